@@ -11,6 +11,11 @@ y_std = 0.01;
 r_std = 0.0;
 
 -- Predict()
+-- hold odometry and apply it with a single Predict before each laser update,
+-- and at most predict_rate times per second in between (0: only before
+-- updates)
+coalesce_odometry = true;
+predict_rate = 0;
 -- trans error from trans model
 k1 = 0.1;
 -- trans error from rotat model
@@ -24,3 +29,39 @@ k4 = 0.1;
 sigma_s = 3.0;
 gamma_pow = -0.5;
 d_short_d_long = 0.2;
+-- "beam" raycasts every beam of the scan for every particle; "line" extracts
+-- line features from the scan once per update and matches them against the
+-- map lines near each particle, which costs the same for any number of beams
+observation_model = "beam";
+-- features are split at this distance from the points and at gaps wider
+-- than line_max_gap, and shorter ones are dropped (m)
+line_max_error = 0.03;
+line_max_gap = 0.25;
+line_min_length = 0.3;
+-- residuals of the feature angle (rad) and midpoint offset (m)
+line_angle_std = 0.05;
+line_offset_std = 0.1;
+-- features matching no map line within this many stds are outliers
+line_max_residual = 3.0;
+
+-- Map
+-- cell size of the grid used to look up map lines near the particles
+map_grid_cell_size = 1.0;
+
+-- GlobalLocalize()
+-- distance field used to score poses
+likelihood_field_resolution = 0.05;
+likelihood_field_max_dist = 1.0;
+-- number of beams of the scan used
+global_loc_num_beams = 60;
+global_loc_sigma = 0.1;
+-- candidate poses are at least this far from any wall
+global_loc_min_clearance = 0.2;
+global_loc_coarse_xy_step = 0.5;
+global_loc_coarse_angle_step = M_PI / 18.0;
+global_loc_fine_xy_step = 0.05;
+-- hypotheses kept at each level of the search
+global_loc_num_hypotheses = 256;
+-- particles are seeded around at most this many distinct poses
+global_loc_num_modes = 4;
+global_loc_mode_separation = 1.0;
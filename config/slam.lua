@@ -3,6 +3,24 @@ min_trans_diff_between_nodes = 1;
 -- min_trans_diff_between_nodes = M_PI / 6.0;
 min_angle_diff_between_nodes = 3.14 / 6.0;
 
+-- adaptive keyframe selection -------------------------
+-- when enabled, the thresholds above only apply to the first node; afterwards
+-- a scan becomes a node when enough of it is new w.r.t. the previous node.
+adaptive_keyframes = true
+-- a scan is only evaluated once the robot moved / turned at least this much
+-- since the last node, and since the last rejected scan
+keyframe_min_trans_diff = 0.3
+keyframe_min_angle_diff = 3.14 / 18.0
+-- always add a node after this distance, to keep successive nodes matchable
+keyframe_max_trans_diff = 2.5
+-- voxel size used to downsample scans for the overlap test
+keyframe_voxel_size = 0.15
+-- minimum fraction of unseen voxels for a scan to become a node
+keyframe_min_novelty = 0.3
+-- at most this many nodes within keyframe_density_radius of the robot
+keyframe_density_radius = 1.0
+keyframe_max_nodes_per_area = 3
+
 -- Motion Model --------------------------------
 -- this is for odometry constraints
 motion_model_trans_err_from_trans = 0.4;
@@ -18,11 +36,51 @@ new_node_theta_std = 1.0;
 non_successive_scan_constraints = true
 max_factors_per_node = 15
 maximum_node_dis_scan_comparison = 5.0
+-- widen maximum_node_dis_scan_comparison by this many standard deviations of
+-- the relative position uncertainty of two nodes (0 disables, online only)
+loop_closure_gate_sigmas = 2.0
+-- upper bound on that extra distance
+loop_closure_max_gate_margin = 3.0
 initial_node_global_x = -26
 initial_node_global_y = 8
 initial_node_global_theta = 1.6
+-- prior std of the nodes loaded with --pose_graph_file; they are held
+-- (almost) fixed while the new session is optimized
+frozen_node_xy_std = 0.01
+frozen_node_theta_std = 0.005
 
 runOnline = false
 runOffline = true
+-- seconds between intermediate estimates of the offline optimization,
+-- shown while it runs (0: none)
+offline_preview_interval = 5.0
+-- seconds between offline optimization checkpoints (0: only when it is
+-- done or interrupted); see --offline_checkpoint_file
+offline_checkpoint_interval = 30.0
+
+-- Localization only ------------------------------------
+-- localize against a map built earlier (--pose_graph_file) instead of
+-- mapping; its keyframes are never modified
+localization_only = false
+-- match each scan against this many nearest keyframes
+localization_num_keyframes = 3
+localization_max_keyframe_dist = 4.0
+-- CSM search window around the odometry prediction
+localization_trans_window = 0.3
+localization_rot_window = 3.14 / 36.0
+-- localize a scan once the robot moved / turned this much
+localization_min_trans_diff = 0.1
+localization_min_angle_diff = 3.14 / 36.0
+-- number of recent poses optimized together
+localization_window_size = 10
+-- prior on the oldest pose in the window
+localization_anchor_xy_std = 0.1
+localization_anchor_theta_std = 0.05
+-- keyframe cost tables kept in memory. A table covers the extent of its
+-- keyframe scan at the 3 cm matcher resolution, 8 bytes per cell: up to
+-- (2 * 30 m / 0.03 m)^2 * 8 bytes = 32 MB and ~0.6 s to build for scans
+-- that reach the full scanner range, ~0.6 MB and a few ms for a 4 m room.
+-- Worst case 6 * 32 MB = 192 MB, charged to slam/cost_tables.
+localization_cost_table_cache_size = 6
 fix_mean = false -- use odom 
 fix_covariance = true -- diagonal covariance
\ No newline at end of file
@@ -0,0 +1,318 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    micro_benchmark_main.cc
+\brief   Micro-benchmarks of the geometry, map and search hot paths, on a
+         real vector map and synthetic scans taken in it. Results are
+         written as CSV, one row per benchmark.
+*/
+//========================================================================
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+#include "gflags/gflags.h"
+#include "ros/package.h"
+
+#include "navigation/simple_queue.h"
+#include "shared/math/line2d.h"
+#include "shared/util/random.h"
+#include "shared/util/timer.h"
+#include "slam/CorrelativeScanMatcher.h"
+#include "vector_map/vector_map.h"
+
+using Eigen::Vector2f;
+using geometry::line2f;
+using std::string;
+using std::vector;
+using vector_map::VectorMap;
+
+DEFINE_string(map, "GDC1", "Name of the map to benchmark on");
+DEFINE_string(map_file, "", "Vector map file, overrides --map");
+DEFINE_string(output, "", "File to write the results to, stdout if empty");
+DEFINE_string(filter, "", "Only run benchmarks whose name contains this");
+DEFINE_double(min_time, 0.2, "Seconds each repetition runs for, at least");
+DEFINE_int32(repetitions, 5, "Repetitions of each benchmark");
+DEFINE_int32(seed, 1, "Seed of the synthetic inputs");
+
+namespace {
+
+// Laser geometry of the synthetic scans.
+const float kRangeMin = 0.02;
+const float kRangeMax = 10;
+const float kAngleMin = -2.35619;
+const float kAngleMax = 2.35619;
+const int kNumRays = 1081;
+const float kRangeNoise = 0.01;
+
+// Number of precomputed inputs each benchmark cycles through.
+const int kNumPoses = 64;
+const int kNumSegments = 4096;
+
+// Results are folded into this, so that the compiler cannot drop the
+// benchmarked calls.
+volatile double sink = 0;
+
+struct Result {
+  string name;
+  int64_t iterations;
+  double median_ns;
+  double min_ns;
+};
+
+// A synthetic scan, in the frame of the laser at loc.
+struct Scan {
+  Vector2f loc;
+  float angle;
+  vector<Vector2f> points;
+};
+
+struct Inputs {
+  VectorMap map;
+  vector<Scan> scans;
+  // Map lines against beams of the scans.
+  vector<line2f> segments_a;
+  vector<line2f> segments_b;
+  // Pairs of lines visible from the same scan location.
+  vector<Vector2f> occlusion_locs;
+  vector<line2f> occluders;
+  vector<line2f> occluded;
+};
+
+// Runs op(i) for increasing i, first to find how many iterations last
+// --min_time seconds, then --repetitions times that many, and reports the
+// time per iteration. op returns a value that is folded into sink.
+template <typename Op>
+Result Measure(const string& name, Op op) {
+  int64_t i = 0;
+  double total = 0;
+  auto run_batch = [&](int64_t n) {
+    const double t_start = GetMonotonicTime();
+    for (int64_t end = i + n; i < end; ++i) {
+      total += op(i);
+    }
+    return GetMonotonicTime() - t_start;
+  };
+  int64_t iterations = 1;
+  for (double t = run_batch(1); t < 0.1 * FLAGS_min_time;
+       t = run_batch(iterations)) {
+    iterations *= 2;
+  }
+  iterations = std::max<int64_t>(1,
+      iterations * FLAGS_min_time / std::max(1e-9, run_batch(iterations)));
+  vector<double> times;
+  for (int r = 0; r < FLAGS_repetitions; ++r) {
+    times.push_back(1e9 * run_batch(iterations) / iterations);
+  }
+  sink = sink + total;
+  std::sort(times.begin(), times.end());
+  Result result;
+  result.name = name;
+  result.iterations = iterations;
+  result.median_ns = times[times.size() / 2];
+  result.min_ns = times[0];
+  return result;
+}
+
+bool LoadInputs(const string& map_file, Inputs* inputs) {
+  VectorMap& map = inputs->map;
+  map.Load(map_file);
+  if (map.lines.empty()) {
+    fprintf(stderr, "No lines in %s\n", map_file.c_str());
+    return false;
+  }
+  Vector2f map_min = map.lines[0].p0;
+  Vector2f map_max = map_min;
+  for (const line2f& l : map.lines) {
+    map_min = map_min.cwiseMin(l.p0).cwiseMin(l.p1);
+    map_max = map_max.cwiseMax(l.p0).cwiseMax(l.p1);
+  }
+
+  // Scans from random poses, keeping those that see the map with most of
+  // their beams, i.e. that are likely to be inside the building.
+  util_random::Random rng(FLAGS_seed);
+  vector<float> ranges;
+  for (int tries = 0; tries < 100 * kNumPoses; ++tries) {
+    if (static_cast<int>(inputs->scans.size()) == kNumPoses) break;
+    Scan scan;
+    scan.loc = Vector2f(rng.UniformRandom(map_min.x(), map_max.x()),
+                        rng.UniformRandom(map_min.y(), map_max.y()));
+    scan.angle = rng.UniformRandom(-M_PI, M_PI);
+    map.GetPredictedScan(scan.loc, kRangeMin, kRangeMax,
+                         scan.angle + kAngleMin, scan.angle + kAngleMax,
+                         kNumRays, &ranges);
+    const float da = (kAngleMax - kAngleMin) / kNumRays;
+    for (int i = 0; i < kNumRays; ++i) {
+      if (ranges[i] >= kRangeMax) continue;
+      const float a = kAngleMin + i * da;
+      const float r = ranges[i] + rng.Gaussian(0, kRangeNoise);
+      scan.points.push_back(r * Vector2f(cos(a), sin(a)));
+    }
+    if (static_cast<int>(scan.points.size()) > kNumRays / 2) {
+      inputs->scans.push_back(scan);
+    }
+  }
+  if (inputs->scans.empty()) {
+    fprintf(stderr, "Found no pose that sees %s\n", map_file.c_str());
+    return false;
+  }
+
+  vector<line2f> scene_lines;
+  for (int i = 0; i < kNumSegments; ++i) {
+    const Scan& scan = inputs->scans[i % inputs->scans.size()];
+    const float a = scan.angle + rng.UniformRandom(kAngleMin, kAngleMax);
+    inputs->segments_a.push_back(
+        map.lines[rng.RandomInt<size_t>(0, map.lines.size() - 1)]);
+    inputs->segments_b.push_back(
+        line2f(scan.loc, scan.loc + kRangeMax * Vector2f(cos(a), sin(a))));
+    map.GetSceneLines(scan.loc, kRangeMax, &scene_lines);
+    if (scene_lines.size() < 2) continue;
+    const size_t j = rng.RandomInt<size_t>(0, scene_lines.size() - 1);
+    const size_t k = rng.RandomInt<size_t>(0, scene_lines.size() - 1);
+    if (j == k) continue;
+    inputs->occlusion_locs.push_back(scan.loc);
+    inputs->occluders.push_back(scene_lines[j]);
+    inputs->occluded.push_back(scene_lines[k]);
+  }
+  return !inputs->occluders.empty();
+}
+
+// Measures the benchmarks selected by --filter, and prints their progress.
+struct Suite {
+  template <typename Op>
+  void Run(const string& name, Op op) {
+    if (name.find(FLAGS_filter) == string::npos) return;
+    results.push_back(Measure(name, op));
+    fprintf(stderr, "%-28s %12.1f ns\n", name.c_str(),
+            results.back().median_ns);
+  }
+  vector<Result> results;
+};
+
+vector<Result> RunAll(Inputs* inputs) {
+  Suite suite;
+  VectorMap& map = inputs->map;
+  const vector<Scan>& scans = inputs->scans;
+  const size_t num_segments = inputs->segments_a.size();
+  const size_t num_occlusions = inputs->occluders.size();
+
+  suite.Run("Line2f::Intersects", [&](int64_t i) {
+    const size_t j = i % num_segments;
+    return inputs->segments_a[j].Intersects(inputs->segments_b[j]) ? 1.0 : 0;
+  });
+  suite.Run("Line2f::Intersection", [&](int64_t i) {
+    const size_t j = i % num_segments;
+    Vector2f p(0, 0);
+    inputs->segments_a[j].Intersection(inputs->segments_b[j], &p);
+    return p.x();
+  });
+  vector<line2f> trimmed;
+  suite.Run("TrimOcclusion", [&](int64_t i) {
+    const size_t j = i % num_occlusions;
+    line2f occluded = inputs->occluded[j];
+    trimmed.clear();
+    vector_map::TrimOcclusion(inputs->occlusion_locs[j],
+                              inputs->occluders[j],
+                              &occluded,
+                              &trimmed);
+    return occluded.p0.x() + trimmed.size();
+  });
+  vector<line2f> render;
+  suite.Run("VectorMap::SceneRender", [&](int64_t i) {
+    const Scan& scan = scans[i % scans.size()];
+    map.SceneRender(scan.loc, kRangeMax, scan.angle + kAngleMin,
+                    scan.angle + kAngleMax, &render);
+    return render.size();
+  });
+  vector<float> ranges;
+  suite.Run("VectorMap::GetPredictedScan", [&](int64_t i) {
+    const Scan& scan = scans[i % scans.size()];
+    map.GetPredictedScan(scan.loc, kRangeMin, kRangeMax,
+                         scan.angle + kAngleMin, scan.angle + kAngleMax,
+                         kNumRays, &ranges);
+    return ranges[kNumRays / 2];
+  });
+
+  // Scan matcher cost tables, with the SLAM defaults.
+  const CorrelativeScanMatcher matcher(30, 1, 0.03, 0.1, 0.1, 0.1, 0.1);
+  suite.Run("CostTable::Build", [&](int64_t i) {
+    const Scan& scan = scans[i % scans.size()];
+    return matcher.CostTableFromPointCloud(scan.points).width;
+  });
+  const CostTable cost_table = matcher.CostTableFromPointCloud(
+      scans[0].points);
+  // Another scan of the same map, so that lookups hit and miss like in
+  // matching.
+  const vector<Vector2f>& lookups = scans[scans.size() / 2].points;
+  suite.Run("CostTable::GetPointValue", [&](int64_t i) {
+    return cost_table.GetPointValue(lookups[i % lookups.size()]);
+  });
+
+  // A queue of the size a grid search keeps, with a push and a pop per
+  // iteration.
+  const int kQueueSize = 256;
+  SimpleQueue<uint64_t, float> queue;
+  util_random::Random rng(FLAGS_seed);
+  vector<float> priorities(4096);
+  for (float& p : priorities) p = rng.UniformRandom();
+  for (int i = 0; i < kQueueSize; ++i) {
+    queue.Push(i, priorities[i]);
+  }
+  suite.Run("SimpleQueue::PushPop", [&](int64_t i) {
+    queue.Push(kQueueSize + i, priorities[i % priorities.size()]);
+    return queue.Pop();
+  });
+  return suite.results;
+}
+
+bool WriteResults(const string& file,
+                  const string& map_file,
+                  const vector<Result>& results) {
+  FILE* fid = file.empty() ? stdout : fopen(file.c_str(), "w");
+  if (fid == nullptr) {
+    fprintf(stderr, "Unable to write %s\n", file.c_str());
+    return false;
+  }
+  fprintf(fid, "benchmark,map,iterations,median_ns,min_ns,ops_per_second\n");
+  for (const Result& r : results) {
+    fprintf(fid, "%s,%s,%lld,%.2f,%.2f,%.0f\n",
+            r.name.c_str(), map_file.c_str(),
+            static_cast<long long>(r.iterations),
+            r.median_ns, r.min_ns, 1e9 / r.median_ns);
+  }
+  if (fid != stdout) fclose(fid);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, false);
+  const string map_file = FLAGS_map_file.empty() ?
+      ros::package::getPath("amrl_maps") + "/" + FLAGS_map + "/" + FLAGS_map +
+          ".vectormap.txt" :
+      FLAGS_map_file;
+  Inputs inputs;
+  if (!LoadInputs(map_file, &inputs)) return 1;
+  fprintf(stderr, "%s: %d lines, %d scans\n", map_file.c_str(),
+          static_cast<int>(inputs.map.lines.size()),
+          static_cast<int>(inputs.scans.size()));
+  return WriteResults(FLAGS_output, map_file, RunAll(&inputs)) ? 0 : 1;
+}
@@ -1,58 +1,49 @@
-
 #include <ros/ros.h>
 #include "gflags/gflags.h"
 #include <std_msgs/Empty.h>
-#include <mutex>
-#include <condition_variable>
+#include <std_msgs/String.h>
 #include <signal.h>
 
 DEFINE_string(stopSlam_topic, "/stop_slam", "Name of ROS topic for stop slam");
+DEFINE_double(timeout, 0,
+              "Seconds to wait for the offline optimization to finish; "
+              "forever if 0");
 
-
-// std::mutex reoptimization_done_mutex_;
-// std::condition_variable reoptimization_done_cv_;
-// bool dpg_ready_ = false;
 bool run_ = true;
+bool stopSlam_complete_ = false;
 
 ros::Publisher stopSlam_pub_;
 
-// void ReoptimizationCompleteCallback(const std_msgs::Empty &empty_msg) {
-//     {
-//         std::lock_guard<std::mutex> lk(reoptimization_done_mutex_);
-//         dpg_ready_ = true;
-//     }
-//     reoptimization_done_cv_.notify_one();
-// }
-
+void StopSlamCompleteCallback(const std_msgs::Empty &empty_msg) {
+    stopSlam_complete_ = true;
+}
 
+void OfflineProgressCallback(const std_msgs::String &msg) {
+    ROS_INFO_STREAM(msg.data);
+}
 
 void sendStopSlam() {
     ROS_INFO_STREAM("Sending StopSlam");
     stopSlam_pub_.publish(std_msgs::Empty());
 }
 
-
-
-// void SignalHandler(int) {
-//     if (!run_) {
-//         printf("Force Exit.\n");
-//         exit(0);
-//     }
-//     {
-//         std::lock_guard<std::mutex> lk(reoptimization_done_mutex_);
-//         dpg_ready_ = true;
-//     }
-//     reoptimization_done_cv_.notify_one();
-//     printf("Exiting.\n");
-//     run_ = false;
-// }
+void SignalHandler(int) {
+    if (!run_) {
+        printf("Force Exit.\n");
+        exit(0);
+    }
+    // SLAM keeps optimizing; only stop waiting for it.
+    printf("Exiting.\n");
+    run_ = false;
+}
 
 int main(int argc, char** argv) {
     google::ParseCommandLineFlags(&argc, &argv, false);
-    // signal(SIGINT, SignalHandler);
+    signal(SIGINT, SignalHandler);
 
     // Initialize ROS.
-    ros::init(argc, argv, "stopSlam_controller");
+    ros::init(argc, argv, "stopSlam_controller",
+              ros::init_options::NoSigintHandler);
     ros::NodeHandle n;
 
 
@@ -62,21 +53,29 @@ int main(int argc, char** argv) {
         ros::Duration(0.1).sleep();
     }
 
-    // ros::Subscriber optimization_done_sub = n.subscribe(
-    //         "reoptimization_complete",
-    //         1,
-    //         ReoptimizationCompleteCallback);
+    ros::Subscriber complete_sub = n.subscribe(
+            "stopSlamComplete",
+            1,
+            StopSlamCompleteCallback);
+    ros::Subscriber progress_sub = n.subscribe(
+            "slam_offline_progress",
+            1,
+            OfflineProgressCallback);
 
-    ros::AsyncSpinner spinner(2); // TODO do we need this to be this high?
-    spinner.start();
     sendStopSlam();
-    // if (run_mit) {
-    //     ROS_INFO_STREAM("Run on MIT dataset");
-    //     runOnMitRosBags();
-    // } else {
-    //     ROS_INFO_STREAM("Run on GDC dataset");
-    //     runOnGdcRosBags();
-    // }
+    const ros::WallTime t_start = ros::WallTime::now();
+    while (ros::ok() && run_ && !stopSlam_complete_) {
+        if (FLAGS_timeout > 0 &&
+            (ros::WallTime::now() - t_start).toSec() > FLAGS_timeout) {
+            ROS_ERROR_STREAM("Timed out waiting for SLAM to finish");
+            return 1;
+        }
+        ros::spinOnce();
+        ros::Duration(0.05).sleep();
+    }
+    if (stopSlam_complete_) {
+        ROS_INFO_STREAM("SLAM optimization complete");
+    }
 
-    return 0;
+    return stopSlam_complete_ ? 0 : 1;
 }
@@ -0,0 +1,154 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    local_costmap.cc
+\brief   Robot-centric rolling obstacle grid for local planning.
+*/
+//========================================================================
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#include "shared/math/distance_transform.h"
+#include "navigation/local_costmap.h"
+
+using Eigen::Vector2f;
+using std::vector;
+
+namespace {
+const float kInf = std::numeric_limits<float>::infinity();
+}  // namespace
+
+namespace navigation {
+
+LocalCostmap::LocalCostmap(const LocalCostmapOptions& options) :
+    options_(options),
+    size_(std::max(1, static_cast<int>(
+        std::ceil(options.size / options.resolution)))),
+    min_x_(0),
+    min_y_(0),
+    initialized_(false),
+    time_origin_(0),
+    last_seen_(size_ * size_, -kInf),
+    distance_(size_ * size_, options.max_distance) {}
+
+void LocalCostmap::MoveWindow(int min_x, int min_y) {
+  const int dx = min_x - min_x_;
+  const int dy = min_y - min_y_;
+  if (std::abs(dx) >= size_ || std::abs(dy) >= size_) {
+    std::fill(last_seen_.begin(), last_seen_.end(), -kInf);
+  } else {
+    // Clear the columns and rows the window enters; they still hold the
+    // cells that wrapped around from the side it leaves.
+    const int x0 = (dx > 0) ? min_x_ + size_ : min_x;
+    const int x1 = (dx > 0) ? min_x + size_ : min_x_;
+    for (int x = x0; x < x1; ++x) {
+      for (int y = 0; y < size_; ++y) {
+        last_seen_[StorageIndex(x, y)] = -kInf;
+      }
+    }
+    const int y0 = (dy > 0) ? min_y_ + size_ : min_y;
+    const int y1 = (dy > 0) ? min_y + size_ : min_y_;
+    for (int y = y0; y < y1; ++y) {
+      for (int x = 0; x < size_; ++x) {
+        last_seen_[StorageIndex(x, y)] = -kInf;
+      }
+    }
+  }
+  min_x_ = min_x;
+  min_y_ = min_y;
+}
+
+void LocalCostmap::ClearRay(const Vector2f& p0, const Vector2f& p1) {
+  // Grid traversal (Amanatides & Woo), in units of cells.
+  const Vector2f a = p0 / options_.resolution;
+  const Vector2f b = p1 / options_.resolution;
+  int x = std::floor(a.x());
+  int y = std::floor(a.y());
+  const int x_end = std::floor(b.x());
+  const int y_end = std::floor(b.y());
+  const Vector2f dir = b - a;
+  const int step_x = (dir.x() > 0) ? 1 : -1;
+  const int step_y = (dir.y() > 0) ? 1 : -1;
+  const float t_delta_x = (dir.x() != 0) ? 1 / std::fabs(dir.x()) : kInf;
+  const float t_delta_y = (dir.y() != 0) ? 1 / std::fabs(dir.y()) : kInf;
+  float t_max_x = (dir.x() != 0) ?
+      ((step_x > 0) ? (x + 1 - a.x()) : (a.x() - x)) * t_delta_x : kInf;
+  float t_max_y = (dir.y() != 0) ?
+      ((step_y > 0) ? (y + 1 - a.y()) : (a.y() - y)) * t_delta_y : kInf;
+  const int num_cells = std::abs(x_end - x) + std::abs(y_end - y);
+  for (int i = 0; i < num_cells; ++i) {
+    if (x < min_x_ || y < min_y_ ||
+        x >= min_x_ + size_ || y >= min_y_ + size_) {
+      // The ray starts inside the window, so it has left it for good.
+      return;
+    }
+    last_seen_[StorageIndex(x, y)] = -kInf;
+    if (t_max_x < t_max_y) {
+      t_max_x += t_delta_x;
+      x += step_x;
+    } else {
+      t_max_y += t_delta_y;
+      y += step_y;
+    }
+  }
+}
+
+void LocalCostmap::UpdateDistances(float now) {
+  for (int y = 0; y < size_; ++y) {
+    for (int x = 0; x < size_; ++x) {
+      const float t = last_seen_[StorageIndex(min_x_ + x, min_y_ + y)];
+      distance_[y * size_ + x] = (now - t <= options_.memory) ? 0 : kInf;
+    }
+  }
+  distance_transform::SquaredEuclidean(&distance_, size_, size_);
+  for (float& d : distance_) {
+    d = std::min(options_.max_distance, options_.resolution * std::sqrt(d));
+  }
+}
+
+void LocalCostmap::Update(const Vector2f& robot_loc,
+                          const Vector2f& sensor_loc,
+                          const vector<Vector2f>& points,
+                          double time) {
+  if (!initialized_) {
+    time_origin_ = time;
+    initialized_ = true;
+  }
+  const float now = time - time_origin_;
+  MoveWindow(std::floor(robot_loc.x() / options_.resolution) - size_ / 2,
+             std::floor(robot_loc.y() / options_.resolution) - size_ / 2);
+  // Clear all beams before marking any endpoint, so that a beam does not
+  // erase an obstacle that another one of the same scan hit.
+  for (const Vector2f& p : points) {
+    ClearRay(sensor_loc, p);
+  }
+  for (const Vector2f& p : points) {
+    const int x = std::floor(p.x() / options_.resolution);
+    const int y = std::floor(p.y() / options_.resolution);
+    if (x >= min_x_ && y >= min_y_ &&
+        x < min_x_ + size_ && y < min_y_ + size_) {
+      last_seen_[StorageIndex(x, y)] = now;
+    }
+  }
+  UpdateDistances(now);
+}
+
+}  // namespace navigation
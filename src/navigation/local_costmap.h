@@ -0,0 +1,135 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    local_costmap.h
+\brief   Robot-centric rolling obstacle grid for local planning.
+*/
+//========================================================================
+
+#include <cmath>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#ifndef LOCAL_COSTMAP_H
+#define LOCAL_COSTMAP_H
+
+namespace navigation {
+
+struct LocalCostmapOptions {
+  LocalCostmapOptions() :
+      resolution(0.05),
+      size(10),
+      memory(3),
+      max_distance(1) {}
+  // Cell size, in meters.
+  float resolution;
+  // Side of the square window around the robot, in meters.
+  float size;
+  // Seconds an obstacle is remembered after it was last observed, unless a
+  // later scan sees through it.
+  float memory;
+  // Distances to obstacles are capped at this.
+  float max_distance;
+};
+
+// Obstacles seen around the robot, in a square window of the odometry frame
+// that follows it. Each scan marks the cells of its endpoints as occupied and
+// clears the cells its beams pass through, so obstacles out of view (e.g. in
+// a lidar blind spot) are remembered for a while, and then forgotten. After
+// every update the distance from each cell to the nearest obstacle is
+// available in constant time.
+class LocalCostmap {
+ public:
+  LocalCostmap() : LocalCostmap(LocalCostmapOptions()) {}
+  explicit LocalCostmap(const LocalCostmapOptions& options);
+
+  // Integrates a scan taken from sensor_loc (odom frame) at time, with its
+  // points in the odom frame; robot_loc is where the window is centered.
+  void Update(const Eigen::Vector2f& robot_loc,
+              const Eigen::Vector2f& sensor_loc,
+              const std::vector<Eigen::Vector2f>& points,
+              double time);
+
+  // Distance from p (odom frame) to the nearest obstacle, capped at
+  // max_distance. Points outside the window are reported free.
+  float Distance(const Eigen::Vector2f& p) const {
+    int i;
+    if (!CellIndex(p, &i)) return options_.max_distance;
+    return distance_[i];
+  }
+
+  bool Occupied(const Eigen::Vector2f& p) const {
+    int i;
+    return CellIndex(p, &i) && distance_[i] == 0;
+  }
+
+  bool InWindow(const Eigen::Vector2f& p) const {
+    int i;
+    return CellIndex(p, &i);
+  }
+
+  const LocalCostmapOptions& options() const { return options_; }
+
+ private:
+  // Index of the cell of p in distance_, which is laid out row-major from
+  // the window's lower left corner. Returns false outside the window.
+  bool CellIndex(const Eigen::Vector2f& p, int* i) const {
+    const int x = static_cast<int>(std::floor(p.x() / options_.resolution)) -
+        min_x_;
+    const int y = static_cast<int>(std::floor(p.y() / options_.resolution)) -
+        min_y_;
+    if (x < 0 || y < 0 || x >= size_ || y >= size_) return false;
+    *i = y * size_ + x;
+    return true;
+  }
+
+  // last_seen_ is a torus: cell (x, y) of the odom frame is stored at
+  // (x mod size_, y mod size_), so moving the window only clears the rows
+  // and columns it enters.
+  int StorageIndex(int x, int y) const {
+    x %= size_;
+    y %= size_;
+    if (x < 0) x += size_;
+    if (y < 0) y += size_;
+    return y * size_ + x;
+  }
+
+  // Moves the window so that its lower left cell is (min_x, min_y).
+  void MoveWindow(int min_x, int min_y);
+
+  // Clears the cells the segment p0-p1 passes through, except that of p1.
+  void ClearRay(const Eigen::Vector2f& p0, const Eigen::Vector2f& p1);
+
+  void UpdateDistances(float now);
+
+  LocalCostmapOptions options_;
+  // Cells along a side of the window.
+  int size_;
+  // Lower left cell of the window, in odom frame cells.
+  int min_x_;
+  int min_y_;
+  bool initialized_;
+  // Time of the first update; times are stored relative to it.
+  double time_origin_;
+  // Per cell, when it was last observed occupied, -inf if never or cleared.
+  std::vector<float> last_seen_;
+  // Distance to the nearest obstacle, in the window's row-major order.
+  std::vector<float> distance_;
+};
+
+}  // namespace navigation
+
+#endif  // LOCAL_COSTMAP_H
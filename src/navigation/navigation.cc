@@ -19,6 +19,11 @@
 */
 //========================================================================
 
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <thread>
+
 #include "gflags/gflags.h"
 #include "eigen3/Eigen/Dense"
 #include "eigen3/Eigen/Geometry"
@@ -28,7 +33,12 @@
 #include "glog/logging.h"
 #include "ros/ros.h"
 #include "ros/package.h"
+#include "shared/math/fast_math.h"
+#include "shared/math/geometry.h"
+#include "shared/math/line_extraction.h"
 #include "shared/math/math_util.h"
+#include "shared/math/poses_2d.h"
+#include "shared/util/runtime_config.h"
 #include "shared/util/timer.h"
 #include "shared/ros/ros_helpers.h"
 #include "navigation.h"
@@ -43,6 +53,37 @@ using std::vector;
 using namespace math_util;
 using namespace ros_helpers;
 
+DEFINE_bool(use_costmap, false,
+            "Plan on a local costmap accumulated over recent scans, instead "
+            "of the latest point cloud");
+DEFINE_double(costmap_resolution, 0.05, "Local costmap cell size (m)");
+DEFINE_double(costmap_size, 10, "Local costmap window side (m)");
+DEFINE_double(costmap_memory, 3,
+              "Seconds the local costmap remembers unobserved obstacles");
+DEFINE_string(chassis, "ut_car", "Car to plan for: ut_car or f1tenth");
+DEFINE_bool(use_scan_segments, false,
+            "Plan on line segments extracted from the latest scan, instead "
+            "of its points");
+DEFINE_double(scan_segment_max_error, 0.03,
+              "Largest distance of a scan point from its segment (m); the "
+              "car is grown by this when planning on segments");
+DEFINE_double(scan_segment_max_gap, 0.25,
+              "Scan points farther apart than this are not joined (m)");
+DEFINE_bool(use_map_prior, false,
+            "Also keep paths clear of the walls of the vector map, at the "
+            "localized pose");
+DEFINE_bool(adaptive_curvatures, false,
+            "Sample the curvatures coarse to fine around the best paths, "
+            "instead of a fixed uniform set");
+DEFINE_int32(curvature_coarse_samples, 9,
+             "Uniformly spaced curvatures evaluated first by the adaptive "
+             "sampler");
+DEFINE_int32(curvature_budget, 25,
+             "Paths the adaptive sampler evaluates per cycle at most");
+DEFINE_double(curvature_resolution, 0.01,
+              "Finest curvature spacing of the adaptive sampler (1/m)");
+DECLARE_int32(v);
+
 namespace {
 ros::Publisher drive_pub_;
 ros::Publisher viz_pub_;
@@ -51,6 +92,244 @@ VisualizationMsg global_viz_msg_;
 AckermannCurvatureDriveMsg drive_msg_;
 // Epsilon value for handling limited numerical precision.
 const float kEpsilon = 1e-5;
+// Location of the laser on the robot.
+const Vector2f kLaserLoc(0.2, 0);
+// Longest free path length considered.
+const float kMaxFreePathLength = 10.0;
+// Curvatures sampled by the planner.
+const int kNumCurvatures = 10;
+// Best curvatures the adaptive sampler refines around, besides the previous
+// choice.
+const int kNumRefinedCurvatures = 2;
+// Commands the latency compensation accounts for.
+const size_t kLatencyQueueSize = 3;
+// How often the pipeline threads check for new input, in seconds.
+const double kPipelinePollInterval = 0.001;
+// Plans older than this (in seconds) are not followed, the car stops.
+const double kPlanTimeout = 0.25;
+// Cell size of the index over the map walls (m).
+const float kMapGridCellSize = 1.0;
+// Precision of the free path lengths against map walls (m).
+const float kMapFreePathTolerance = 1e-3;
+// Walls farther than this from the path do not count for the clearance (m).
+const float kMaxClearance = 3;
+
+line_extraction::LineExtractionOptions LineExtractionOptionsFromFlags() {
+  line_extraction::LineExtractionOptions options;
+  options.max_error = FLAGS_scan_segment_max_error;
+  options.max_gap = FLAGS_scan_segment_max_gap;
+  return options;
+}
+
+navigation::LocalCostmapOptions CostmapOptionsFromFlags() {
+  navigation::LocalCostmapOptions options;
+  options.resolution = FLAGS_costmap_resolution;
+  options.size = FLAGS_costmap_size;
+  options.memory = FLAGS_costmap_memory;
+  return options;
+}
+
+// The car's footprint, with the safety margin, covered by circles centered on
+// its x axis: they are cheap to test against a distance field.
+template <typename Chassis>
+void GetFootprintCircles(vector<float>* centers, float* radius) {
+  typedef navigation::VehicleModel<Chassis> Model;
+  const float half_width = Model::HalfWidth();
+  const float front = Model::Front();
+  const float rear = Model::Rear();
+  const int n = std::ceil((front - rear) / half_width);
+  const float spacing = (front - rear) / n;
+  centers->resize(n);
+  for (int i = 0; i < n; ++i) {
+    (*centers)[i] = rear + spacing * (i + 0.5);
+  }
+  *radius = std::sqrt(Sq(half_width) + Sq(spacing / 2));
+}
+
+// Adds a cloud seen from base_link at the given odometry pose to the costmap.
+void IntegrateScan(const vector<Vector2f>& cloud,
+                   const Vector2f& odom_loc,
+                   float odom_angle,
+                   double time,
+                   navigation::LocalCostmap* costmap) {
+  const Eigen::Rotation2Df R_base2odom(odom_angle);
+  vector<Vector2f> odom_cloud(cloud.size());
+  for (size_t i = 0; i < cloud.size(); ++i) {
+    odom_cloud[i] = R_base2odom * cloud[i] + odom_loc;
+  }
+  costmap->Update(odom_loc, R_base2odom * kLaserLoc + odom_loc, odom_cloud, time);
+}
+
+// Grows [box_min, box_max] to contain the arc of the circle around center
+// with the given radius, from angle start counterclockwise by sweep.
+void AddArcToBox(const Vector2f& center,
+                 float radius,
+                 float start,
+                 float sweep,
+                 Vector2f* box_min,
+                 Vector2f* box_max) {
+  const auto add = [&](float angle) {
+    const Vector2f p = center + radius * geometry::Heading(angle);
+    *box_min = box_min->cwiseMin(p);
+    *box_max = box_max->cwiseMax(p);
+  };
+  add(start);
+  add(start + sweep);
+  // The extreme points along the axes that the arc passes.
+  for (int i = 0; i < 4; ++i) {
+    const float axis = i * M_PI_2;
+    float angle = std::fmod(axis - start, 2 * M_PI);
+    if (angle < 0) angle += 2 * M_PI;
+    if (angle <= sweep) add(axis);
+  }
+}
+
+// Minimum distance between the wall and the arc of the circle around
+// center, from angle start counterclockwise by sweep, which may exceed a
+// full turn.
+float WallArcDistance(const geometry::line2f& wall,
+                      const Vector2f& center,
+                      float radius,
+                      float start,
+                      float sweep) {
+  // MinDistanceLineArc takes arcs of less than a full turn.
+  if (sweep > M_PI) {
+    const float half = 0.5 * std::min<float>(sweep, 2 * M_PI);
+    return std::min(
+        geometry::MinDistanceLineArc(
+            wall.p0, wall.p1, center, radius, start, start + half, 1),
+        geometry::MinDistanceLineArc(
+            wall.p0, wall.p1, center, radius, start + half, start + 2 * half, 1));
+  }
+  return geometry::MinDistanceLineArc(
+      wall.p0, wall.p1, center, radius, start, start + sweep, 1);
+}
+
+// Clearance of the path of base_link, driving free_path_len along an arc
+// with the given curvature, from the lines, which are mirrored across the x
+// axis for right turns. Lines farther than kMaxClearance are ignored.
+float LinesClearance(const vector<geometry::line2f>& lines,
+                     float free_path_len,
+                     float curvature) {
+  float min_clearance = 10.0;
+  const bool straight = std::abs(curvature) < kEpsilon;
+  const float r = straight ? 0 : 1.0 / std::abs(curvature);
+  for (const geometry::line2f& line : lines) {
+    const float clearance = straight ?
+        geometry::MinDistanceLineLine(
+            line.p0, line.p1, Vector2f(0, 0), Vector2f(free_path_len, 0)) :
+        WallArcDistance(line, Vector2f(0, r), r, -M_PI_2, free_path_len / r);
+    if (clearance <= kMaxClearance) {
+      min_clearance = std::min(min_clearance, clearance);
+    }
+  }
+  return min_clearance;
+}
+
+// The line mirrored across the x axis if sign is negative.
+geometry::line2f MirrorLine(const geometry::line2f& line, float sign) {
+  return geometry::line2f(Vector2f(line.p0.x(), sign * line.p0.y()),
+                          Vector2f(line.p1.x(), sign * line.p1.y()));
+}
+
+// Distance base_link drives straight until the front of the car, given by
+// its half width and front in base_link, hits the segment.
+float StraightSegmentFreePathLength(const geometry::line2f& segment,
+                                    float half_width,
+                                    float front) {
+  float free_path_length = kMaxFreePathLength;
+  // The ends of the segment hitting the front.
+  for (const Vector2f& p : {segment.p0, segment.p1}) {
+    if (std::abs(p.y()) <= half_width && p.x() >= front) {
+      free_path_length = std::min(free_path_length, p.x() - front);
+    }
+  }
+  // The front corners hitting the segment.
+  const Vector2f d = segment.p1 - segment.p0;
+  if (d.y() == 0) return free_path_length;
+  for (const float y : {-half_width, half_width}) {
+    const float t = (y - segment.p0.y()) / d.y();
+    if (t < 0 || t > 1) continue;
+    const float x = segment.p0.x() + t * d.x();
+    if (x >= front) {
+      free_path_length = std::min(free_path_length, x - front);
+    }
+  }
+  return free_path_length;
+}
+
+// Arc length base_link drives turning left around (0, r) until the car,
+// given by its half width and front in base_link, hits the segment. As for
+// points, only what is ahead of base_link is considered, and hit by the
+// front or the inner side. The first contact is either an end of the
+// segment hitting the car, or a corner of the car hitting the segment.
+float TurningSegmentFreePathLength(geometry::line2f segment,
+                                   float r,
+                                   float half_width,
+                                   float front) {
+  // Clip to x >= 0.
+  if (segment.p0.x() < 0 && segment.p1.x() < 0) return kMaxFreePathLength;
+  if (segment.p0.x() < 0 || segment.p1.x() < 0) {
+    const Vector2f& inside = (segment.p0.x() < 0) ? segment.p1 : segment.p0;
+    const Vector2f& outside = (segment.p0.x() < 0) ? segment.p0 : segment.p1;
+    const float t = inside.x() / (inside.x() - outside.x());
+    segment = geometry::line2f(inside, inside + t * (outside - inside));
+  }
+  const float r_min = r - half_width;
+  const float r_1 = std::sqrt(Sq(r_min) + Sq(front));
+  const float r_max = std::sqrt(Sq(r + half_width) + Sq(front));
+  const float r_min_sq = (r_min > 0) ? Sq(r_min) : 0;
+  float free_path_length = kMaxFreePathLength;
+  // The ends of the segment, as in CloudFreePathLength().
+  for (const Vector2f& p : {segment.p0, segment.p1}) {
+    const float r_p_sq = Sq(p.x()) + Sq(r - p.y());
+    if (r_p_sq < r_min_sq || r_p_sq > Sq(r_max)) continue;
+    const float r_p = std::sqrt(r_p_sq);
+    const float theta = fast_math::FastAtan2(p.x(), r - p.y());
+    const float omega = (r_p >= r_1) ?
+        fast_math::FastAsin(front / r_p) :
+        fast_math::FastAcos(r_min / r_p);
+    free_path_length = std::min(free_path_length, (theta - omega) * r);
+  }
+  // The corners of the front and inner side, on circles around the turning
+  // center, with their angles from the direction of base_link.
+  const Vector2f center(0, r);
+  const Vector2f d = segment.p1 - segment.p0;
+  const Vector2f f = segment.p0 - center;
+  const float a = d.squaredNorm();
+  const float corner_radius[3] = {r_min, r_1, r_max};
+  const float corner_angle[3] = {
+      0, std::atan2(front, r_min), std::atan2(front, r + half_width)};
+  for (int i = 0; i < 3; ++i) {
+    if (a == 0 || corner_radius[i] <= 0) continue;
+    const float b = f.dot(d);
+    const float discriminant =
+        Sq(b) - a * (f.squaredNorm() - Sq(corner_radius[i]));
+    if (discriminant < 0) continue;
+    const float root = std::sqrt(discriminant);
+    for (const float t : {(-b - root) / a, (-b + root) / a}) {
+      if (t < 0 || t > 1) continue;
+      const Vector2f q = segment.p0 + t * d;
+      const float phi =
+          fast_math::FastAtan2(q.x(), r - q.y()) - corner_angle[i];
+      if (phi >= 0) {
+        free_path_length = std::min(free_path_length, phi * r);
+      }
+    }
+  }
+  return free_path_length;
+}
+
+// Pose of base_link after driving arc length s with the given curvature.
+void ArcPose(float curvature, float s, Vector2f* loc, float* angle) {
+  if (std::abs(curvature) < kEpsilon) {
+    *loc = Vector2f(s, 0);
+    *angle = 0;
+    return;
+  }
+  *angle = curvature * s;
+  *loc = Vector2f(std::sin(*angle), 1 - std::cos(*angle)) / curvature;
+}
 } //namespace
 
 namespace navigation {
@@ -61,16 +340,30 @@ string GetMapFileFromName(const string& map) {
 }
 
 Navigation::Navigation(const string& map_name, ros::NodeHandle* n) :
+    chassis_(ChassisType::kUtCar),
     odom_initialized_(false),
     localization_initialized_(false),
     robot_loc_(0, 0),
     robot_angle_(0),
     robot_vel_(0, 0),
     robot_omega_(0),
+    costmap_(CostmapOptionsFromFlags()),
+    predicted_loc_(0, 0),
+    predicted_angle_(0),
     nav_complete_(true),
     nav_goal_loc_(0, 0),
-    nav_goal_angle_(0) {
+    nav_goal_angle_(0),
+    map_from_odom_valid_(false),
+    previous_curvature_(0),
+    cycle_dt_(dt),
+    pipeline_running_(false),
+    control_monitor_(dt) {
+  if (!ParseChassisType(FLAGS_chassis, &chassis_)) {
+    LOG(FATAL) << "Unknown chassis: " << FLAGS_chassis;
+  }
   map_.Load(GetMapFileFromName(map_name));
+  map_grid_.Build(map_.lines, kMapGridCellSize);
+  callback_odom_ = OdometryInput{Vector2f(0, 0), 0, Vector2f(0, 0), 0};
   drive_pub_ = n->advertise<AckermannCurvatureDriveMsg>(
       "ackermann_curvature_drive", 1);
   viz_pub_ = n->advertise<VisualizationMsg>("visualization", 1);
@@ -81,10 +374,26 @@ Navigation::Navigation(const string& map_name, ros::NodeHandle* n) :
   InitRosHeader("base_link", &drive_msg_.header);
 }
 
+Navigation::~Navigation() {
+  StopPipeline();
+}
+
 void Navigation::SetNavGoal(const Vector2f& loc, float angle) {
 }
 
 void Navigation::UpdateLocation(const Eigen::Vector2f& loc, float angle) {
+  // Relate the map to the odometry frame the planner works in.
+  const pose_2d::Pose2Df odom_pose = pipeline_running_ ?
+      pose_2d::Pose2Df(callback_odom_.angle, callback_odom_.loc) :
+      pose_2d::Pose2Df(odom_angle_, odom_loc_);
+  const pose_2d::Pose2Df map_from_odom = pose_2d::Compose(
+      pose_2d::Pose2Df(angle, loc), pose_2d::Inverse(odom_pose));
+  if (pipeline_running_) {
+    map_from_odom_slot_.Write(map_from_odom);
+    return;
+  }
+  map_from_odom_ = map_from_odom;
+  map_from_odom_valid_ = true;
   localization_initialized_ = true;
   robot_loc_ = loc;
   robot_angle_ = angle;
@@ -94,6 +403,17 @@ void Navigation::UpdateOdometry(const Vector2f& loc,
                                 float angle,
                                 const Vector2f& vel,
                                 float ang_vel) {
+  if (pipeline_running_) {
+    OdometryInput odom;
+    odom.loc = loc;
+    odom.angle = angle;
+    odom.vel = vel;
+    odom.omega = ang_vel;
+    callback_odom_ = odom;
+    ingestion_odom_slot_.Write(odom);
+    control_odom_slot_.Write(odom);
+    return;
+  }
   robot_omega_ = ang_vel;
   robot_vel_ = vel;
   if (!odom_initialized_) {
@@ -110,89 +430,182 @@ void Navigation::UpdateOdometry(const Vector2f& loc,
 
 void Navigation::ObservePointCloud(const vector<Vector2f>& cloud,
                                    double time) {
-  point_cloud_ = cloud;                                     
+  if (pipeline_running_) {
+    ScanInput scan;
+    scan.cloud = cloud;
+    scan.time = time;
+    scan_slot_.Write(scan);
+    return;
+  }
+  point_cloud_ = cloud;
+  if (FLAGS_use_scan_segments) {
+    scan_segments_.clear();
+    line_extraction::ExtractLines(
+        cloud, LineExtractionOptionsFromFlags(), &scan_segments_);
+  }
+  if (FLAGS_use_costmap && odom_initialized_) {
+    IntegrateScan(cloud, odom_loc_, odom_angle_, time, &costmap_);
+  }
+}
+
+Vector2f Navigation::PlanningToOdom(const Vector2f& p) const {
+  return Eigen::Rotation2Df(odom_angle_) *
+      (Eigen::Rotation2Df(predicted_angle_) * p + predicted_loc_) + odom_loc_;
+}
+
+template <typename Chassis>
+float Navigation::CostmapFreePathLength(float curvature) const {
+  vector<float> centers;
+  float radius;
+  GetFootprintCircles<Chassis>(&centers, &radius);
+  // How much faster than base_link the circle centers move along the arc.
+  float speed_factor = 1;
+  for (const float x : centers) {
+    speed_factor = std::max(speed_factor, std::sqrt(1 + Sq(x * curvature)));
+  }
+  const float resolution = costmap_.options().resolution;
+  float s = 0;
+  while (s < kMaxFreePathLength) {
+    Vector2f loc;
+    float angle;
+    ArcPose(curvature, s, &loc, &angle);
+    const Eigen::Rotation2Df R(angle);
+    float clearance = costmap_.options().max_distance;
+    for (const float x : centers) {
+      const Vector2f p = PlanningToOdom(loc + R * Vector2f(x, 0));
+      // Nothing is known beyond the window.
+      if (!costmap_.InWindow(p)) return s;
+      clearance = std::min(clearance, costmap_.Distance(p));
+    }
+    clearance -= radius;
+    if (clearance <= 0) return s;
+    // No circle can reach an obstacle before moving by the clearance; less a
+    // cell for the distances being those of cell centers.
+    s += std::max(0.5f * resolution,
+                  (clearance - resolution) / speed_factor);
+  }
+  return kMaxFreePathLength;
+}
+
+float Navigation::CostmapClearance(float free_path_len, float curvature) const {
+  const float step = costmap_.options().resolution;
+  float min_clearance = costmap_.options().max_distance;
+  for (float s = 0; s <= free_path_len; s += step) {
+    Vector2f loc;
+    float angle;
+    ArcPose(curvature, s, &loc, &angle);
+    min_clearance = std::min(min_clearance,
+                             costmap_.Distance(PlanningToOdom(loc)));
+  }
+  return min_clearance;
 }
 
 
 float Navigation::ComputeClearance(float free_path_len, float curv) {
+  switch (chassis_) {
+    case ChassisType::kF1Tenth: return Clearance<F1Tenth>(free_path_len, curv);
+    case ChassisType::kUtCar: break;
+  }
+  return Clearance<UtCar>(free_path_len, curv);
+}
+
+template <typename Chassis>
+float Navigation::Clearance(float free_path_len, float curv) const {
+  float clearance;
+  if (FLAGS_use_costmap) {
+    clearance = CostmapClearance(free_path_len, curv);
+  } else if (FLAGS_use_scan_segments) {
+    clearance = SegmentClearance(free_path_len, curv);
+  } else {
+    clearance = CloudClearance<Chassis>(free_path_len, curv);
+  }
+  if (!FLAGS_use_map_prior) return clearance;
+  return std::min(clearance, MapClearance(free_path_len, curv));
+}
+
+template <typename Chassis>
+float Navigation::CloudClearance(float free_path_len, float curv) const {
+  typedef VehicleModel<Chassis> Model;
+  // Obstacles farther than this from the path are ignored.
+  const float c_max = kMaxClearance;
   float min_clearance = 10.0;
-  float r = 1.0 / std::abs(curv);
-  float turning_angle = free_path_len / r; // len = r * turning_angle
-  float c_max = 3;
 
-  float car_inner_y = CAR_WIDTH / 2.0 + SAFETY_MARGIN;
-  float car_outter_y = -car_inner_y;
-  float car_front_x = (CAR_BASE + CAR_LENGTH) / 2.0 + SAFETY_MARGIN;
-  
-  const Vector2f center_pt = Vector2f(0,r);  // turning instant center
-  const Vector2f car_outter_front_pt = Vector2f(car_front_x,car_outter_y);
-  
-  const float r_min = r - (CAR_WIDTH / 2.0 + SAFETY_MARGIN);
-  const float r_max = (center_pt - car_outter_front_pt ).norm();
-  
   // Calculate clearance (distance to base_link)
   if (curv == 0) {    // straight line
-    for (auto point : point_cloud_) {
+    for (const Vector2f& point : point_cloud_) {
+      const float y = std::abs(point.y());
       // filter out large clearance
-      if (std::abs(point.y()) > c_max) continue;
+      if (y > c_max) continue;
       // filter out collision points
-      if (point.y() <= car_inner_y && point.y() >= car_outter_y && point.x() >= car_front_x) {
-        continue;
-      }
-      float cur_clearance = std::abs(point.y());
-      min_clearance = std::min(min_clearance,cur_clearance);
+      if (y <= Model::HalfWidth() && point.x() >= Model::Front()) continue;
+      min_clearance = std::min(min_clearance, y);
     }
+    return min_clearance;
+  }
 
-  } else { // turing 
-    
-    for (auto point : point_cloud_) {
-      // for right turn
-      if (curv < 0) point.y() = -point.y();
-
-      float cur_clearance;
-      float r_p = (center_pt - point).norm();
-      // cout << "r_p, r: " << r_p << ", " << r << endl;
-      float p_angle = atan2(point.x(), r - point.y()); // angle: init baselink, center, p
-      // cout << "turning_angle, p_angle: " << turning_angle << ", " << p_angle << endl;
-      // filter out collision 
-      if (r_min <= r_p && r_p <= r_max) continue;
-      // filter out far point
-      if (std::abs(r_p - r) > c_max || p_angle < 0 || p_angle > turning_angle) { // TODO: condition on turning_angle is an assumption
-        continue;
-      }
-      cur_clearance = std::abs(r_p - r); // |c-p| - rmax
-      // cout << "curv, x, clearance: " << curv << ", " << point.x() << ", " << cur_clearance << endl;
-      // if (cur_clearance < min_clearance) {
-      //     // cout << "min_clearance, x, r_p: " << min_clearance << ", " << point.x() << ", " << r_p << endl;
-      // }
-      min_clearance = std::min(min_clearance,cur_clearance);
-    }
+  // turning: mirror right turns onto left ones
+  const float r = 1.0 / std::abs(curv);
+  const float sign = (curv < 0) ? -1 : 1;
+  const float turning_angle = free_path_len / r; // len = r * turning_angle
+  // radii from the turning center swept by the car
+  const float r_min = r - Model::HalfWidth();
+  const float r_max = std::sqrt(Sq(r + Model::HalfWidth()) + Sq(Model::Front()));
+  for (const Vector2f& point : point_cloud_) {
+    const float x = point.x();
+    const float y = sign * point.y();
+    const float r_p = std::sqrt(Sq(x) + Sq(r - y));
+    // filter out collision
+    if (r_min <= r_p && r_p <= r_max) continue;
+    const float cur_clearance = std::abs(r_p - r);
+    // filter out far point
+    if (cur_clearance > c_max) continue;
+    // angle: init baselink, center, p
+    const float p_angle = fast_math::FastAtan2(x, r - y);
+    // TODO: condition on turning_angle is an assumption
+    if (p_angle < 0 || p_angle > turning_angle) continue;
+    min_clearance = std::min(min_clearance, cur_clearance);
   }
-  // cout << "============/=======\n";
   return min_clearance;
 }
+
 PathOption Navigation::ChoosePath(const vector<float> &candidate_curvs) {
+  switch (chassis_) {
+    case ChassisType::kF1Tenth: return ChoosePathFor<F1Tenth>(candidate_curvs);
+    case ChassisType::kUtCar: break;
+  }
+  return ChoosePathFor<UtCar>(candidate_curvs);
+}
+
+template <typename Chassis>
+float Navigation::ScorePath(float curvature, PathOption* path) {
+  float score_clearance = 0; // hyper-param
+  float score_curv = 0;
+  // draw options (gray)
+  // visualization::DrawPathOption(curvature,1,5,0x808080,false,local_viz_msg_);
+
+  float free_path_len = FreePathLength<Chassis>(curvature);
+  float clearance = Clearance<Chassis>(free_path_len, curvature);
+  // float score = free_path_len + score_w * clearance - PENALTY_CURVE * std::abs(curvature);
+  visualization::DrawPathOption(curvature, free_path_len, clearance, 0xFF0000, false, local_viz_msg_);
+  path->curvature = curvature;
+  path->clearance = clearance;
+  path->free_path_length = free_path_len;
+  return free_path_len + score_clearance * clearance + score_curv * std::abs(curvature);
+}
+
+template <typename Chassis>
+PathOption Navigation::ChoosePathFor(const vector<float> &candidate_curvs) {
  
   // PathOption return_path;
 
   float highest_score = -1;
   PathOption best_path;
-  float score_clearance = 0; // hyper-param
-  float score_curv = 0;
   for (auto _curv : candidate_curvs) {
-    // draw options (gray)
-    // visualization::DrawPathOption(_curv,1,5,0x808080,false,local_viz_msg_);
-
-    float free_path_len = ComputeFreePathLength(_curv);
-    float clearance = ComputeClearance(free_path_len, _curv);
-    // float score = free_path_len + score_w * clearance - PENALTY_CURVE * std::abs(_curv);
-    visualization::DrawPathOption(_curv, free_path_len, clearance, 0xFF0000, false, local_viz_msg_);
-    float score = free_path_len + score_clearance * clearance + score_curv * std::abs(_curv);
+    PathOption path;
+    float score = ScorePath<Chassis>(_curv, &path);
     if (score > highest_score) {
       highest_score = score;
-      best_path.curvature = _curv;
-      best_path.clearance = clearance;
-      best_path.free_path_length = free_path_len;
+      best_path = path;
     }
   }
 
@@ -200,20 +613,128 @@ PathOption Navigation::ChoosePath(const vector<float> &candidate_curvs) {
   // draw best option (blue)
   visualization::DrawPathOption(best_path.curvature,best_path.free_path_length,best_path.clearance,0x0F03FC,false,local_viz_msg_);
   std::cout<<"Best C="<<best_path.curvature<<" Free Path Length="<<best_path.free_path_length<<"\n";
-  
-  // just for an example
-  // return_path.curvature = best_curv;
-  // return_path.clearance = 1.4;
-  // return_path.free_path_length = best_option;
-  // return_path.obstruction = Vector2f(0,0)
-  // return_path.closest_point = Vector2f(0,0);
 
   return best_path;
-    
+}
+
+PathOption Navigation::ChoosePathAdaptive() {
+  switch (chassis_) {
+    case ChassisType::kF1Tenth: return ChoosePathAdaptiveFor<F1Tenth>();
+    case ChassisType::kUtCar: break;
+  }
+  return ChoosePathAdaptiveFor<UtCar>();
+}
+
+template <typename Chassis>
+PathOption Navigation::ChoosePathAdaptiveFor() {
+  struct Sample {
+    float curvature;
+    float score;
+  };
+  const float max_curvature = MaxCurvature();
+  const size_t budget = std::max(1, FLAGS_curvature_budget);
+  const float resolution = FLAGS_curvature_resolution;
+  vector<Sample> samples;
+  samples.reserve(budget);
+  float highest_score = -1;
+  PathOption best_path;
+  // Evaluates curvature unless the budget is spent or a sample is closer
+  // than the resolution already.
+  auto evaluate = [&](float curvature) {
+    if (samples.size() >= budget) return;
+    curvature = Clamp(curvature, -max_curvature, max_curvature);
+    for (const Sample& sample : samples) {
+      if (std::abs(sample.curvature - curvature) < 0.5f * resolution) return;
+    }
+    PathOption path;
+    const float score = this->template ScorePath<Chassis>(curvature, &path);
+    samples.push_back({curvature, score});
+    if (score > highest_score) {
+      highest_score = score;
+      best_path = path;
+    }
+  };
+
+  // Coarse pass, straight first so that it wins ties as with the uniform
+  // set, then the previous choice.
+  const int half = std::max(1, FLAGS_curvature_coarse_samples / 2);
+  float step = max_curvature / half;
+  evaluate(0);
+  evaluate(previous_curvature_);
+  for (int i = 1; i <= half; ++i) {
+    evaluate(i * step);
+    evaluate(-i * step);
+  }
+
+  // Refine: halve the spacing around the best samples and the previous
+  // choice, while there is budget and resolution left.
+  vector<float> centers;
+  while (samples.size() < budget && step > resolution) {
+    step = std::max(0.5f * step, resolution);
+    // Stable, so that ties keep the order of evaluation.
+    vector<Sample> ranked = samples;
+    std::stable_sort(ranked.begin(), ranked.end(),
+                     [](const Sample& a, const Sample& b) {
+                       return a.score > b.score;
+                     });
+    centers.clear();
+    for (int i = 0; i < kNumRefinedCurvatures &&
+         i < static_cast<int>(ranked.size()); ++i) {
+      centers.push_back(ranked[i].curvature);
+    }
+    centers.push_back(previous_curvature_);
+    for (size_t i = 0; i < centers.size(); ++i) {
+      if (std::find(centers.begin(), centers.begin() + i, centers[i]) !=
+          centers.begin() + i) {
+        continue;
+      }
+      evaluate(centers[i] - step);
+      evaluate(centers[i] + step);
+    }
+  }
+
+  previous_curvature_ = best_path.curvature;
+  // draw best option (blue)
+  visualization::DrawPathOption(best_path.curvature,
+                                best_path.free_path_length,
+                                best_path.clearance,
+                                0x0F03FC,
+                                false,
+                                local_viz_msg_);
+  if (FLAGS_v > 1) {
+    printf("Adaptive curvatures: best %.4f of %d paths, free path %.3f\n",
+           best_path.curvature, static_cast<int>(samples.size()),
+           best_path.free_path_length);
+  }
+  return best_path;
 }
 
 float Navigation::ComputeFreePathLength(float curvature) {
-   /* notation
+  switch (chassis_) {
+    case ChassisType::kF1Tenth: return FreePathLength<F1Tenth>(curvature);
+    case ChassisType::kUtCar: break;
+  }
+  return FreePathLength<UtCar>(curvature);
+}
+
+template <typename Chassis>
+float Navigation::FreePathLength(float curvature) const {
+  float free_path_length;
+  if (FLAGS_use_costmap) {
+    free_path_length = CostmapFreePathLength<Chassis>(curvature);
+  } else if (FLAGS_use_scan_segments) {
+    free_path_length = SegmentFreePathLength<Chassis>(curvature);
+  } else {
+    free_path_length = CloudFreePathLength<Chassis>(curvature);
+  }
+  if (!FLAGS_use_map_prior) return free_path_length;
+  return MapFreePathLength<Chassis>(curvature, free_path_length);
+}
+
+template <typename Chassis>
+float Navigation::CloudFreePathLength(float curvature) const {
+  typedef VehicleModel<Chassis> Model;
+  /* notation
   Angle
     theta: turing angle
   Radius
@@ -227,86 +748,241 @@ float Navigation::ComputeFreePathLength(float curvature) {
     *----------------*
    outer_rear(r2)    outer_front(rmax)
   */
-  // Car points (baselink frame)
-  float car_inner_y = CAR_WIDTH / 2.0 + SAFETY_MARGIN;
-  float car_outter_y = -car_inner_y;
-  float car_front_x = (CAR_BASE + CAR_LENGTH) / 2.0 + SAFETY_MARGIN;
-  //float car_rear_x = -(CAR_LENGTH - CAR_BASE) / 2.0 - SAFETY_MARGIN;
-  
-  
+  float free_path_length = kMaxFreePathLength;
 
+  if (curvature == 0) {
+    // go straight
+    for (const Vector2f& point : point_cloud_) {
+      if (std::abs(point.y()) <= Model::HalfWidth() &&
+          point.x() >= Model::Front()) {
+        free_path_length =
+            std::min(free_path_length, point.x() - Model::Front());
+      }
+    }
+    return free_path_length;
+  }
 
+  // go curve: mirror right turns onto left ones, turning center at (0, r)
+  const float r = 1.0 / std::abs(curvature);
+  const float sign = (curvature < 0) ? -1 : 1;
+  // The inner side sweeps radii r_min..r_1, the front r_1..r_max.
+  const float r_min = r - Model::HalfWidth();
+  const float r_1 = std::sqrt(Sq(r_min) + Sq(Model::Front()));
+  const float r_max = std::sqrt(Sq(r + Model::HalfWidth()) + Sq(Model::Front()));
+  const float r_min_sq = (r_min > 0) ? Sq(r_min) : 0;
+  const float r_max_sq = Sq(r_max);
+
+  for (const Vector2f& point : point_cloud_) {
+    // Only points ahead can be hit (the turning angle theta below is
+    // positive exactly when x is).
+    const float x = point.x();
+    if (x <= 0) continue;
+    const float y = sign * point.y();
+    // r_p point to center
+    const float r_p_sq = Sq(x) + Sq(r - y);
+    if (r_p_sq < r_min_sq || r_p_sq > r_max_sq) continue;
+    const float r_p = std::sqrt(r_p_sq);
+    // angle: point angle, init base_link -> point
+    const float theta = fast_math::FastAtan2(x, r - y);
+    // angle: new base_link -> point, when the front (asin(h/rp)) or the
+    // inner side (acos(r-w/2 / rp)) hits it. The approximations are within
+    // 5e-7 rad, a millimeter of path at a 2 km turning radius.
+    const float omega = (r_p >= r_1) ?
+        fast_math::FastAsin(Model::Front() / r_p) :
+        fast_math::FastAcos(r_min / r_p);
+    //  turning angle: init base_link -> new base_link = theta - omega
+    free_path_length = std::min(free_path_length, (theta - omega) * r);
+  }
+  return free_path_length;
+}
 
-  float free_path_length = 10.0;
+void Navigation::GetMapLines(Vector2f box_min,
+                             Vector2f box_max,
+                             bool mirror,
+                             vector<geometry::line2f>* lines) const {
+  // The box is given in the mirrored frame, like the lines.
+  if (mirror) {
+    const float y_min = -box_max.y();
+    box_max.y() = -box_min.y();
+    box_min.y() = y_min;
+  }
+  // The planning frame in the map.
+  const pose_2d::Pose2Df map_from_planning = pose_2d::Compose(
+      map_from_odom_,
+      pose_2d::Compose(pose_2d::Pose2Df(odom_angle_, odom_loc_),
+                       pose_2d::Pose2Df(predicted_angle_, predicted_loc_)));
+  Vector2f map_box_min = pose_2d::TransformPoint(map_from_planning, box_min);
+  Vector2f map_box_max = map_box_min;
+  for (const Vector2f& corner : {Vector2f(box_min.x(), box_max.y()),
+                                 Vector2f(box_max.x(), box_min.y()),
+                                 box_max}) {
+    const Vector2f p = pose_2d::TransformPoint(map_from_planning, corner);
+    map_box_min = map_box_min.cwiseMin(p);
+    map_box_max = map_box_max.cwiseMax(p);
+  }
+  vector<int> ids;
+  map_grid_.GetCandidates(map_box_min, map_box_max, &ids);
+  const pose_2d::Pose2Df planning_from_map =
+      pose_2d::Inverse(map_from_planning);
+  const float y_sign = mirror ? -1 : 1;
+  lines->clear();
+  for (const int id : ids) {
+    const geometry::line2f& wall = map_grid_.lines()[id];
+    Vector2f p0 = pose_2d::TransformPoint(planning_from_map, wall.p0);
+    Vector2f p1 = pose_2d::TransformPoint(planning_from_map, wall.p1);
+    p0.y() *= y_sign;
+    p1.y() *= y_sign;
+    lines->emplace_back(p0, p1);
+  }
+}
 
-  if (curvature==0) {
-    // go straight
-    for (auto point : point_cloud_) {
-      if (point.y() <= car_inner_y && point.y() >= car_outter_y && point.x() >= car_front_x) {
-        free_path_length = std::min(free_path_length, point.x() - car_front_x );
+template <typename Chassis>
+float Navigation::MapFreePathLength(float curvature,
+                                    float max_free_path_len) const {
+  if (!map_from_odom_valid_ || max_free_path_len <= 0) {
+    return max_free_path_len;
+  }
+  // The footprint circles of the car, each of which must stay farther than
+  // their radius from the walls. Walls far from the path are culled with
+  // the index, the rest by their distance to the whole path; the first
+  // contact with those left is found by bisection on the distance to the
+  // path up to it, which shrinks as the path grows.
+  vector<float> centers;
+  float radius;
+  GetFootprintCircles<Chassis>(&centers, &radius);
+  vector<geometry::line2f> walls;
+  float free_path_length = max_free_path_len;
+
+  if (std::abs(curvature) < kEpsilon) {
+    // Straight: the circles move along the x axis.
+    GetMapLines(Vector2f(centers.front() - radius, -radius),
+                Vector2f(centers.back() + free_path_length + radius, radius),
+                false,
+                &walls);
+    for (const geometry::line2f& wall : walls) {
+      for (const float x : centers) {
+        const auto distance = [&](float s) {
+          return geometry::MinDistanceLineLine(
+              wall.p0, wall.p1, Vector2f(x, 0), Vector2f(x + s, 0));
+        };
+        if (distance(free_path_length) > radius) continue;
+        float lo = 0;
+        float hi = free_path_length;
+        while (hi - lo > kMapFreePathTolerance) {
+          const float mid = 0.5 * (lo + hi);
+          if (distance(mid) > radius) {
+            lo = mid;
+          } else {
+            hi = mid;
+          }
+        }
+        free_path_length = lo;
       }
     }
-  } else {
-    // go curve
-    const float r = 1.0 / std::abs(curvature);
-    const Vector2f center_pt = Vector2f(0,r);  // turning instant center
-    const Vector2f car_inner_front_pt = Vector2f(car_front_x,car_inner_y);
-    const Vector2f car_outter_front_pt = Vector2f(car_front_x,car_outter_y);
-    //const Vector2f car_inner_rear_pt = Vector2f(car_rear_x,car_inner_y);
-    //const Vector2f car_outter_rear_pt = Vector2f(car_rear_x,car_outter_y);
-
-
-
-    const float r_min = r - (CAR_WIDTH / 2.0 + SAFETY_MARGIN);
-    const float r_max = (center_pt - car_outter_front_pt ).norm();
-    const float r_1 = (center_pt - car_inner_front_pt ).norm();
-    // const float r_2 = (center_pt - car_outter_rear_pt ).norm();
-
-
-    for (auto point : point_cloud_) {
-      if (curvature < 0)
-        point.y() = -point.y();
-        
-      //visualization::DrawCross(point,0.2,2,local_viz_msg_); 
-      // whether the car will hit the point
-      bool collision = true;
-      
-      // r_p point to center
-      float r_p = (center_pt - point).norm();
-
-      // angle: point angle, init base_link -> point
-      float theta = atan2(point.x() ,  (r - point.y())); // atan2(x / (r-y))
-      // angle: new base_link -> point
-      float omega; 
-
-      if (theta > 0 && r_p >= r_1 && r_p <= r_max && point.x() > 0) { 
-        // front side
-        omega = asin(car_front_x / r_p); // asin(h/rp)
-      } else if (theta > 0 && r_p >= r_min && r_p <= r_1 && point.x() > 0) {
-        // inner side
-        omega = acos((r - (CAR_WIDTH / 2.0 + SAFETY_MARGIN)) / r_p); // acos(r-w/2 / rp)
-      } else {
-        // case 3, or no collision
-        collision = false;
+    return free_path_length;
+  }
+
+  // Turning: mirror right turns onto left ones, turning center at (0, r).
+  // Arc lengths are those of base_link, on the circle of radius r.
+  const float r = 1.0 / std::abs(curvature);
+  const bool mirror = curvature < 0;
+  const Vector2f center(0, r);
+  Vector2f box_min(0, 0);
+  Vector2f box_max(0, 0);
+  for (const float x : centers) {
+    const Vector2f p(x, 0);
+    AddArcToBox(center,
+                (p - center).norm(),
+                geometry::Angle<float>(Vector2f(p - center)),
+                free_path_length / r,
+                &box_min,
+                &box_max);
+  }
+  GetMapLines(box_min - Vector2f(radius, radius),
+              box_max + Vector2f(radius, radius),
+              mirror,
+              &walls);
+  for (const geometry::line2f& wall : walls) {
+    for (const float x : centers) {
+      const Vector2f p(x, 0);
+      const float circle_radius = (p - center).norm();
+      const float start = geometry::Angle<float>(Vector2f(p - center));
+      const auto distance = [&](float s) {
+        return WallArcDistance(wall, center, circle_radius, start, s / r);
+      };
+      if (distance(free_path_length) > radius) continue;
+      float lo = 0;
+      float hi = free_path_length;
+      while (hi - lo > kMapFreePathTolerance) {
+        const float mid = 0.5 * (lo + hi);
+        if (distance(mid) > radius) {
+          lo = mid;
+        } else {
+          hi = mid;
+        }
       }
+      free_path_length = lo;
+    }
+  }
+  return free_path_length;
+}
 
-      if (collision) {
-        //  turning angle: init base_link -> new base_link = theta - omega
-        float cur_free_path_length = (theta - omega) * r; // turning_angle * r
+float Navigation::MapClearance(float free_path_len, float curvature) const {
+  if (!map_from_odom_valid_) return LinesClearance({}, 0, curvature);
+  // The box of the path of base_link.
+  Vector2f box_min(0, 0);
+  Vector2f box_max(free_path_len, 0);
+  if (std::abs(curvature) >= kEpsilon) {
+    const float r = 1.0 / std::abs(curvature);
+    AddArcToBox(Vector2f(0, r), r, -M_PI_2, free_path_len / r,
+                &box_min, &box_max);
+  }
+  vector<geometry::line2f> walls;
+  GetMapLines(box_min - Vector2f(kMaxClearance, kMaxClearance),
+              box_max + Vector2f(kMaxClearance, kMaxClearance),
+              curvature < 0,
+              &walls);
+  return LinesClearance(walls, free_path_len, curvature);
+}
 
-        //std::cout<<"cur_free_path_length="<<cur_free_path_length<<" free_path_length="<<free_path_length<<"\n";
-        free_path_length = std::min(free_path_length, cur_free_path_length);
-      } 
+template <typename Chassis>
+float Navigation::SegmentFreePathLength(float curvature) const {
+  typedef VehicleModel<Chassis> Model;
+  // Every point is within the max error of its segment, so growing the car
+  // by it keeps the car clear of the points.
+  const float half_width = Model::HalfWidth() + FLAGS_scan_segment_max_error;
+  const float front = Model::Front() + FLAGS_scan_segment_max_error;
+  float free_path_length = kMaxFreePathLength;
+  if (std::abs(curvature) < kEpsilon) {
+    for (const geometry::line2f& segment : scan_segments_) {
+      free_path_length = std::min(
+          free_path_length,
+          StraightSegmentFreePathLength(segment, half_width, front));
     }
-    
+    return free_path_length;
+  }
+  // Mirror right turns onto left ones, turning center at (0, r).
+  const float r = 1.0 / std::abs(curvature);
+  const float sign = (curvature < 0) ? -1 : 1;
+  for (const geometry::line2f& segment : scan_segments_) {
+    free_path_length = std::min(
+        free_path_length,
+        TurningSegmentFreePathLength(
+            MirrorLine(segment, sign), r, half_width, front));
   }
-
-  // draw free path length along the curve (cyan)
-  // visualization::DrawPathOption(curvature,free_path_length,5,0x00FFFF,false,local_viz_msg_);
   return free_path_length;
-
 }
 
+float Navigation::SegmentClearance(float free_path_len,
+                                   float curvature) const {
+  const float sign = (curvature < 0) ? -1 : 1;
+  vector<geometry::line2f> segments;
+  segments.reserve(scan_segments_.size());
+  for (const geometry::line2f& segment : scan_segments_) {
+    segments.push_back(MirrorLine(segment, sign));
+  }
+  return LinesClearance(segments, free_path_len, curvature);
+}
 
 void Navigation::RunAssign1() {
   float cur_velocity = LatencyCompensation();
@@ -320,7 +996,8 @@ void Navigation::RunAssign1() {
       // c. Compute Distance To Goal
       // d. Compute total “score”
   // 3. From all paths, pick path with best score
-  PathOption chosen_path = ChoosePath(curvatures_);
+  PathOption chosen_path = FLAGS_adaptive_curvatures ?
+      ChoosePathAdaptive() : ChoosePath(curvatures_);
   // path.curvature, path.free_path_length
 
   // 4. Implement 1-D TOC on the chosen arc.
@@ -334,6 +1011,7 @@ void Navigation::RunAssign1() {
   Control latest_control;
   latest_control.curvature = chosen_path.curvature;
   latest_control.velocity = velocity;
+  latest_control.dt = cycle_dt_;
   control_queue.push_back(latest_control);
 }
 void Navigation::GenerateCurvatures(int num_samples = 100) {
@@ -345,7 +1023,7 @@ void Navigation::GenerateCurvatures(int num_samples = 100) {
   // half of samples
   num_samples = (num_samples - 1) / 2;
   std::cout<<"half samples="<<num_samples<<"\n";
-  float _delta = CAR_CMAX * 1.0 / num_samples;
+  float _delta = MaxCurvature() / num_samples;
   std::cout<<"delta="<<_delta<<"\n";
   // straight line
   curvatures_[0] = 0;
@@ -373,11 +1051,21 @@ float Navigation::ComputeTOC(float free_path_length, float cur_velocity) {
 }
 
 void Navigation::drawCar(bool withMargin=true) {
+  switch (chassis_) {
+    case ChassisType::kF1Tenth: DrawCar<F1Tenth>(withMargin); return;
+    case ChassisType::kUtCar: break;
+  }
+  DrawCar<UtCar>(withMargin);
+}
+
+template <typename Chassis>
+void Navigation::DrawCar(bool withMargin) {
+  typedef VehicleModel<Chassis> Model;
   // draw car (black)
-  float car_inner_y = CAR_WIDTH / 2.0;
+  float car_inner_y = Model::BodyHalfWidth();
   float car_outter_y = -car_inner_y;
-  float car_front_x = (CAR_BASE + CAR_LENGTH) / 2.0;
-  float car_rear_x = -(CAR_LENGTH - CAR_BASE) / 2.0;
+  float car_front_x = Model::BodyFront();
+  float car_rear_x = Model::BodyRear();
 
   Vector2f car_inner_front_pt = Vector2f(car_front_x,car_inner_y);
   Vector2f car_outter_front_pt = Vector2f(car_front_x,car_outter_y);
@@ -389,11 +1077,12 @@ void Navigation::drawCar(bool withMargin=true) {
   visualization::DrawLine(car_inner_front_pt,car_inner_rear_pt,0, local_viz_msg_);
   visualization::DrawLine(car_inner_rear_pt,car_outter_rear_pt,0, local_viz_msg_);
 
+  if (!withMargin) return;
   // draw margin (orange)
-  float car_inner_y_m = CAR_WIDTH / 2.0 + SAFETY_MARGIN;
+  float car_inner_y_m = Model::HalfWidth();
   float car_outter_y_m = -car_inner_y_m;
-  float car_front_x_m = (CAR_BASE + CAR_LENGTH) / 2.0 + SAFETY_MARGIN;
-  float car_rear_x_m = -(CAR_LENGTH - CAR_BASE) / 2.0 - SAFETY_MARGIN;
+  float car_front_x_m = Model::Front();
+  float car_rear_x_m = Model::Rear();
 
   Vector2f car_inner_front_pt_m = Vector2f(car_front_x_m,car_inner_y_m);
   Vector2f car_outter_front_pt_m = Vector2f(car_front_x_m,car_outter_y_m);
@@ -404,8 +1093,14 @@ void Navigation::drawCar(bool withMargin=true) {
   visualization::DrawLine(car_outter_rear_pt_m,car_outter_front_pt_m,0xFFC116, local_viz_msg_);
   visualization::DrawLine(car_inner_front_pt_m,car_inner_rear_pt_m,0xFFC116, local_viz_msg_);
   visualization::DrawLine(car_inner_rear_pt_m,car_outter_rear_pt_m,0xFFC116, local_viz_msg_);
+}
 
-
+float Navigation::MaxCurvature() const {
+  switch (chassis_) {
+    case ChassisType::kF1Tenth: return VehicleModel<F1Tenth>::MaxCurvature();
+    case ChassisType::kUtCar: break;
+  }
+  return VehicleModel<UtCar>::MaxCurvature();
 }
 
 void Navigation::drawPointCloud() {
@@ -446,6 +1141,8 @@ float Navigation::LatencyCompensation(size_t queue_size) {
     3.  Return the latest velocity in the control queue.
   */
 
+  predicted_loc_ = Vector2f(0, 0);
+  predicted_angle_ = 0;
   if (control_queue.size() < queue_size) {
     return robot_vel_.norm();
   }
@@ -457,11 +1154,12 @@ float Navigation::LatencyCompensation(size_t queue_size) {
   for (const auto &control : control_queue) {
     if (std::abs(control.curvature) < 1E-3f) {
       // straight line
-      x += control.velocity * std::cos(theta) * dt;
-      y += control.velocity * std::sin(theta) * dt;
+      x += control.velocity * std::cos(theta) * control.dt;
+      y += control.velocity * std::sin(theta) * control.dt;
     } else {
       // curve
-      float theta_prime = theta + control.velocity * control.curvature * dt;
+      float theta_prime =
+          theta + control.velocity * control.curvature * control.dt;
       x += (-std::sin(theta) + std::sin(theta_prime)) / control.curvature;
       y += (std::cos(theta) - std::cos(theta_prime)) / control.curvature;
       theta = theta_prime;
@@ -469,27 +1167,18 @@ float Navigation::LatencyCompensation(size_t queue_size) {
   }
   cout << "forward-predict: (x', y', theta'): (" << x << ", " << y << ", " << theta << ')' << endl;
 
-  // rotation and translation matrix
-  Eigen::Matrix3f transform;
-  transform <<
-        std::cos(theta), -std::sin(theta), x * std::cos(theta) - y * std::sin(theta),
-        std::sin(theta), std::cos(theta), x * std::sin(theta) + y * std::cos(theta),
-        0.f, 0.f, 1.f;
-
-  // draw an example
-  // Eigen::Vector3f example_pt1(0,0,1);
-  // Eigen::Vector3f example_pt2(1,0,1);
-  // example_pt1 = transform * example_pt1;
-  // example_pt2 = transform * example_pt2;
-  // visualization::DrawLine(Vector2f(example_pt1.x(), example_pt1.y()), Vector2f(example_pt2.x(), example_pt2.y()), 0xEB4EED ,local_viz_msg_);
-
-  // Transform the lidar points using translation and rotation
-  for (auto& point : point_cloud_) {
-      // homogeneous coordinates
-      Eigen::Vector3f p(point.x(), point.y(), 1);
-      p = transform.inverse() * p;
-      point.x() = p.x() / p.z();
-      point.y() = p.y() / p.z();
+  // Pose of the predicted base_link w.r.t. the current base_link.
+  const Eigen::Rotation2Df rotation(theta);
+  const pose_2d::Pose2Df predicted_pose(theta, rotation * Vector2f(x, y));
+  predicted_loc_ = predicted_pose.translation;
+  predicted_angle_ = predicted_pose.angle;
+
+  // Transform the lidar points into the predicted base_link frame.
+  const pose_2d::Pose2Df predicted_from_base = pose_2d::Inverse(predicted_pose);
+  pose_2d::TransformPointCloud(predicted_from_base, point_cloud_, &point_cloud_);
+  for (geometry::line2f& segment : scan_segments_) {
+    segment.p0 = pose_2d::TransformPoint(predicted_from_base, segment.p0);
+    segment.p1 = pose_2d::TransformPoint(predicted_from_base, segment.p1);
   }
 
   // pop out the oldest control and return the lastest velocity
@@ -499,7 +1188,10 @@ float Navigation::LatencyCompensation(size_t queue_size) {
 
 void Navigation::Run() {
   // This function gets called 20 times a second to form the control loop.
-  
+  // The previous command was in effect until now.
+  cycle_dt_ = control_monitor_.Tick();
+  if (!control_queue.empty()) control_queue.back().dt = cycle_dt_;
+
   // Clear previous visualizations.
   visualization::ClearVisualizationMsg(local_viz_msg_);
   visualization::ClearVisualizationMsg(global_viz_msg_);
@@ -534,4 +1226,152 @@ void Navigation::Run() {
   drive_pub_.publish(drive_msg_);
 }
 
+void Navigation::StartPipeline() {
+  if (pipeline_running_) return;
+  pipeline_running_ = true;
+  control_monitor_.Reset();
+  pipeline_threads_.emplace_back(&Navigation::IngestionLoop, this);
+  pipeline_threads_.emplace_back(&Navigation::PlanningLoop, this);
+  pipeline_threads_.emplace_back(&Navigation::ControlLoop, this);
+}
+
+void Navigation::StopPipeline() {
+  if (!pipeline_running_) return;
+  pipeline_running_ = false;
+  for (std::thread& thread : pipeline_threads_) {
+    thread.join();
+  }
+  pipeline_threads_.clear();
+  const DeadlineMonitor::Stats t = control_monitor_.GetStats();
+  if (t.num_cycles > 0) {
+    printf("Control: %d cycles, %d deadlines missed, period mean %.3f ms, "
+           "max %.3f ms, jitter mean %.3f ms, max %.3f ms\n",
+           static_cast<int>(t.num_cycles),
+           static_cast<int>(t.num_overruns),
+           1e3 * t.mean_period, 1e3 * t.max_period,
+           1e3 * t.mean_jitter, 1e3 * t.max_jitter);
+  }
+}
+
+DeadlineMonitor::Stats Navigation::ControlStats() const {
+  return control_monitor_.GetStats();
+}
+
+void Navigation::IngestionLoop() {
+  LocalCostmap costmap(CostmapOptionsFromFlags());
+  ScanInput scan;
+  PlanningInput input;
+  bool have_odom = false;
+  while (pipeline_running_) {
+    if (ingestion_odom_slot_.Read(&input.odom)) have_odom = true;
+    if (!have_odom || !scan_slot_.Read(&scan)) {
+      Sleep(kPipelinePollInterval);
+      continue;
+    }
+    if (FLAGS_use_costmap) {
+      IntegrateScan(scan.cloud,
+                    input.odom.loc,
+                    input.odom.angle,
+                    scan.time,
+                    &costmap);
+      input.costmap = costmap;
+    }
+    if (FLAGS_use_scan_segments) {
+      input.segments.clear();
+      line_extraction::ExtractLines(
+          scan.cloud, LineExtractionOptionsFromFlags(), &input.segments);
+    }
+    input.cloud.swap(scan.cloud);
+    planning_slot_.Write(input);
+  }
+}
+
+void Navigation::PlanningLoop() {
+  PlanningInput input;
+  std::deque<Control> control_history;
+  while (pipeline_running_) {
+    if (!planning_slot_.Read(&input)) {
+      Sleep(kPipelinePollInterval);
+      continue;
+    }
+    point_cloud_.swap(input.cloud);
+    scan_segments_.swap(input.segments);
+    if (FLAGS_use_costmap) {
+      std::swap(costmap_, input.costmap);
+    }
+    odom_loc_ = input.odom.loc;
+    odom_angle_ = input.odom.angle;
+    if (map_from_odom_slot_.Read(&map_from_odom_)) {
+      map_from_odom_valid_ = true;
+    }
+    robot_vel_ = input.odom.vel;
+    robot_omega_ = input.odom.omega;
+    control_history_slot_.Read(&control_history);
+    control_queue = control_history;
+
+    visualization::ClearVisualizationMsg(local_viz_msg_);
+    LatencyCompensation(kLatencyQueueSize);
+    if (curvatures_.empty()) GenerateCurvatures(kNumCurvatures);
+    const PathOption path = FLAGS_adaptive_curvatures ?
+        ChoosePathAdaptive() : ChoosePath(curvatures_);
+
+    // The path starts at the pose predicted by the latency compensation;
+    // the control thread measures progress from where the scan was taken.
+    Plan plan;
+    plan.curvature = path.curvature;
+    plan.free_path_length = path.free_path_length + predicted_loc_.norm();
+    plan.odom_loc = input.odom.loc;
+    plan.time = GetMonotonicTime();
+    plan_slot_.Write(plan);
+  }
+}
+
+void Navigation::ControlLoop() {
+  runtime_config::ConfigureRealtimeThread();
+  OdometryInput odom;
+  Plan plan;
+  bool have_odom = false;
+  bool have_plan = false;
+  std::deque<Control> history;
+  float velocity = 0;
+  double deadline = GetMonotonicTime();
+  while (pipeline_running_) {
+    deadline += dt;
+    SleepUntil(deadline);
+    const double lateness = GetMonotonicTime() - deadline;
+    if (lateness > dt) {
+      // Overslept: drop the cycles that are already late rather than
+      // bunching them up.
+      deadline += std::floor(lateness / dt) * dt;
+    }
+    // The previous command was in effect until now.
+    const float cycle_dt = control_monitor_.Tick();
+    if (!history.empty()) history.back().dt = cycle_dt;
+
+    if (control_odom_slot_.Read(&odom)) have_odom = true;
+    if (plan_slot_.Read(&plan)) have_plan = true;
+    const double now = GetMonotonicTime();
+    float curvature = 0;
+    float free_path_length = 0;
+    if (have_plan && have_odom && now - plan.time < kPlanTimeout) {
+      curvature = plan.curvature;
+      free_path_length = std::max(
+          0.0f, plan.free_path_length - (odom.loc - plan.odom_loc).norm());
+    }
+    velocity = ComputeTOC(free_path_length, velocity);
+    drive_msg_.curvature = curvature;
+    drive_msg_.velocity = velocity;
+    drive_msg_.header.stamp = ros::Time::now();
+    drive_pub_.publish(drive_msg_);
+
+    Control control;
+    control.curvature = curvature;
+    control.velocity = velocity;
+    control.dt = cycle_dt;
+    history.push_back(control);
+    while (history.size() > kLatencyQueueSize) history.pop_front();
+    control_history_slot_.Write(history);
+  }
+}
+
 }  // namespace navigation
@@ -19,22 +19,24 @@
 */
 //========================================================================
 
-#include <vector>
+#include <atomic>
 #include <deque>
+#include <thread>
+#include <vector>
 
 #include "eigen3/Eigen/Dense"
 
+#include "navigation/local_costmap.h"
+#include "navigation/vehicle_model.h"
+#include "shared/math/poses_2d.h"
+#include "shared/util/latest_value.h"
+#include "shared/util/timer.h"
+#include "vector_map/line_grid.h"
 #include "vector_map/vector_map.h"
 
 #ifndef NAVIGATION_H
 #define NAVIGATION_H
 
-#define CAR_LENGTH 0.535
-#define CAR_WIDTH 0.281
-#define CAR_BASE 0.324
-#define CAR_CMAX 1
-#define SAFETY_MARGIN 0.03
-
 // heuristic 
 #define PENALTY_CURVE  2
 
@@ -46,13 +48,6 @@ namespace ros {
 
 namespace navigation {
 
-// car params
-// const float CAR_LENGTH = 0.535;
-// const float CAR_WIDTH = 0.281;
-// const float CAR_BASE = 0.324;
-// const float CAR_CMAX = 1;
-// const float SAFETY_MARGIN = 0.3;
-
 struct PathOption {
   float curvature;
   float clearance;
@@ -65,6 +60,9 @@ struct PathOption {
 struct Control {
   float curvature;
   float velocity;
+  // Seconds the command is in effect: the measured period of the control
+  // cycle that sent it, updated once the next cycle starts.
+  float dt;
 };
 
 class Navigation {
@@ -72,6 +70,7 @@ class Navigation {
 
    // Constructor
   explicit Navigation(const std::string& map_file, ros::NodeHandle* n);
+  ~Navigation();
 
   // Used in callback from localization to update position.
   void UpdateLocation(const Eigen::Vector2f& loc, float angle);
@@ -88,12 +87,29 @@ class Navigation {
 
   // Main function called continously from main
   void Run();
+
+  // Runs navigation as a pipeline instead of from Run(): scan ingestion with
+  // the costmap update, planning, and the drive command output each have a
+  // thread, and hand over the latest values through lock-free slots. The
+  // drive command goes out every dt even when planning overruns; with a
+  // stale plan the car is brought to a stop.
+  void StartPipeline();
+  void StopPipeline();
+
+  // Timing of the control cycles so far, of Run() or of the control thread
+  // of the pipeline. Can be called from any thread while they run.
+  DeadlineMonitor::Stats ControlStats() const;
   // Used to set the next target pose.
   void SetNavGoal(const Eigen::Vector2f& loc, float angle);
 
   void RunAssign1();
 
   PathOption ChoosePath(const vector<float> &curvatures);
+  // Chooses among curvatures sampled coarse to fine instead: a uniform
+  // coarse set and the previous choice first, then ever closer around the
+  // best of them, until --curvature_budget paths have been evaluated or the
+  // spacing is down to --curvature_resolution.
+  PathOption ChoosePathAdaptive();
 
   float ComputeFreePathLength(float curvature);
   float ComputeClearance(float free_path_len, float curv);
@@ -115,7 +131,68 @@ class Navigation {
 
   void drawPointCloud();
  private:
-
+  // The planner for a given chassis, see vehicle_model.h. The public methods
+  // above dispatch to these on chassis_.
+  template <typename Chassis>
+  PathOption ChoosePathFor(const vector<float>& curvatures);
+  template <typename Chassis>
+  PathOption ChoosePathAdaptiveFor();
+  // Evaluates the path along curvature into path, and returns its score.
+  template <typename Chassis>
+  float ScorePath(float curvature, PathOption* path);
+  template <typename Chassis>
+  float FreePathLength(float curvature) const;
+  template <typename Chassis>
+  float Clearance(float free_path_len, float curvature) const;
+  template <typename Chassis>
+  void DrawCar(bool withMargin);
+  float MaxCurvature() const;
+
+  // ComputeFreePathLength and ComputeClearance on the latest point cloud.
+  template <typename Chassis>
+  float CloudFreePathLength(float curvature) const;
+  template <typename Chassis>
+  float CloudClearance(float free_path_len, float curvature) const;
+
+  // ComputeFreePathLength and ComputeClearance on the segments extracted
+  // from the latest scan, see --use_scan_segments. The free path length is
+  // that of the car, grown by the extraction error, against the segments.
+  template <typename Chassis>
+  float SegmentFreePathLength(float curvature) const;
+  float SegmentClearance(float free_path_len, float curvature) const;
+
+  // ComputeFreePathLength and ComputeClearance on the local costmap, by
+  // marching the car along the arc.
+  template <typename Chassis>
+  float CostmapFreePathLength(float curvature) const;
+  float CostmapClearance(float free_path_len, float curvature) const;
+
+  // ComputeFreePathLength, up to max_free_path_len, and ComputeClearance
+  // against the walls of the map at the localized pose, see
+  // --use_map_prior. They see walls in sensor shadows and beyond the range
+  // of the lidar, and do not depend on the scan resolution.
+  template <typename Chassis>
+  float MapFreePathLength(float curvature, float max_free_path_len) const;
+  float MapClearance(float free_path_len, float curvature) const;
+  // The walls of the map that may intersect the box [box_min, box_max] of
+  // the planning frame, transformed into it. If mirror is set, the box and
+  // the lines are mirrored across its x axis.
+  void GetMapLines(Eigen::Vector2f box_min,
+                   Eigen::Vector2f box_max,
+                   bool mirror,
+                   std::vector<geometry::line2f>* lines) const;
+
+  // Transforms a point from the planning frame (base_link, advanced by the
+  // latency compensation) to the odometry frame.
+  Eigen::Vector2f PlanningToOdom(const Eigen::Vector2f& p) const;
+
+  // Pipeline stages, see StartPipeline().
+  void IngestionLoop();
+  void PlanningLoop();
+  void ControlLoop();
+
+  // The car being driven.
+  ChassisType chassis_;
   // Whether odometry has been initialized.
   bool odom_initialized_;
   // Whether localization has been initialized.
@@ -138,6 +215,14 @@ class Navigation {
   float odom_start_angle_;
   // Latest observed point cloud.
   std::vector<Eigen::Vector2f> point_cloud_;
+  // Line segments extracted from it, in scan order.
+  std::vector<geometry::line2f> scan_segments_;
+  // Obstacles around the robot, accumulated over recent scans.
+  LocalCostmap costmap_;
+  // Pose that the latency compensation predicts for base_link, relative to
+  // the current one.
+  Eigen::Vector2f predicted_loc_;
+  float predicted_angle_;
 
   // Whether navigation is complete.
   bool nav_complete_;
@@ -147,9 +232,17 @@ class Navigation {
   float nav_goal_angle_;
   // Map of the environment.
   vector_map::VectorMap map_;
+  // Spatial index over the walls of map_.
+  vector_map::LineGrid map_grid_;
+  // Transform from the odometry frame to the map frame, from the latest
+  // localization, and whether there was one.
+  pose_2d::Pose2Df map_from_odom_;
+  bool map_from_odom_valid_;
 
   // Generated curvatures
   vector<float> curvatures_;
+  // Curvature chosen by the previous ChoosePathAdaptive().
+  float previous_curvature_;
 
   // Configuration
   static constexpr float dt = 0.05f;
@@ -159,6 +252,51 @@ class Navigation {
   
   // Control queue for latency compensation
   std::deque<Control> control_queue;
+  // Measured period of the current cycle of Run().
+  float cycle_dt_;
+
+  // Pipeline state. The callbacks only write into the slots while it runs,
+  // and each of the members above is used by the planning thread alone.
+  struct OdometryInput {
+    Eigen::Vector2f loc;
+    float angle;
+    Eigen::Vector2f vel;
+    float omega;
+  };
+  struct ScanInput {
+    std::vector<Eigen::Vector2f> cloud;
+    double time;
+  };
+  struct PlanningInput {
+    std::vector<Eigen::Vector2f> cloud;
+    std::vector<geometry::line2f> segments;
+    LocalCostmap costmap;
+    // Odometry when the scan was taken.
+    OdometryInput odom;
+  };
+  struct Plan {
+    float curvature;
+    // Free path length from odom_loc.
+    float free_path_length;
+    Eigen::Vector2f odom_loc;
+    // Monotonic time it was made at.
+    double time;
+  };
+  std::atomic<bool> pipeline_running_;
+  std::vector<std::thread> pipeline_threads_;
+  LatestValue<ScanInput> scan_slot_;
+  LatestValue<OdometryInput> ingestion_odom_slot_;
+  LatestValue<OdometryInput> control_odom_slot_;
+  LatestValue<PlanningInput> planning_slot_;
+  LatestValue<Plan> plan_slot_;
+  LatestValue<pose_2d::Pose2Df> map_from_odom_slot_;
+  // The latest odometry, used by the callbacks alone.
+  OdometryInput callback_odom_;
+  // The latest commands, for the latency compensation of the planner.
+  LatestValue<std::deque<Control>> control_history_slot_;
+  // Ticked at the start of every control cycle, by Run() or the control
+  // thread.
+  DeadlineMonitor control_monitor_;
 };
 
 }  // namespace navigation
@@ -43,6 +43,7 @@
 #include "nav_msgs/Odometry.h"
 #include "ros/ros.h"
 #include "shared/math/math_util.h"
+#include "shared/util/runtime_config.h"
 #include "shared/util/timer.h"
 #include "shared/ros/ros_helpers.h"
 
@@ -71,6 +72,8 @@ DEFINE_string(init_topic,
               "initialpose",
               "Name of ROS topic for initialization");
 DEFINE_string(map, "GDC1", "Name of vector map file");
+DEFINE_bool(pipeline, false,
+            "Run ingestion, planning and control on separate threads");
 
 bool run_ = true;
 sensor_msgs::LaserScan last_laser_msg_;
@@ -158,8 +161,25 @@ void StringCallback(const std_msgs::String& msg) {
   std::cout << msg.data << "\n";
 }
 
+// Prints the control loop timing every few seconds when verbose.
+void ReportControlStats(double* t_report) {
+  const double now = GetMonotonicTime();
+  if (FLAGS_v < 1 || now - *t_report < 5.0) return;
+  *t_report = now;
+  const DeadlineMonitor::Stats stats = navigation_->ControlStats();
+  printf("Control: period %.3f ms (mean %.3f, max %.3f), "
+         "jitter mean %.3f ms, max %.3f ms, %d missed\n",
+         1e3 * stats.last_period,
+         1e3 * stats.mean_period,
+         1e3 * stats.max_period,
+         1e3 * stats.mean_jitter,
+         1e3 * stats.max_jitter,
+         static_cast<int>(stats.num_overruns));
+}
+
 int main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, false);
+  runtime_config::Initialize();
   signal(SIGINT, SignalHandler);
   // Initialize ROS.
   ros::init(argc, argv, "navigation", ros::init_options::NoSigintHandler);
@@ -178,11 +198,27 @@ int main(int argc, char** argv) {
   ros::Subscriber goto_sub =
       n.subscribe("/move_base_simple/goal", 1, &GoToCallback);
 
-  RateLoop loop(20.0);
-  while (run_ && ros::ok()) {
-    ros::spinOnce();
-    navigation_->Run();
-    loop.Sleep();
+  double t_report = GetMonotonicTime();
+  if (FLAGS_pipeline) {
+    // The pipeline threads do the work; just deliver the messages promptly.
+    navigation_->StartPipeline();
+    RateLoop loop(200.0);
+    while (run_ && ros::ok()) {
+      ros::spinOnce();
+      ReportControlStats(&t_report);
+      loop.Sleep();
+    }
+    navigation_->StopPipeline();
+  } else {
+    // The main thread runs the control loop.
+    runtime_config::ConfigureRealtimeThread();
+    RateLoop loop(20.0);
+    while (run_ && ros::ok()) {
+      ros::spinOnce();
+      navigation_->Run();
+      ReportControlStats(&t_report);
+      loop.Sleep();
+    }
   }
   delete navigation_;
   return 0;
@@ -0,0 +1,92 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    vehicle_model.h
+\brief   Compile-time geometry of the supported car chassis.
+*/
+//========================================================================
+
+#include <string>
+
+#ifndef VEHICLE_MODEL_H
+#define VEHICLE_MODEL_H
+
+namespace navigation {
+
+// Chassis dimensions, in meters. The body is centered on the wheelbase, and
+// base_link is at the center of the rear axle.
+struct UtCar {
+  static constexpr float Length() { return 0.535; }
+  static constexpr float Width() { return 0.281; }
+  static constexpr float Wheelbase() { return 0.324; }
+  static constexpr float MaxCurvature() { return 1; }
+  static constexpr float SafetyMargin() { return 0.03; }
+};
+
+struct F1Tenth {
+  static constexpr float Length() { return 0.58; }
+  static constexpr float Width() { return 0.31; }
+  static constexpr float Wheelbase() { return 0.3302; }
+  // tan(0.4189 rad max steering) / wheelbase.
+  static constexpr float MaxCurvature() { return 1.348; }
+  static constexpr float SafetyMargin() { return 0.03; }
+};
+
+// Quantities the planner derives from a chassis, folded at compile time.
+template <typename Chassis>
+struct VehicleModel {
+  static constexpr float MaxCurvature() { return Chassis::MaxCurvature(); }
+
+  // The car's body, in base_link.
+  static constexpr float BodyHalfWidth() { return Chassis::Width() / 2; }
+  static constexpr float BodyFront() {
+    return (Chassis::Wheelbase() + Chassis::Length()) / 2;
+  }
+  static constexpr float BodyRear() {
+    return -(Chassis::Length() - Chassis::Wheelbase()) / 2;
+  }
+
+  // The body grown by the safety margin, which the planner keeps clear.
+  static constexpr float HalfWidth() {
+    return BodyHalfWidth() + Chassis::SafetyMargin();
+  }
+  static constexpr float Front() {
+    return BodyFront() + Chassis::SafetyMargin();
+  }
+  static constexpr float Rear() {
+    return BodyRear() - Chassis::SafetyMargin();
+  }
+};
+
+enum class ChassisType {
+  kUtCar,
+  kF1Tenth,
+};
+
+// Parses "ut_car" or "f1tenth"; returns false for anything else.
+inline bool ParseChassisType(const std::string& name, ChassisType* type) {
+  if (name == "ut_car") {
+    *type = ChassisType::kUtCar;
+  } else if (name == "f1tenth") {
+    *type = ChassisType::kF1Tenth;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace navigation
+
+#endif  // VEHICLE_MODEL_H
@@ -0,0 +1,462 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    autotune_main.cc
+\brief   Offline parameter sweep for the particle filter: replays a bag
+         through many filters in parallel and ranks their configurations
+         by error against a reference trajectory and by CPU cost.
+*/
+//========================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "nav_msgs/Odometry.h"
+#include "ros/package.h"
+#include "ros/ros.h"
+#include "rosbag/bag.h"
+#include "rosbag/view.h"
+#include "sensor_msgs/LaserScan.h"
+
+#include "config_reader/config_reader.h"
+#include "sensor_log/sensor_log.h"
+#include "shared/math/math_util.h"
+#include "shared/util/runtime_config.h"
+#include "shared/util/timer.h"
+
+#include "particle_filter.h"
+
+using Eigen::Vector2f;
+using math_util::AngleDist;
+using particle_filter::ParticleFilter;
+using particle_filter::ParticleFilterParams;
+using std::string;
+using std::vector;
+
+DEFINE_string(bag, "", "Bag file, or sensor log (.slog), to replay");
+DEFINE_string(laser_topic, "/scan", "Name of ROS topic for LIDAR data");
+DEFINE_string(odom_topic, "/odom", "Name of ROS topic for odometry data");
+DEFINE_string(reference_file, "reference_pose.csv",
+              "Reference trajectory, as written by listen_rosbag_pose");
+DEFINE_string(map, "", "Name of the map, defaults to the one in the config");
+DEFINE_string(output, "autotune.csv", "File to write the ranked results to");
+DEFINE_int32(threads, 0,
+             "Configurations evaluated in parallel, 0 for the thread budget "
+             "of --max_threads");
+DEFINE_int32(top, 10, "Number of configurations to print");
+DEFINE_double(reference_window, 1.0,
+              "Meters of the reference trajectory past the last matched pose "
+              "searched for the pose matching the next estimate");
+
+// Values to sweep, as comma-separated lists. Parameters without a list keep
+// their value from the config file. Every combination is evaluated.
+DEFINE_string(sweep_k1, "", "Values of k1 to try");
+DEFINE_string(sweep_k2, "", "Values of k2 to try");
+DEFINE_string(sweep_k3, "", "Values of k3 to try");
+DEFINE_string(sweep_k4, "", "Values of k4 to try");
+DEFINE_string(sweep_sigma_s, "", "Values of sigma_s to try");
+DEFINE_string(sweep_gamma_pow, "", "Values of gamma_pow to try");
+DEFINE_string(sweep_d_short_d_long, "", "Values of d_short_d_long to try");
+DEFINE_string(sweep_num_particles, "", "Numbers of particles to try");
+
+CONFIG_STRING(map_name_, "map");
+config_reader::ConfigReader config_reader_({"config/particle_filter.lua"});
+
+namespace {
+
+// One message of the bag or sensor log, in the order it was recorded.
+struct LogEvent {
+  bool is_laser;
+  // Laser.
+  vector<float> ranges;
+  float range_min;
+  float range_max;
+  float angle_min;
+  float angle_max;
+  // Odometry.
+  Vector2f odom_loc;
+  float odom_angle;
+};
+
+struct ReferencePose {
+  Vector2f loc;
+  float angle;
+  // Length of the reference trajectory up to this pose.
+  float distance;
+};
+
+struct Result {
+  ParticleFilterParams params;
+  // Mean distance of the estimates from their matching reference poses.
+  float mean_error;
+  float max_error;
+  // Mean angle error against the matching reference poses.
+  float mean_angle_error;
+  // Mean squared range error of the scans against the map.
+  float scan_loss;
+  // Thread CPU time of the replay.
+  double cpu_time;
+  bool pareto_optimal;
+};
+
+bool LoadSensorLog(const string& file, vector<LogEvent>* events) {
+  sensor_log::SensorLogReader reader;
+  if (!reader.Open(file)) return false;
+  reader.Replay([&](const sensor_log::LaserScan& scan) {
+    LogEvent event;
+    event.is_laser = true;
+    event.ranges = scan.ranges;
+    event.range_min = scan.range_min;
+    event.range_max = scan.range_max;
+    event.angle_min = scan.angle_min;
+    event.angle_max = scan.angle_max;
+    events->push_back(event);
+  }, [&](const sensor_log::Odometry& odometry) {
+    LogEvent event;
+    event.is_laser = false;
+    event.odom_loc = odometry.loc;
+    event.odom_angle = odometry.angle;
+    events->push_back(event);
+  });
+  return true;
+}
+
+bool LoadLog(const string& file, vector<LogEvent>* events) {
+  const string extension(sensor_log::kExtension);
+  if (file.size() >= extension.size() &&
+      file.compare(file.size() - extension.size(), extension.size(),
+                   extension) == 0) {
+    return LoadSensorLog(file, events);
+  }
+  rosbag::Bag bag;
+  try {
+    bag.open(file, rosbag::bagmode::Read);
+  } catch(rosbag::BagException& exception) {
+    fprintf(stderr, "Unable to read %s, reason:\n %s\n",
+            file.c_str(), exception.what());
+    return false;
+  }
+  rosbag::View view(bag,
+                    rosbag::TopicQuery({FLAGS_laser_topic, FLAGS_odom_topic}));
+  for (const rosbag::MessageInstance& m : view) {
+    sensor_msgs::LaserScanConstPtr laser_msg =
+        m.instantiate<sensor_msgs::LaserScan>();
+    if (laser_msg != nullptr) {
+      LogEvent event;
+      event.is_laser = true;
+      event.ranges = laser_msg->ranges;
+      event.range_min = laser_msg->range_min;
+      event.range_max = laser_msg->range_max;
+      event.angle_min = laser_msg->angle_min;
+      event.angle_max = laser_msg->angle_max;
+      events->push_back(event);
+      continue;
+    }
+    nav_msgs::OdometryConstPtr odom_msg = m.instantiate<nav_msgs::Odometry>();
+    if (odom_msg != nullptr) {
+      LogEvent event;
+      event.is_laser = false;
+      event.odom_loc = Vector2f(odom_msg->pose.pose.position.x,
+                                odom_msg->pose.pose.position.y);
+      event.odom_angle = 2.0 * atan2(odom_msg->pose.pose.orientation.z,
+                                     odom_msg->pose.pose.orientation.w);
+      events->push_back(event);
+    }
+  }
+  bag.close();
+  return true;
+}
+
+bool LoadReference(const string& file, vector<ReferencePose>* poses) {
+  std::ifstream stream(file);
+  if (!stream.good()) {
+    fprintf(stderr, "Unable to read %s\n", file.c_str());
+    return false;
+  }
+  string line;
+  while (std::getline(stream, line)) {
+    ReferencePose pose;
+    if (sscanf(line.c_str(), "%f,%f,%f",
+               &pose.loc.x(), &pose.loc.y(), &pose.angle) == 3) {
+      pose.distance = poses->empty() ? 0 :
+          poses->back().distance + (pose.loc - poses->back().loc).norm();
+      poses->push_back(pose);
+    }
+  }
+  return !poses->empty();
+}
+
+bool ParseList(const string& flag, vector<float>* values) {
+  if (flag.empty()) return true;
+  values->clear();
+  std::stringstream stream(flag);
+  string item;
+  while (std::getline(stream, item, ',')) {
+    char* end = nullptr;
+    const float value = strtof(item.c_str(), &end);
+    if (end == item.c_str()) {
+      fprintf(stderr, "Invalid value '%s' in '%s'\n",
+              item.c_str(), flag.c_str());
+      return false;
+    }
+    values->push_back(value);
+  }
+  if (values->empty()) {
+    fprintf(stderr, "No values in '%s'\n", flag.c_str());
+    return false;
+  }
+  return true;
+}
+
+// All combinations of the swept values, on top of the config file values.
+bool BuildConfigurations(vector<ParticleFilterParams>* configurations) {
+  ParticleFilterParams base = ParticleFilterParams::FromConfig();
+  // Configurations run in parallel already.
+  base.num_threads = 1;
+  // Parameters are indexed in the order of their fields below.
+  vector<float> values[8] = {
+    {base.k1}, {base.k2}, {base.k3}, {base.k4},
+    {base.sigma_s}, {base.gamma_pow}, {base.d_short_d_long},
+    {static_cast<float>(base.num_particles)},
+  };
+  const string* flags[8] = {
+    &FLAGS_sweep_k1, &FLAGS_sweep_k2, &FLAGS_sweep_k3, &FLAGS_sweep_k4,
+    &FLAGS_sweep_sigma_s, &FLAGS_sweep_gamma_pow, &FLAGS_sweep_d_short_d_long,
+    &FLAGS_sweep_num_particles,
+  };
+  size_t num_configurations = 1;
+  for (int i = 0; i < 8; ++i) {
+    if (!ParseList(*flags[i], &values[i])) return false;
+    num_configurations *= values[i].size();
+  }
+  configurations->clear();
+  for (size_t n = 0; n < num_configurations; ++n) {
+    // Mixed-radix decomposition of n into one index per parameter.
+    size_t index = n;
+    float v[8];
+    for (int i = 0; i < 8; ++i) {
+      v[i] = values[i][index % values[i].size()];
+      index /= values[i].size();
+    }
+    ParticleFilterParams params = base;
+    params.k1 = v[0];
+    params.k2 = v[1];
+    params.k3 = v[2];
+    params.k4 = v[3];
+    params.sigma_s = v[4];
+    params.gamma_pow = v[5];
+    params.d_short_d_long = v[6];
+    params.num_particles = std::max(1, static_cast<int>(v[7]));
+    configurations->push_back(params);
+  }
+  return true;
+}
+
+// Replays the log through a filter with the given parameters. The reference
+// poses carry no timestamps, so each estimate is scored against the nearest
+// reference pose, searched for only within --reference_window ahead of the
+// pose that matched the previous estimate. Matching in order keeps a path
+// that crosses or revisits itself from matching the wrong pass, which would
+// hide errors along it.
+Result Evaluate(const ParticleFilterParams& params,
+                const string& map_file,
+                const vector<LogEvent>& events,
+                const vector<ReferencePose>& reference) {
+  Result result;
+  result.params = params;
+  result.mean_error = 0;
+  result.max_error = 0;
+  result.mean_angle_error = 0;
+  result.pareto_optimal = false;
+
+  const double t_start = GetThreadCpuTime();
+  ParticleFilter pf(params);
+  pf.Initialize(map_file, reference[0].loc, reference[0].angle);
+  int num_estimates = 0;
+  size_t nearest = 0;
+  for (const LogEvent& event : events) {
+    if (!event.is_laser) {
+      pf.ObserveOdometry(event.odom_loc, event.odom_angle);
+      continue;
+    }
+    pf.ObserveLaser(event.ranges,
+                    event.range_min,
+                    event.range_max,
+                    event.angle_min,
+                    event.angle_max);
+    Vector2f loc;
+    float angle;
+    pf.GetLocation(&loc, &angle);
+    const size_t previous = nearest;
+    float nearest_sq_dist = (reference[nearest].loc - loc).squaredNorm();
+    for (size_t i = previous + 1; i < reference.size(); ++i) {
+      // Always consider the next pose, in case of a gap in the reference.
+      if (i > previous + 1 && reference[i].distance -
+          reference[previous].distance > FLAGS_reference_window) {
+        break;
+      }
+      const float sq_dist = (reference[i].loc - loc).squaredNorm();
+      if (sq_dist < nearest_sq_dist) {
+        nearest = i;
+        nearest_sq_dist = sq_dist;
+      }
+    }
+    const float error = sqrt(nearest_sq_dist);
+    result.mean_error += error;
+    result.max_error = std::max(result.max_error, error);
+    result.mean_angle_error += AngleDist(angle, reference[nearest].angle);
+    ++num_estimates;
+  }
+  result.cpu_time = GetThreadCpuTime() - t_start;
+  if (num_estimates > 0) {
+    result.mean_error /= num_estimates;
+    result.mean_angle_error /= num_estimates;
+  }
+  result.scan_loss = pf.AverageLoss();
+  return result;
+}
+
+// A configuration is Pareto-optimal if no other one is both more accurate
+// and cheaper. Expects results sorted by error, then CPU time.
+void MarkParetoFront(vector<Result>* results) {
+  double best_cpu_time = std::numeric_limits<double>::infinity();
+  for (Result& r : *results) {
+    if (r.cpu_time < best_cpu_time) {
+      r.pareto_optimal = true;
+      best_cpu_time = r.cpu_time;
+    }
+  }
+}
+
+bool WriteResults(const string& file, const vector<Result>& results) {
+  FILE* fid = fopen(file.c_str(), "w");
+  if (fid == nullptr) {
+    fprintf(stderr, "Unable to write %s\n", file.c_str());
+    return false;
+  }
+  fprintf(fid, "rank,k1,k2,k3,k4,sigma_s,gamma_pow,d_short_d_long,"
+          "num_particles,mean_error,max_error,mean_angle_error,scan_loss,"
+          "cpu_time,pareto\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    fprintf(fid, "%d,%g,%g,%g,%g,%g,%g,%g,%d,%f,%f,%f,%f,%f,%d\n",
+            static_cast<int>(i + 1),
+            r.params.k1, r.params.k2, r.params.k3, r.params.k4,
+            r.params.sigma_s, r.params.gamma_pow, r.params.d_short_d_long,
+            r.params.num_particles,
+            r.mean_error, r.max_error, r.mean_angle_error, r.scan_loss,
+            r.cpu_time, r.pareto_optimal ? 1 : 0);
+  }
+  fclose(fid);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, false);
+  if (FLAGS_bag.empty()) {
+    fprintf(stderr, "Usage: %s --bag <bag file> [--sweep_<param> a,b,c]\n",
+            argv[0]);
+    return 1;
+  }
+  ros::Time::init();
+  runtime_config::Initialize();
+
+  vector<LogEvent> events;
+  vector<ReferencePose> reference;
+  vector<ParticleFilterParams> configurations;
+  if (!LoadLog(FLAGS_bag, &events) ||
+      !LoadReference(FLAGS_reference_file, &reference) ||
+      !BuildConfigurations(&configurations)) {
+    return 1;
+  }
+  const string map = FLAGS_map.empty() ? string(CONFIG_map_name_) : FLAGS_map;
+  const string map_file = ros::package::getPath("amrl_maps") + "/" + map +
+      "/" + map + ".vectormap.txt";
+  // Hold the map for the whole sweep so that it is loaded only once.
+  const std::shared_ptr<const vector_map::MapContext> map_context =
+      vector_map::MapContext::Get(map_file,
+                                  configurations[0].map_options);
+
+  const runtime_config::WorkerThreads threads(
+      (FLAGS_threads > 0) ? 0 : configurations.size());
+  const int num_threads = (FLAGS_threads > 0) ?
+      FLAGS_threads : threads.count();
+  printf("Evaluating %d configurations on %d events with %d threads\n",
+         static_cast<int>(configurations.size()),
+         static_cast<int>(events.size()),
+         num_threads);
+
+  const double t_start = GetWallTime();
+  vector<Result> results(configurations.size());
+  std::atomic<size_t> next(0);
+  std::mutex print_mutex;
+  size_t num_done = 0;
+  vector<std::thread> workers;
+  for (int i = 0; i < num_threads; ++i) {
+    workers.emplace_back([&]() {
+      runtime_config::ConfigureWorkerThread();
+      for (size_t j = next++; j < configurations.size(); j = next++) {
+        results[j] = Evaluate(configurations[j], map_file, events, reference);
+        std::lock_guard<std::mutex> lock(print_mutex);
+        ++num_done;
+        printf("\r%d/%d configurations",
+               static_cast<int>(num_done),
+               static_cast<int>(configurations.size()));
+        fflush(stdout);
+      }
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  printf("\nDone in %.1fs\n", GetWallTime() - t_start);
+
+  std::sort(results.begin(), results.end(),
+            [](const Result& a, const Result& b) {
+    if (a.mean_error != b.mean_error) return a.mean_error < b.mean_error;
+    return a.cpu_time < b.cpu_time;
+  });
+  MarkParetoFront(&results);
+
+  printf("rank  error  angle  cpu    k1     k2     k3     k4     sigma_s "
+         "gamma  d_short particles\n");
+  const int num_printed = std::min<int>(FLAGS_top, results.size());
+  for (int i = 0; i < num_printed; ++i) {
+    const Result& r = results[i];
+    printf("%-5d %-6.3f %-6.3f %-6.2f %-6.3f %-6.3f %-6.3f %-6.3f %-7.3f "
+           "%-6.3f %-7.3f %d%s\n",
+           i + 1, r.mean_error, r.mean_angle_error, r.cpu_time,
+           r.params.k1, r.params.k2, r.params.k3, r.params.k4,
+           r.params.sigma_s, r.params.gamma_pow, r.params.d_short_d_long,
+           r.params.num_particles, r.pareto_optimal ? " *" : "");
+  }
+  return WriteResults(FLAGS_output, results) ? 0 : 1;
+}
@@ -22,15 +22,21 @@
 #include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <limits>
 #include <mutex>
+#include <string>
 #include <thread>
 #include "eigen3/Eigen/Dense"
 #include "eigen3/Eigen/Geometry"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
+#include "shared/math/fast_math.h"
 #include "shared/math/geometry.h"
 #include "shared/math/line2d.h"
+#include "shared/math/line_extraction.h"
 #include "shared/math/math_util.h"
+#include "shared/math/poses_2d.h"
+#include "shared/util/runtime_config.h"
 #include "shared/util/timer.h"
 
 #include "config_reader/config_reader.h"
@@ -48,8 +54,10 @@ using Eigen::Vector2f;
 using Eigen::Vector2i;
 using vector_map::VectorMap;
 using math_util::AngleDiff;
+using math_util::Sq;
 
 DEFINE_double(num_particles, 50, "Number of particles");
+DECLARE_int32(v);
 
 CONFIG_FLOAT(x_std, "x_std");
 CONFIG_FLOAT(y_std, "y_std");
@@ -61,20 +69,267 @@ CONFIG_FLOAT(k4, "k4");
 CONFIG_FLOAT(sigma_s, "sigma_s");
 CONFIG_FLOAT(gamma_pow, "gamma_pow");
 CONFIG_FLOAT(d_short_d_long, "d_short_d_long");
+CONFIG_STRING(observation_model, "observation_model");
+CONFIG_FLOAT(line_max_error, "line_max_error");
+CONFIG_FLOAT(line_max_gap, "line_max_gap");
+CONFIG_FLOAT(line_min_length, "line_min_length");
+CONFIG_FLOAT(line_angle_std, "line_angle_std");
+CONFIG_FLOAT(line_offset_std, "line_offset_std");
+CONFIG_FLOAT(line_max_residual, "line_max_residual");
+
+CONFIG_BOOL(coalesce_odometry, "coalesce_odometry");
+CONFIG_FLOAT(predict_rate, "predict_rate");
+
+CONFIG_FLOAT(map_grid_cell_size, "map_grid_cell_size");
+CONFIG_FLOAT(likelihood_field_resolution, "likelihood_field_resolution");
+CONFIG_FLOAT(likelihood_field_max_dist, "likelihood_field_max_dist");
+CONFIG_INT(global_loc_num_beams, "global_loc_num_beams");
+CONFIG_FLOAT(global_loc_sigma, "global_loc_sigma");
+CONFIG_FLOAT(global_loc_min_clearance, "global_loc_min_clearance");
+CONFIG_FLOAT(global_loc_coarse_xy_step, "global_loc_coarse_xy_step");
+CONFIG_FLOAT(global_loc_coarse_angle_step, "global_loc_coarse_angle_step");
+CONFIG_FLOAT(global_loc_fine_xy_step, "global_loc_fine_xy_step");
+CONFIG_INT(global_loc_num_hypotheses, "global_loc_num_hypotheses");
+CONFIG_INT(global_loc_num_modes, "global_loc_num_modes");
+CONFIG_FLOAT(global_loc_mode_separation, "global_loc_mode_separation");
+
+namespace {
+
+// A candidate pose for global localization.
+struct PoseHypothesis {
+  Vector2f loc;
+  float angle;
+  float score;
+  bool operator<(const PoseHypothesis& other) const {
+    // Best first.
+    return score > other.score;
+  }
+};
+
+// Log-likelihood of the scan endpoints (in the robot frame) from each
+// hypothesis under the likelihood field model, evaluated on the worker
+// threads that the thread budget allows.
+void ScoreHypotheses(const vector_map::LikelihoodField& field,
+                     const vector<Vector2f>& points,
+                     float sigma,
+                     vector<PoseHypothesis>* hypotheses_ptr) {
+  vector<PoseHypothesis>& hypotheses = *hypotheses_ptr;
+  const float scale = -0.5 / Sq(sigma);
+  const runtime_config::WorkerThreads threads(hypotheses.size());
+  const int num_threads = threads.count();
+  vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    workers.emplace_back([&, i]() {
+      runtime_config::ConfigureWorkerThread();
+      for (size_t j = i; j < hypotheses.size(); j += num_threads) {
+        PoseHypothesis& h = hypotheses[j];
+        const Eigen::Rotation2Df rotation(h.angle);
+        float score = 0;
+        for (const Vector2f& p : points) {
+          score += Sq(field.Distance(rotation * p + h.loc));
+        }
+        h.score = scale * score;
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+// Line features of the scan, in the robot frame, at least min_length long.
+void ExtractLineFeatures(const vector<float>& ranges,
+                         float range_min,
+                         float range_max,
+                         float angle_min,
+                         float angle_max,
+                         const particle_filter::ParticleFilterParams& params,
+                         vector<particle_filter::LineFeature>* features) {
+  features->clear();
+  if (ranges.size() < 2) return;
+  const Vector2f kLaserLoc(0.2, 0);
+  const float angle_increment = (angle_max - angle_min) / (ranges.size() - 1);
+  vector<Vector2f> points;
+  points.reserve(ranges.size());
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    if (ranges[i] <= range_min || ranges[i] >= range_max) continue;
+    Vector2f dir;
+    fast_math::FastSinCos(angle_min + i * angle_increment, &dir.y(), &dir.x());
+    points.push_back(kLaserLoc + ranges[i] * dir);
+  }
+  line_extraction::LineExtractionOptions options;
+  options.max_error = params.line_max_error;
+  options.max_gap = params.line_max_gap;
+  vector<line2f> lines;
+  line_extraction::ExtractLines(points, options, &lines);
+  for (const line2f& line : lines) {
+    const Vector2f d = line.p1 - line.p0;
+    const float length = d.norm();
+    if (length < params.line_min_length) continue;
+    features->push_back({0.5 * (line.p0 + line.p1), d / length});
+  }
+}
+
+// Keep the best n hypotheses, best first.
+void KeepBest(size_t n, vector<PoseHypothesis>* hypotheses) {
+  n = std::min(n, hypotheses->size());
+  std::partial_sort(
+      hypotheses->begin(), hypotheses->begin() + n, hypotheses->end());
+  hypotheses->resize(n);
+}
+
+// Computes the log of the sum of the weights of the particles together with
+// the weighted moments of their poses. A cheap first pass finds the largest
+// weight, and a single branch-free pass then accumulates every sum relative
+// to it (the log-sum-exp trick); a ruled out particle just adds exp(-inf) = 0.
+// Angles are taken relative to the first particle, so that the moments do not
+// suffer from wrap-around.
+// Returns -inf if all weights are zero.
+double SummarizeParticles(const particle_filter::ParticleVector& particles,
+                          particle_filter::ParticleStats* stats) {
+  const double kNegInf = -std::numeric_limits<double>::infinity();
+  const float ref_angle = particles.empty() ? 0 : particles[0].angle;
+  double max_weight = kNegInf;
+  for (const particle_filter::Particle& p : particles) {
+    max_weight = std::max(max_weight, p.weight);
+  }
+  // Sum of the weights and of their squares.
+  double w_sum = 0;
+  double w_sq_sum = 0;
+  // Weighted sums of x, y, angle offset and of their products.
+  double m_x = 0, m_y = 0, m_a = 0;
+  double m_xx = 0, m_xy = 0, m_xa = 0, m_yy = 0, m_ya = 0, m_aa = 0;
+  if (max_weight != kNegInf) {
+    for (const particle_filter::Particle& p : particles) {
+      const double w = exp(p.weight - max_weight);
+      const double x = p.loc.x();
+      const double y = p.loc.y();
+      const double a = AngleDiff(p.angle, ref_angle);
+      w_sum += w;
+      w_sq_sum += w * w;
+      m_x += w * x;
+      m_y += w * y;
+      m_a += w * a;
+      m_xx += w * x * x;
+      m_xy += w * x * y;
+      m_xa += w * x * a;
+      m_yy += w * y * y;
+      m_ya += w * y * a;
+      m_aa += w * a * a;
+    }
+  }
+
+  if (w_sum == 0) {
+    // No particles, or all of them ruled out: summarize them unweighted.
+    stats->mean_loc = Vector2f(0, 0);
+    stats->mean_angle = ref_angle;
+    stats->covariance.setZero();
+    stats->effective_sample_size = 0;
+    if (!particles.empty()) {
+      for (const particle_filter::Particle& p : particles) {
+        stats->mean_loc += p.loc;
+      }
+      stats->mean_loc /= particles.size();
+    }
+    return kNegInf;
+  }
+
+  const double x = m_x / w_sum;
+  const double y = m_y / w_sum;
+  const double a = m_a / w_sum;
+  stats->mean_loc = Vector2f(x, y);
+  stats->mean_angle = ref_angle + a;
+  Eigen::Matrix3f& cov = stats->covariance;
+  cov(0, 0) = m_xx / w_sum - x * x;
+  cov(0, 1) = cov(1, 0) = m_xy / w_sum - x * y;
+  cov(0, 2) = cov(2, 0) = m_xa / w_sum - x * a;
+  cov(1, 1) = m_yy / w_sum - y * y;
+  cov(1, 2) = cov(2, 1) = m_ya / w_sum - y * a;
+  cov(2, 2) = m_aa / w_sum - a * a;
+  stats->effective_sample_size = w_sum * w_sum / w_sq_sum;
+  return max_weight + log(w_sum);
+}
+
+memory_accounting::MemoryAccount* ParticleMemory() {
+  static memory_accounting::MemoryAccount account("particle_filter/particles");
+  return &account;
+}
+
+}  // namespace
 
 namespace particle_filter {
 
 config_reader::ConfigReader config_reader_({"config/particle_filter.lua"});
 
+ParticleFilterParams ParticleFilterParams::FromConfig() {
+  ParticleFilterParams params;
+  params.x_std = CONFIG_x_std;
+  params.y_std = CONFIG_y_std;
+  params.r_std = CONFIG_r_std;
+  params.k1 = CONFIG_k1;
+  params.k2 = CONFIG_k2;
+  params.k3 = CONFIG_k3;
+  params.k4 = CONFIG_k4;
+  params.sigma_s = CONFIG_sigma_s;
+  params.gamma_pow = CONFIG_gamma_pow;
+  params.d_short_d_long = CONFIG_d_short_d_long;
+  if (CONFIG_observation_model == "line") {
+    params.observation_model = ObservationModel::kLine;
+  } else {
+    static bool warned = false;
+    if (CONFIG_observation_model != "beam" && !warned) {
+      fprintf(stderr, "Unknown observation_model \"%s\", using \"beam\"\n",
+              CONFIG_observation_model.c_str());
+      warned = true;
+    }
+    params.observation_model = ObservationModel::kBeam;
+  }
+  params.line_max_error = CONFIG_line_max_error;
+  params.line_max_gap = CONFIG_line_max_gap;
+  params.line_min_length = CONFIG_line_min_length;
+  params.line_angle_std = CONFIG_line_angle_std;
+  params.line_offset_std = CONFIG_line_offset_std;
+  params.line_max_residual = CONFIG_line_max_residual;
+  params.num_particles = FLAGS_num_particles;
+  params.num_threads = 0;
+  params.map_options.line_grid_cell_size = CONFIG_map_grid_cell_size;
+  params.map_options.likelihood_field_resolution =
+      CONFIG_likelihood_field_resolution;
+  params.map_options.likelihood_field_max_dist = CONFIG_likelihood_field_max_dist;
+  return params;
+}
+
 ParticleFilter::ParticleFilter() :
+    ParticleFilter(ParticleFilterParams::FromConfig()) {
+  follow_config_ = true;
+}
+
+ParticleFilter::ParticleFilter(const ParticleFilterParams& params) :
+    params_(params),
+    follow_config_(false),
+    particles_(
+        memory_accounting::TrackingAllocator<Particle>(ParticleMemory())),
+    stats_valid_(false),
     prev_odom_loc_(0, 0),
     prev_odom_angle_(0),
     odom_initialized_(false),
+    odom_pending_(false),
+    pending_odom_loc_(0, 0),
+    pending_odom_angle_(0),
+    last_predict_time_(0),
+    resample_cnt_(0),
     loss_count_(0),
     loss_sum_(0.f) {}
 
+void ParticleFilter::UpdateParams() {
+  if (follow_config_) {
+    params_ = ParticleFilterParams::FromConfig();
+  }
+}
+
 void ParticleFilter::GetParticles(vector<Particle>* particles) const {
-  *particles = particles_;
+  particles->assign(particles_.begin(), particles_.end());
 }
 
 void ParticleFilter::GetPredictedPointCloud(const Vector2f& loc,
@@ -135,21 +390,25 @@ void ParticleFilter::GetPredictedPointCloud(const Vector2f& loc,
   // 
   // Location of the laser on the robot. Assumes the laser is forward-facing.
   const Vector2f kLaserLoc(0.2, 0);
-  Eigen::Rotation2Df r1(angle);
 
   // lidar center point (map frame)
-  Vector2f laser_loc = loc + r1 * kLaserLoc;
+  Vector2f laser_loc =
+      pose_2d::TransformPoint(pose_2d::Pose2Df(angle, loc), kLaserLoc);
   float angle_delta = (angle_max - angle_min) / num_ranges;
+  static const vector<line2f> kNoLines;
+  const vector<line2f>& map_lines =
+      map_context_ ? map_context_->map().lines : kNoLines;
   for (size_t i = 0; i < scan.size(); ++i) {
     float _beamAngle = i * angle_delta + angle_min;
+    Vector2f beam_dir;
+    fast_math::FastSinCos(_beamAngle + angle, &beam_dir.y(), &beam_dir.x());
     
-    line2f my_line(
-      range_min * cos(_beamAngle + angle ) + laser_loc.x(), range_min * sin(_beamAngle + angle ) + laser_loc.y(),
-      range_max * cos(_beamAngle + angle ) + laser_loc.x(), range_max * sin(_beamAngle + angle ) + laser_loc.y());
+    line2f my_line(range_min * beam_dir + laser_loc,
+                   range_max * beam_dir + laser_loc);
 
     float shortest_range = range_max;
-    for (size_t i = 0; i < map_.lines.size(); ++i) {
-      const line2f map_line = map_.lines[i];
+    for (size_t i = 0; i < map_lines.size(); ++i) {
+      const line2f& map_line = map_lines[i];
       // Check for intersections:
       // bool intersects = map_line.Intersects(my_line);
       // You can also simultaneously check for intersection, and return the point
@@ -172,10 +431,7 @@ void ParticleFilter::GetPredictedPointCloud(const Vector2f& loc,
     
     // uncomment the following line to debug
     // shortest_range = range_max;
-    scan[i] = Vector2f(
-      shortest_range * cos(_beamAngle + angle ) + laser_loc.x(), 
-      shortest_range * sin(_beamAngle + angle ) + laser_loc.y()
-    );
+    scan[i] = shortest_range * beam_dir + laser_loc;
   }
 }
 
@@ -193,8 +449,8 @@ void ParticleFilter::Update(const vector<float>& ranges,
 
   // ian =========
   // Require tuning
-  const float sigma_s = CONFIG_sigma_s;
-  const float gamma = pow(ranges.size(), CONFIG_gamma_pow); // 1 (pow = 0): uncorrelated, 1/n (pow = -1): perfectly correlated
+  const float sigma_s = params_.sigma_s;
+  const float gamma = pow(ranges.size(), params_.gamma_pow); // 1 (pow = 0): uncorrelated, 1/n (pow = -1): perfectly correlated
   vector<Vector2f> scan;
   this->GetPredictedPointCloud( p_ptr->loc,
                                 p_ptr->angle ,
@@ -206,11 +462,11 @@ void ParticleFilter::Update(const vector<float>& ranges,
                                 &scan);
   float log_prob = 0;
   const Vector2f kLaserLoc(0.2, 0);
-  float d_short = CONFIG_d_short_d_long;
-  float d_long = CONFIG_d_short_d_long;
+  float d_short = params_.d_short_d_long;
+  float d_long = params_.d_short_d_long;
 
-  Eigen::Rotation2Df r1(p_ptr->angle);
-  Vector2f laser_loc = p_ptr->loc + r1 * kLaserLoc;
+  Vector2f laser_loc = pose_2d::TransformPoint(
+      pose_2d::Pose2Df(p_ptr->angle, p_ptr->loc), kLaserLoc);
   for(size_t i=0; i< scan.size();++i)
   {
   // lidar center point (map frame)
@@ -229,6 +485,46 @@ void ParticleFilter::Update(const vector<float>& ranges,
   // ian =========
 }
 
+void ParticleFilter::UpdateLineFeatures(vector<int>* candidates,
+                                        Particle* p_ptr) const {
+  if (!map_context_) return;
+  const vector_map::LineGrid& line_grid = map_context_->line_grid();
+  const vector<line2f>& map_lines = line_grid.lines();
+  // Each feature is scored by the map line that explains it best, on the
+  // squared residuals of its angle and of the offset of its midpoint. A
+  // feature without a map line within line_max_residual (e.g. a person)
+  // costs as much as one at that residual.
+  const float max_cost = Sq(params_.line_max_residual);
+  const float max_offset = params_.line_max_residual * params_.line_offset_std;
+  const float angle_scale = 1.0 / Sq(params_.line_angle_std);
+  const float offset_scale = 1.0 / Sq(params_.line_offset_std);
+  const Eigen::Rotation2Df rotation(p_ptr->angle);
+  float cost = 0;
+  for (const LineFeature& feature : line_features_) {
+    const Vector2f mid = rotation * feature.mid + p_ptr->loc;
+    const Vector2f dir = rotation * feature.dir;
+    line_grid.GetCandidates(mid - Vector2f(max_offset, max_offset),
+                            mid + Vector2f(max_offset, max_offset),
+                            candidates);
+    float best = max_cost;
+    for (const int id : *candidates) {
+      const line2f& line = map_lines[id];
+      const Vector2f d = line.p1 - line.p0;
+      const float length_sq = d.squaredNorm();
+      if (length_sq == 0) continue;
+      // Squared sine of the angle between the lines, which does not depend
+      // on their directions and needs no trigonometry.
+      const float sin_sq = Sq(dir.x() * d.y() - dir.y() * d.x()) / length_sq;
+      const Vector2f q =
+          geometry::ProjectPointOntoLineSegment(mid, line.p0, line.p1);
+      best = std::min(
+          best, angle_scale * sin_sq + offset_scale * (mid - q).squaredNorm());
+    }
+    cost += best;
+  }
+  p_ptr->weight += -0.5 * cost;
+}
+
 void ParticleFilter::RecordLoss(const vector<float>& ranges,
                                 float range_min,
                                 float range_max,
@@ -253,8 +549,8 @@ void ParticleFilter::RecordLoss(const vector<float>& ranges,
                                angle_max,
                                &scan);
   const Vector2f kLaserLoc(0.2, 0);
-  const Eigen::Rotation2Df r1(angle);
-  const Vector2f laser_loc = loc + r1 * kLaserLoc;
+  const Vector2f laser_loc =
+      pose_2d::TransformPoint(pose_2d::Pose2Df(angle, loc), kLaserLoc);
 
   // distance between predicted point cloud and observations
   for (size_t i = 0; i < scan.size(); ++i) {
@@ -282,16 +578,20 @@ void ParticleFilter::Report() {
 
 void ParticleFilter::PrintConfigurations() {
   cout << "\n\n===== Configurations ====="
-       << "\nx_std: " << CONFIG_x_std
-       << "\ny_std: " << CONFIG_y_std
-       << "\nr_std: " << CONFIG_r_std
-       << "\nk1: " << CONFIG_k1
-       << "\nk2: " << CONFIG_k2
-       << "\nk3: " << CONFIG_k3
-       << "\nk4: " << CONFIG_k4
-       << "\nsigma_s: " << CONFIG_sigma_s
-       << "\ngamma_pow: " << CONFIG_gamma_pow
-       << "\nd_short_d_long: " << CONFIG_d_short_d_long
+       << "\nx_std: " << params_.x_std
+       << "\ny_std: " << params_.y_std
+       << "\nr_std: " << params_.r_std
+       << "\nk1: " << params_.k1
+       << "\nk2: " << params_.k2
+       << "\nk3: " << params_.k3
+       << "\nk4: " << params_.k4
+       << "\nsigma_s: " << params_.sigma_s
+       << "\ngamma_pow: " << params_.gamma_pow
+       << "\nd_short_d_long: " << params_.d_short_d_long
+       << "\nobservation_model: "
+       << (params_.observation_model == ObservationModel::kLine ?
+           "line" : "beam")
+       << "\nnum_particles: " << params_.num_particles
        << "\n==========================\n\n";
 }
 
@@ -314,7 +614,7 @@ void ParticleFilter::Resample() {
 
   // ian ===== (successfully compile)
   // cout<< "Particles cnt: (before,after) " << particles_.size();
-  vector<Particle> new_particles;
+  ParticleVector new_particles(particles_.get_allocator());
   new_particles.reserve(particles_.size());
 
   vector<float> cmf; // cumulative mass function
@@ -323,7 +623,7 @@ void ParticleFilter::Resample() {
   for(size_t i=0; i<particles_.size();++i)
   {
     cmf[i+1] = exp(particles_[i].weight) + cmf[i];
-    particles_[i].weight = log(1/FLAGS_num_particles); //1.0f / particles_.size();
+    particles_[i].weight = -log(particles_.size());
   }
   // add 0.1 to the last boundary, won't affect the sampling
   cmf[particles_.size()] += 0.1f;
@@ -348,6 +648,7 @@ void ParticleFilter::Resample() {
   }
   // After resampling:
   particles_ = new_particles;
+  stats_valid_ = false;
   // cout<<"  "<< particles_.size() << endl;
   // ian =====
 }
@@ -360,6 +661,10 @@ void ParticleFilter::ObserveLaser(const vector<float>& ranges,
   // A new laser scan observation is available (in the laser frame)
   // Call the Update and Resample steps as necessary.
 
+  UpdateParams();
+  // Bring the particles up to date with the odometry first.
+  FlushOdometry();
+
   // Record loss for expected location (tuning purposes only)
   RecordLoss(ranges,
              range_min,
@@ -367,40 +672,92 @@ void ParticleFilter::ObserveLaser(const vector<float>& ranges,
              angle_min,
              angle_max);
 
+  // The line features are the same for all particles.
+  const bool line_model =
+      params_.observation_model == ObservationModel::kLine;
+  if (line_model) {
+    ExtractLineFeatures(ranges, range_min, range_max, angle_min, angle_max,
+                        params_, &line_features_);
+  }
+
   // parallelize the update step
-  const int numThreads = std::thread::hardware_concurrency();
-  vector<std::thread> workers;
-  workers.reserve(numThreads);
-  for (int i = 0; i < numThreads; ++i) {
-    workers.emplace_back([&](){
-      for(size_t j = i; j < particles_.size(); j += numThreads) {
-        this->Update( ranges,
-                      range_min,
-                      range_max,
-                      angle_min,
-                      angle_max,
-                      &particles_[j]);
+  const runtime_config::WorkerThreads threads(
+      (params_.num_threads > 0) ? 0 : particles_.size());
+  const int numThreads = (params_.num_threads > 0) ?
+      params_.num_threads : threads.count();
+  auto update_stride = [&](int i) {
+    vector<int> candidates;
+    for(size_t j = i; j < particles_.size(); j += numThreads) {
+      if (line_model) {
+        this->UpdateLineFeatures(&candidates, &particles_[j]);
+        continue;
       }
-    });
-  }
-  for (auto& worker : workers) {
-    worker.join();
+      this->Update( ranges,
+                    range_min,
+                    range_max,
+                    angle_min,
+                    angle_max,
+                    &particles_[j]);
+    }
+  };
+  if (numThreads == 1) {
+    // Stay on the caller's thread, e.g. for the autotuner's CPU accounting.
+    update_stride(0);
+  } else {
+    vector<std::thread> workers;
+    workers.reserve(numThreads);
+    for (int i = 0; i < numThreads; ++i) {
+      workers.emplace_back([&, i]() {
+        runtime_config::ConfigureWorkerThread();
+        update_stride(i);
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
   }
 
   this->NormalizeParticlesWeights();
 
   const int resample_period = 3;
-  static int resample_cnt = 0;
-  
-  resample_cnt ++;
-  if (resample_cnt == resample_period) {
+
+  resample_cnt_ ++;
+  if (resample_cnt_ == resample_period) {
     this->Resample();
-    resample_cnt = 0;
+    resample_cnt_ = 0;
   }
 }
 
+void ParticleFilter::ObserveOdometry(const Vector2f& odom_loc,
+                                     const float odom_angle) {
+  if (!CONFIG_coalesce_odometry || !odom_initialized_) {
+    Predict(odom_loc, odom_angle);
+    return;
+  }
+  // Predict is relative to the last applied odometry, so holding on to the
+  // latest message accumulates the motion of all of them.
+  odom_pending_ = true;
+  pending_odom_loc_ = odom_loc;
+  pending_odom_angle_ = odom_angle;
+  if (CONFIG_predict_rate > 0 &&
+      GetMonotonicTime() - last_predict_time_ >= 1.0 / CONFIG_predict_rate) {
+    FlushOdometry();
+  }
+}
+
+void ParticleFilter::FlushOdometry() {
+  if (!odom_pending_) {
+    return;
+  }
+  odom_pending_ = false;
+  Predict(pending_odom_loc_, pending_odom_angle_);
+}
+
 void ParticleFilter::Predict(const Vector2f& odom_loc,
                              const float odom_angle) {
+  UpdateParams();
+  last_predict_time_ = GetMonotonicTime();
+
   // Implement the predict step of the particle filter here.
   // A new odometry value is available (in the odom frame)
   // Implement the motion model predict step here, to propagate the particles
@@ -424,10 +781,10 @@ void ParticleFilter::Predict(const Vector2f& odom_loc,
 
   // cout << "predict motion using new odom: " << "(" << odom_loc.x() << ", " << odom_loc.y() << ")" << endl;
 
-  float k1 = CONFIG_k1; // trans error from trans model
-  float k2 = CONFIG_k2; // trans error from rotat model
-  float k3 = CONFIG_k3; // rotat error from trans model
-  float k4 = CONFIG_k4; // rotat error from rotat model
+  float k1 = params_.k1; // trans error from trans model
+  float k2 = params_.k2; // trans error from rotat model
+  float k3 = params_.k3; // rotat error from trans model
+  float k4 = params_.k4; // rotat error from rotat model
 
   // In odom frame, compute delta x, y and angle 
   // This is the "car" movement
@@ -461,15 +818,13 @@ void ParticleFilter::Predict(const Vector2f& odom_loc,
     _particle.angle = _particle.angle + dangle_map*1.01;
 
     // zero out prob (= assign -inf to log prob) to ``filter out'' the particles that pass through the wall
-    const line2f my_line(prev_x, prev_y, _particle.loc.x(), _particle.loc.y());
-    for (const auto &map_line : map_.lines) {
-      if (map_line.Intersects(my_line)) {
-        weight_change = true;
-        _particle.weight = -std::numeric_limits<double>::infinity();
-        break;
-      }
+    if (map_context_ && map_context_->line_grid().Intersects(
+        Vector2f(prev_x, prev_y), _particle.loc)) {
+      weight_change = true;
+      _particle.weight = -std::numeric_limits<double>::infinity();
     }
   }
+  stats_valid_ = false;
   if (weight_change) {
     this->NormalizeParticlesWeights();
   }
@@ -487,79 +842,206 @@ void ParticleFilter::Initialize(const string& map_file,
   // The "set_pose" button on the GUI was clicked, or an initialization message
   // was received from the log. Initialize the particles accordingly, e.g. with
   // some distribution around the provided location and angle.
-  map_.Load(map_file);
+  UpdateParams();
+  map_context_ = vector_map::MapContext::Get(map_file, params_.map_options);
   
   // TODO: questions: what frame does loc, angle in???? => map
   // reset the odometry
   odom_initialized_ = false;
+  odom_pending_ = false;
   // clear the particles
   particles_.clear();
 
   // initialize particles 
-  float x_std = CONFIG_x_std;
-  float y_std = CONFIG_y_std;
-  float r_std = CONFIG_r_std;
-  for (int i = 0; i < FLAGS_num_particles; i++) {
+  float x_std = params_.x_std;
+  float y_std = params_.y_std;
+  float r_std = params_.r_std;
+  for (int i = 0; i < params_.num_particles; i++) {
     Particle p;
     p.loc.x() = rng_.Gaussian(loc.x(), x_std);
     p.loc.y() =  rng_.Gaussian(loc.y(), y_std);
     p.angle =  rng_.Gaussian(angle, r_std);
-    p.weight = log(1/FLAGS_num_particles); // TODO: not sure????
+    p.weight = -log(params_.num_particles); // TODO: not sure????
     particles_.push_back(p);
   }
+  stats_valid_ = false;
   printf("Initialize particles/odom finished.");
 
 }
 
-void ParticleFilter::NormalizeParticlesWeights() {
-  
-  // normalize max
-  double max_prob = -std::numeric_limits<double>::infinity();
+bool ParticleFilter::GlobalLocalize(const vector<float>& ranges,
+                                    float range_min,
+                                    float range_max,
+                                    float angle_min,
+                                    float angle_max) {
+  UpdateParams();
+  if (!map_context_ || map_context_->map().lines.empty() || ranges.size() < 2) {
+    return false;
+  }
+  const vector_map::LikelihoodField& likelihood_field =
+      map_context_->likelihood_field();
 
-  for (int i = 0; i < FLAGS_num_particles; i++) {
-    max_prob = std::max(max_prob, particles_[i].weight);
+  // Evenly spaced subset of the valid beams, as points in the robot frame.
+  const Vector2f kLaserLoc(0.2, 0);
+  const float angle_increment = (angle_max - angle_min) / (ranges.size() - 1);
+  const size_t stride = std::max<size_t>(
+      1, ranges.size() / std::max(1, CONFIG_global_loc_num_beams));
+  vector<Vector2f> points;
+  for (size_t i = 0; i < ranges.size(); i += stride) {
+    if (ranges[i] <= range_min || ranges[i] >= range_max) continue;
+    const float a = angle_min + i * angle_increment;
+    points.push_back(kLaserLoc + ranges[i] * Vector2f(cos(a), sin(a)));
+  }
+  if (points.empty()) {
+    return false;
   }
 
-  // normalize sum to 1
-  double sum_prob = 0.0;
-  for (int i = 0; i < FLAGS_num_particles; i++) {
-    particles_[i].weight = exp(particles_[i].weight - max_prob);
-    sum_prob += particles_[i].weight;
+  // Coarse grid over the free space of the map.
+  float xy_step = CONFIG_global_loc_coarse_xy_step;
+  float angle_step = CONFIG_global_loc_coarse_angle_step;
+  const Vector2f field_min = likelihood_field.Min();
+  const Vector2f field_max = likelihood_field.Max();
+  vector<PoseHypothesis> hypotheses;
+  for (float x = field_min.x(); x < field_max.x(); x += xy_step) {
+    for (float y = field_min.y(); y < field_max.y(); y += xy_step) {
+      const Vector2f loc(x, y);
+      if (likelihood_field.Distance(loc) < CONFIG_global_loc_min_clearance) {
+        continue;
+      }
+      for (float a = -M_PI; a < M_PI; a += angle_step) {
+        hypotheses.push_back({loc, a, 0});
+      }
+    }
   }
 
-  for (int i = 0; i < FLAGS_num_particles; i++) {
-     particles_[i].weight = particles_[i].weight / sum_prob;
-     particles_[i].weight = log(particles_[i].weight);
+  // A sigma below the grid spacing makes the coarse levels miss the true
+  // pose, so it shrinks with the grid.
+  const size_t num_hypotheses = std::max(1, CONFIG_global_loc_num_hypotheses);
+  ScoreHypotheses(likelihood_field, points,
+                  std::max(CONFIG_global_loc_sigma, xy_step), &hypotheses);
+  KeepBest(num_hypotheses, &hypotheses);
+  while (xy_step > CONFIG_global_loc_fine_xy_step) {
+    xy_step *= 0.5;
+    angle_step *= 0.5;
+    vector<PoseHypothesis> refined;
+    refined.reserve(27 * hypotheses.size());
+    for (const PoseHypothesis& h : hypotheses) {
+      for (int dx = -1; dx <= 1; ++dx) {
+        for (int dy = -1; dy <= 1; ++dy) {
+          for (int da = -1; da <= 1; ++da) {
+            refined.push_back({h.loc + xy_step * Vector2f(dx, dy),
+                               h.angle + da * angle_step,
+                               0});
+          }
+        }
+      }
+    }
+    hypotheses.swap(refined);
+    ScoreHypotheses(likelihood_field, points,
+                    std::max(CONFIG_global_loc_sigma, xy_step), &hypotheses);
+    KeepBest(num_hypotheses, &hypotheses);
   }
+
+  // Distinct modes, best first.
+  vector<PoseHypothesis> modes;
+  for (const PoseHypothesis& h : hypotheses) {
+    if (modes.size() >= static_cast<size_t>(CONFIG_global_loc_num_modes)) break;
+    bool distinct = true;
+    for (const PoseHypothesis& m : modes) {
+      if ((m.loc - h.loc).norm() < CONFIG_global_loc_mode_separation &&
+          std::fabs(AngleDiff(m.angle, h.angle)) < 4 * angle_step) {
+        distinct = false;
+        break;
+      }
+    }
+    if (distinct) modes.push_back(h);
+  }
+  if (modes.empty()) {
+    return false;
+  }
+
+  // The particles are placed for the latest odometry, so motion that is
+  // still pending must not be applied to them again.
+  if (odom_pending_) {
+    prev_odom_loc_ = pending_odom_loc_;
+    prev_odom_angle_ = pending_odom_angle_;
+    odom_pending_ = false;
+  }
+
+  // Split the particles across the modes by likelihood.
+  vector<double> mode_weights(modes.size());
+  double sum_weights = 0;
+  for (size_t i = 0; i < modes.size(); ++i) {
+    mode_weights[i] = exp(modes[i].score - modes[0].score);
+    sum_weights += mode_weights[i];
+  }
+  const int num_particles = params_.num_particles;
+  particles_.clear();
+  particles_.reserve(num_particles);
+  for (size_t i = 0; i < modes.size(); ++i) {
+    int n = std::round(num_particles * mode_weights[i] / sum_weights);
+    if (i + 1 == modes.size()) {
+      n = num_particles - particles_.size();
+    }
+    n = std::min<int>(n, num_particles - particles_.size());
+    for (int j = 0; j < n; ++j) {
+      Particle p;
+      p.loc.x() = rng_.Gaussian(modes[i].loc.x(), xy_step);
+      p.loc.y() = rng_.Gaussian(modes[i].loc.y(), xy_step);
+      p.angle = rng_.Gaussian(modes[i].angle, angle_step);
+      p.weight = -log(num_particles);
+      particles_.push_back(p);
+    }
+  }
+  stats_valid_ = false;
+  if (FLAGS_v > 0) {
+    for (const PoseHypothesis& m : modes) {
+      printf("Global localization mode: (%f,%f) %f score=%f\n",
+             m.loc.x(), m.loc.y(), m.angle, m.score);
+    }
+  }
+  return true;
+}
+
+void ParticleFilter::NormalizeParticlesWeights() {
+  const double log_sum = SummarizeParticles(particles_, &stats_);
+  stats_valid_ = true;
+  if (log_sum == -std::numeric_limits<double>::infinity()) {
+    // Every particle was ruled out; start over from uniform weights.
+    const double uniform = -log(particles_.size());
+    for (Particle& p : particles_) {
+      p.weight = uniform;
+    }
+    return;
+  }
+  for (Particle& p : particles_) {
+    p.weight -= log_sum;
+  }
+}
+
+const ParticleStats& ParticleFilter::GetStats() const {
+  if (!stats_valid_) {
+    SummarizeParticles(particles_, &stats_);
+    stats_valid_ = true;
+  }
+  return stats_;
 }
 
-void ParticleFilter::GetLocation(Eigen::Vector2f* loc_ptr, 
+void ParticleFilter::GetLocation(Eigen::Vector2f* loc_ptr,
                                  float* angle_ptr) const {
   Vector2f& loc = *loc_ptr;
   float& angle = *angle_ptr;
-  // Compute the best estimate of the robot's location based on the current set
-  // of particles. The computed values must be set to the `loc` and `angle`
-  // variables to return them. Modify the following assignments:
-  // loc = Vector2f(0, 0);
-  // angle = 0;
-  
-  // Weighted sum over all particles
-  Vector2f weighted_sum_loc(0.0, 0.0);
-  float weighted_sum_angle = 0.0;
-  for (auto& particle : particles_) {
-    // cout << "particle: " << particle.loc << endl;
-    // cout << "particle weight: " << particle.weight << endl;
+  const ParticleStats& stats = GetStats();
+  loc = stats.mean_loc;
+  angle = stats.mean_angle;
 
-    weighted_sum_loc = weighted_sum_loc + exp(particle.weight) * particle.loc;
-    weighted_sum_angle = weighted_sum_angle + exp(particle.weight) * particle.angle;
+  if (odom_pending_) {
+    // Extrapolate with the odometry since the last Predict, rotated from the
+    // odom frame into the map frame.
+    const Eigen::Rotation2Df R_odom2map(AngleDiff(angle, prev_odom_angle_));
+    loc += R_odom2map * (pending_odom_loc_ - prev_odom_loc_);
+    angle += AngleDiff(pending_odom_angle_, prev_odom_angle_);
   }
-
-  loc = weighted_sum_loc;
-  angle = weighted_sum_angle;
-  
-  // cout << "Get previous odometry: " << prev_odom_loc_ << endl;
-  // cout << "Get Location: " << loc << endl;
-  // cout << "Get angle: " << angle / M_2PI * 360 << endl;
 }
 
 
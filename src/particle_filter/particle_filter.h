@@ -20,13 +20,15 @@
 //========================================================================
 
 #include <algorithm>
+#include <memory>
 #include <vector>
 
 #include "eigen3/Eigen/Dense"
 #include "eigen3/Eigen/Geometry"
 #include "shared/math/line2d.h"
+#include "shared/util/memory_accounting.h"
 #include "shared/util/random.h"
-#include "vector_map/vector_map.h"
+#include "vector_map/map_context.h"
 
 #ifndef SRC_PARTICLE_FILTER_H_
 #define SRC_PARTICLE_FILTER_H_
@@ -39,11 +41,82 @@ struct Particle {
   double weight;
 };
 
+// Particles of a filter, charged to the "particle_filter/particles" memory
+// account.
+typedef std::vector<Particle, memory_accounting::TrackingAllocator<Particle>>
+    ParticleVector;
+
+// How Update() scores the particles against a scan.
+enum class ObservationModel {
+  // Raycast every beam of the scan against the map.
+  kBeam,
+  // Match line features extracted from the scan against the map lines near
+  // the particle, so that the cost per particle does not depend on the
+  // number of beams.
+  kLine,
+};
+
+// A line feature of the scan, in the robot frame.
+struct LineFeature {
+  Eigen::Vector2f mid;
+  // Unit direction.
+  Eigen::Vector2f dir;
+};
+
+// Weighted summary of the particles.
+struct ParticleStats {
+  Eigen::Vector2f mean_loc;
+  float mean_angle;
+  // Covariance of (x, y, angle).
+  Eigen::Matrix3f covariance;
+  // 1 / sum(w^2) of the normalized weights: the number of particles that
+  // effectively carry the distribution, between 1 and their number.
+  float effective_sample_size;
+};
+
+// Tuning parameters of a filter, see config/particle_filter.lua.
+struct ParticleFilterParams {
+  // Initialize()
+  float x_std;
+  float y_std;
+  float r_std;
+  // Predict()
+  float k1;
+  float k2;
+  float k3;
+  float k4;
+  // Update()
+  float sigma_s;
+  float gamma_pow;
+  float d_short_d_long;
+  ObservationModel observation_model;
+  // Line features, see kLine.
+  float line_max_error;
+  float line_max_gap;
+  float line_min_length;
+  float line_angle_std;
+  float line_offset_std;
+  float line_max_residual;
+
+  int num_particles;
+  // Threads used for the update step, 0 for one per core.
+  int num_threads;
+
+  vector_map::MapContextOptions map_options;
+
+  // The current values of the config file and --num_particles.
+  static ParticleFilterParams FromConfig();
+};
+
 class ParticleFilter {
  public:
-  // Default Constructor.
+  // Default Constructor. Follows the config file, including changes made
+  // while running.
    ParticleFilter();
 
+  // Filter with fixed parameters, independent of the config file.
+  explicit ParticleFilter(const ParticleFilterParams& params);
+
   // Observe a new laser scan.
   void ObserveLaser(const std::vector<float>& ranges,
                     float range_min,
@@ -51,6 +124,12 @@ class ParticleFilter {
                     float angle_min,
                     float angle_max);
 
+  // Observe new odometry. With coalesce_odometry, the odometry is held and
+  // applied by a single Predict before the next laser update (or once per
+  // predict period), instead of predicting for every message.
+  void ObserveOdometry(const Eigen::Vector2f& odom_loc,
+                       const float odom_angle);
+
   // Predict particle motion based on odometry.
   void Predict(const Eigen::Vector2f& odom_loc,
                        const float odom_angle);
@@ -60,12 +139,30 @@ class ParticleFilter {
                   const Eigen::Vector2f& loc,
                   const float angle);
 
+  // Localize without a prior, e.g. from a cold start or after a kidnapping:
+  // search the free space of the map for the poses that best explain the
+  // scan, coarse to fine, and reinitialize the particles around the best few
+  // of them. Requires a map loaded by Initialize().
+  // Returns false, leaving the particles as they are, if there is no map, no
+  // usable ranges or no free space to search.
+  bool GlobalLocalize(const std::vector<float>& ranges,
+                      float range_min,
+                      float range_max,
+                      float angle_min,
+                      float angle_max);
+
   // Return the list of particles.
   void GetParticles(std::vector<Particle>* particles) const;
 
-  // Get robot's current location.
+  // Get robot's current location. Odometry that has not been applied to the
+  // particles yet is added on top of their mean.
   void GetLocation(Eigen::Vector2f* loc, float* angle) const;
 
+  // Mean, covariance and effective sample size of the particles. Computed
+  // along with the weight normalization, or on demand after the particles
+  // moved. Not thread-safe, like GetLocation().
+  const ParticleStats& GetStats() const;
+
   // Update particle weight based on laser.
   void Update(const std::vector<float>& ranges,
               float range_min,
@@ -81,8 +178,14 @@ class ParticleFilter {
                   float angle_min,
                   float angle_max);
   void Report();
+  // Mean squared range error of the scans recorded so far.
+  float AverageLoss() const {
+    return (loss_count_ > 0) ? loss_sum_ / loss_count_ : 0;
+  }
   void PrintConfigurations();
 
+  const ParticleFilterParams& params() const { return params_; }
+
   // Resample particles.
   void Resample();
 
@@ -96,15 +199,34 @@ class ParticleFilter {
                               float angle_max,
                               std::vector<Eigen::Vector2f>* scan);
   
-  void NormalizeParticlesWeights(); 
+  // Normalize the log weights so that their exponentials sum to one, and
+  // update the stats on the way.
+  void NormalizeParticlesWeights();
 
  private:
 
+  // Reload params_ from the config if following it.
+  void UpdateParams();
+
+  // Update particle weight based on line_features_. candidates is scratch
+  // space, so that threads can reuse their own.
+  void UpdateLineFeatures(std::vector<int>* candidates, Particle* p) const;
+
+  ParticleFilterParams params_;
+  bool follow_config_;
+
   // List of particles being tracked.
-  std::vector<Particle> particles_;
+  ParticleVector particles_;
+
+  // Line features of the latest scan, for the kLine observation model.
+  std::vector<LineFeature> line_features_;
+
+  // Stats of particles_, valid until the particles change.
+  mutable ParticleStats stats_;
+  mutable bool stats_valid_;
 
-  // Map of the environment.
-  vector_map::VectorMap map_;
+  // Map of the environment, shared with other filters using the same map.
+  std::shared_ptr<const vector_map::MapContext> map_context_;
 
   // Random number generator.
   util_random::Random rng_;
@@ -114,6 +236,18 @@ class ParticleFilter {
   float prev_odom_angle_;
   bool odom_initialized_;
 
+  // Apply the pending odometry, if any.
+  void FlushOdometry();
+
+  // Latest odometry not yet applied by Predict.
+  bool odom_pending_;
+  Eigen::Vector2f pending_odom_loc_;
+  float pending_odom_angle_;
+  double last_predict_time_;
+
+  // Updates since the last resampling.
+  int resample_cnt_;
+
   // tuning
   int loss_count_;
   float loss_sum_;
@@ -41,10 +41,13 @@
 #include "rosbag/bag.h"
 #include "rosbag/view.h"
 #include "ros/package.h"
+#include "std_msgs/Empty.h"
 
 #include "config_reader/config_reader.h"
 #include "shared/math/math_util.h"
 #include "shared/math/line2d.h"
+#include "shared/util/memory_accounting.h"
+#include "shared/util/runtime_config.h"
 #include "shared/util/timer.h"
 
 #include "particle_filter.h"
@@ -72,6 +75,15 @@ DEFINE_string(odom_topic, "/odom", "Name of ROS topic for odometry data");
 DEFINE_string(init_topic,
               "/set_pose",
               "Name of ROS topic for initialization");
+DEFINE_string(global_localization_topic,
+              "/global_localization",
+              "Name of ROS topic that triggers global localization");
+DEFINE_bool(global_localization, false,
+            "Globally localize from the first scan instead of starting at "
+            "the configured initial pose");
+DEFINE_double(memory_report_period, 0,
+              "Print the memory usage of the subsystems every this many "
+              "seconds, 0 to disable");
 
 DECLARE_int32(v);
 
@@ -90,6 +102,8 @@ ros::Publisher laser_publisher_;
 VisualizationMsg vis_msg_;
 amrl_msgs::Localization2DMsg localization_msg_;
 sensor_msgs::LaserScan last_laser_msg_;
+// Globally localize from the next scan.
+bool global_localization_pending_ = false;
 
 vector<Vector2f> trajectory_points_;
 string current_map_;
@@ -183,6 +197,18 @@ void LaserCallback(const sensor_msgs::LaserScan& msg) {
     printf("Laser t=%f\n", msg.header.stamp.toSec());
   }
   last_laser_msg_ = msg;
+  if (global_localization_pending_) {
+    const double t_start = GetMonotonicTime();
+    if (particle_filter_.GlobalLocalize(
+        msg.ranges, msg.range_min, msg.range_max, msg.angle_min,
+        msg.angle_max)) {
+      global_localization_pending_ = false;
+      trajectory_points_.clear();
+      printf("Global localization took %.3fs\n", GetMonotonicTime() - t_start);
+    }
+    PublishVisualization();
+    return;
+  }
   particle_filter_.ObserveLaser(
       msg.ranges,
       msg.range_min,
@@ -211,7 +237,7 @@ void OdometryCallback(const nav_msgs::Odometry& msg) {
   const Vector2f odom_loc(msg.pose.pose.position.x, msg.pose.pose.position.y);
   const float odom_angle =
       2.0 * atan2(msg.pose.pose.orientation.z, msg.pose.pose.orientation.w);
-  particle_filter_.Predict(odom_loc, odom_angle);
+  particle_filter_.ObserveOdometry(odom_loc, odom_angle);
   PublishLocation();
   PublishVisualization();
 }
@@ -235,6 +261,10 @@ void InitCallback(const amrl_msgs::Localization2DMsg& msg) {
   trajectory_points_.clear();
 }
 
+void GlobalLocalizationCallback(const std_msgs::Empty& msg) {
+  global_localization_pending_ = true;
+}
+
 void ProcessLive(ros::NodeHandle* n) {
   ros::Subscriber initial_pose_sub = n->subscribe(
       FLAGS_init_topic.c_str(),
@@ -248,6 +278,11 @@ void ProcessLive(ros::NodeHandle* n) {
       FLAGS_odom_topic.c_str(),
       1,
       OdometryCallback);
+  ros::Subscriber global_localization_sub = n->subscribe(
+      FLAGS_global_localization_topic.c_str(),
+      1,
+      GlobalLocalizationCallback);
+  global_localization_pending_ = FLAGS_global_localization;
   particle_filter_.Initialize(
       GetMapFileFromName(current_map_),
       Vector2f(CONFIG_init_x_, CONFIG_init_x_),
@@ -271,6 +306,10 @@ void SignalHandler(int) {
 
 int main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, false);
+  runtime_config::Initialize();
+  if (FLAGS_memory_report_period > 0) {
+    memory_accounting::StartPeriodicReports(FLAGS_memory_report_period);
+  }
   signal(SIGINT, SignalHandler);
   // Initialize ROS.
   ros::init(argc, argv, "particle_filter", ros::init_options::NoSigintHandler);
@@ -0,0 +1,313 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    sensor_log.cc
+\brief   Compact columnar log of laser scans and odometry.
+*/
+//========================================================================
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "sensor_log/sensor_log.h"
+
+using Eigen::Vector2f;
+using std::string;
+using std::vector;
+
+namespace {
+
+// File layout, in native (little endian) byte order: the header, then the
+// columns in the order of the reader's Layout(), each padded to 8 bytes.
+struct Header {
+  char magic[4];
+  uint32_t version;
+  uint64_t num_scans;
+  uint64_t num_odometry;
+  // Bytes of encoded ranges.
+  uint64_t ranges_size;
+};
+
+const char kMagic[4] = {'S', 'L', 'O', 'G'};
+const uint32_t kVersion = 1;
+const size_t kAlignment = 8;
+
+// Ranges are stored as millimeters, with this for beams without a return.
+const uint16_t kNoReturn = 65535;
+
+size_t Align(size_t size) {
+  return (size + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+uint16_t Quantize(float range) {
+  // Also false for NaN.
+  if (!(range < (kNoReturn - 0.5f) / 1000.0f)) return kNoReturn;
+  if (range <= 0) return 0;
+  return static_cast<uint16_t>(std::lround(range * 1000.0f));
+}
+
+void PutVarint(uint32_t value, vector<uint8_t>* bytes) {
+  while (value >= 0x80) {
+    bytes->push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  bytes->push_back(static_cast<uint8_t>(value));
+}
+
+bool WriteColumn(FILE* fid, const void* data, size_t size) {
+  static const char kPadding[kAlignment] = {0};
+  return fwrite(data, 1, size, fid) == size &&
+      fwrite(kPadding, 1, Align(size) - size, fid) == Align(size) - size;
+}
+
+template <typename T>
+bool WriteColumn(FILE* fid, const vector<T>& column) {
+  return WriteColumn(fid, column.data(), column.size() * sizeof(T));
+}
+
+}  // namespace
+
+namespace sensor_log {
+
+const char kExtension[] = ".slog";
+
+void SensorLogWriter::AddScan(const LaserScan& scan) {
+  scan_time_.push_back(scan.time);
+  scan_angle_min_.push_back(scan.angle_min);
+  scan_angle_max_.push_back(scan.angle_max);
+  scan_range_min_.push_back(scan.range_min);
+  scan_range_max_.push_back(scan.range_max);
+  scan_num_ranges_.push_back(scan.ranges.size());
+  int32_t previous = 0;
+  for (const float range : scan.ranges) {
+    const int32_t value = Quantize(range);
+    const int32_t delta = value - previous;
+    previous = value;
+    // Zigzag: small magnitudes of either sign become small unsigned values.
+    PutVarint((static_cast<uint32_t>(delta) << 1) ^
+                  static_cast<uint32_t>(delta >> 31),
+              &ranges_);
+  }
+  scan_offset_.push_back(ranges_.size());
+}
+
+void SensorLogWriter::AddOdometry(const Odometry& odometry) {
+  odom_time_.push_back(odometry.time);
+  odom_x_.push_back(odometry.loc.x());
+  odom_y_.push_back(odometry.loc.y());
+  odom_angle_.push_back(odometry.angle);
+  odom_vx_.push_back(odometry.velocity.x());
+  odom_vy_.push_back(odometry.velocity.y());
+  odom_angular_velocity_.push_back(odometry.angular_velocity);
+}
+
+bool SensorLogWriter::Write(const string& file) const {
+  FILE* fid = fopen(file.c_str(), "wb");
+  if (fid == nullptr) {
+    fprintf(stderr, "ERROR: Unable to write %s\n", file.c_str());
+    return false;
+  }
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.num_scans = scan_time_.size();
+  header.num_odometry = odom_time_.size();
+  header.ranges_size = ranges_.size();
+  // Must match SensorLogReader::Open().
+  const bool ok = WriteColumn(fid, &header, sizeof(header)) &&
+      WriteColumn(fid, scan_time_) &&
+      WriteColumn(fid, scan_angle_min_) &&
+      WriteColumn(fid, scan_angle_max_) &&
+      WriteColumn(fid, scan_range_min_) &&
+      WriteColumn(fid, scan_range_max_) &&
+      WriteColumn(fid, scan_offset_) &&
+      WriteColumn(fid, scan_num_ranges_) &&
+      WriteColumn(fid, odom_time_) &&
+      WriteColumn(fid, odom_x_) &&
+      WriteColumn(fid, odom_y_) &&
+      WriteColumn(fid, odom_angle_) &&
+      WriteColumn(fid, odom_vx_) &&
+      WriteColumn(fid, odom_vy_) &&
+      WriteColumn(fid, odom_angular_velocity_) &&
+      WriteColumn(fid, ranges_);
+  if (fclose(fid) != 0 || !ok) {
+    fprintf(stderr, "ERROR: Unable to write %s\n", file.c_str());
+    return false;
+  }
+  return true;
+}
+
+SensorLogReader::SensorLogReader() :
+    data_(nullptr),
+    size_(0),
+    num_scans_(0),
+    num_odometry_(0) {}
+
+SensorLogReader::~SensorLogReader() {
+  Close();
+}
+
+bool SensorLogReader::Open(const string& file) {
+  Close();
+  const int fd = open(file.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) != 0) {
+    fprintf(stderr, "ERROR: Unable to read %s\n", file.c_str());
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  size_ = file_stat.st_size;
+  if (size_ >= sizeof(Header)) {
+    data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  // The mapping stays valid without the descriptor.
+  close(fd);
+  if (data_ == nullptr || data_ == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Unable to map %s\n", file.c_str());
+    data_ = nullptr;
+    return false;
+  }
+  // Start reading ahead; replays touch the whole file anyway.
+  madvise(data_, size_, MADV_WILLNEED);
+
+  const uint8_t* const bytes = static_cast<const uint8_t*>(data_);
+  Header header;
+  memcpy(&header, bytes, sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion) {
+    fprintf(stderr, "ERROR: %s is not a sensor log\n", file.c_str());
+    Close();
+    return false;
+  }
+  // Walk the columns in the order Write() wrote them, checking that they fit
+  // in the file.
+  const size_t num_scans = header.num_scans;
+  const size_t num_odometry = header.num_odometry;
+  size_t offset = Align(sizeof(header));
+  bool truncated = false;
+  auto column = [&](size_t size) {
+    const uint8_t* start = bytes + offset;
+    offset += Align(size);
+    truncated = truncated || offset > size_;
+    return start;
+  };
+  scan_time_ = reinterpret_cast<const double*>(
+      column(num_scans * sizeof(double)));
+  scan_angle_min_ = reinterpret_cast<const float*>(
+      column(num_scans * sizeof(float)));
+  scan_angle_max_ = reinterpret_cast<const float*>(
+      column(num_scans * sizeof(float)));
+  scan_range_min_ = reinterpret_cast<const float*>(
+      column(num_scans * sizeof(float)));
+  scan_range_max_ = reinterpret_cast<const float*>(
+      column(num_scans * sizeof(float)));
+  scan_offset_ = reinterpret_cast<const uint64_t*>(
+      column((num_scans + 1) * sizeof(uint64_t)));
+  scan_num_ranges_ = reinterpret_cast<const uint32_t*>(
+      column(num_scans * sizeof(uint32_t)));
+  odom_time_ = reinterpret_cast<const double*>(
+      column(num_odometry * sizeof(double)));
+  odom_x_ = reinterpret_cast<const float*>(
+      column(num_odometry * sizeof(float)));
+  odom_y_ = reinterpret_cast<const float*>(
+      column(num_odometry * sizeof(float)));
+  odom_angle_ = reinterpret_cast<const float*>(
+      column(num_odometry * sizeof(float)));
+  odom_vx_ = reinterpret_cast<const float*>(
+      column(num_odometry * sizeof(float)));
+  odom_vy_ = reinterpret_cast<const float*>(
+      column(num_odometry * sizeof(float)));
+  odom_angular_velocity_ = reinterpret_cast<const float*>(
+      column(num_odometry * sizeof(float)));
+  ranges_ = column(header.ranges_size);
+  if (truncated ||
+      (num_scans > 0 && scan_offset_[num_scans] != header.ranges_size)) {
+    fprintf(stderr, "ERROR: %s is truncated\n", file.c_str());
+    Close();
+    return false;
+  }
+  num_scans_ = num_scans;
+  num_odometry_ = num_odometry;
+  return true;
+}
+
+void SensorLogReader::Close() {
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+  num_scans_ = 0;
+  num_odometry_ = 0;
+}
+
+void SensorLogReader::GetScan(size_t i, LaserScan* scan) const {
+  scan->time = scan_time_[i];
+  scan->angle_min = scan_angle_min_[i];
+  scan->angle_max = scan_angle_max_[i];
+  scan->range_min = scan_range_min_[i];
+  scan->range_max = scan_range_max_[i];
+  scan->ranges.resize(scan_num_ranges_[i]);
+  const uint8_t* p = ranges_ + scan_offset_[i];
+  uint32_t value = 0;
+  for (float& range : scan->ranges) {
+    uint32_t zigzag = 0;
+    for (int shift = 0; ; shift += 7) {
+      const uint8_t byte = *p++;
+      zigzag |= static_cast<uint32_t>(byte & 0x7F) << shift;
+      if (byte < 0x80) break;
+    }
+    value += (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+    range = (value == kNoReturn) ?
+        std::numeric_limits<float>::infinity() : 0.001f * value;
+  }
+}
+
+void SensorLogReader::GetOdometry(size_t i, Odometry* odometry) const {
+  odometry->time = odom_time_[i];
+  odometry->loc = Vector2f(odom_x_[i], odom_y_[i]);
+  odometry->angle = odom_angle_[i];
+  odometry->velocity = Vector2f(odom_vx_[i], odom_vy_[i]);
+  odometry->angular_velocity = odom_angular_velocity_[i];
+}
+
+void SensorLogReader::Replay(
+    const std::function<void(const LaserScan&)>& on_scan,
+    const std::function<void(const Odometry&)>& on_odometry) const {
+  LaserScan scan;
+  Odometry odometry;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < num_scans_ || j < num_odometry_) {
+    if (j < num_odometry_ &&
+        (i == num_scans_ || odom_time_[j] <= scan_time_[i])) {
+      GetOdometry(j++, &odometry);
+      on_odometry(odometry);
+    } else {
+      GetScan(i++, &scan);
+      on_scan(scan);
+    }
+  }
+}
+
+}  // namespace sensor_log
@@ -0,0 +1,160 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    sensor_log.h
+\brief   Compact columnar log of laser scans and odometry, readable
+         without ROS and replayed straight from a memory map.
+*/
+//========================================================================
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#ifndef SENSOR_LOG_H
+#define SENSOR_LOG_H
+
+namespace sensor_log {
+
+// File name extension of sensor logs.
+extern const char kExtension[];
+
+// Times are when the messages were received (or recorded in a bag), in
+// seconds, which is the order the robot's software saw them in.
+struct LaserScan {
+  double time;
+  float angle_min;
+  float angle_max;
+  float range_min;
+  float range_max;
+  // Ranges are stored in millimeters, so they come back rounded to the
+  // nearest millimeter. Beams without a return (infinite, NaN, or beyond
+  // 65.534 m) come back as infinity.
+  std::vector<float> ranges;
+};
+
+struct Odometry {
+  double time;
+  Eigen::Vector2f loc;
+  float angle;
+  Eigen::Vector2f velocity;
+  float angular_velocity;
+};
+
+// Collects scans and odometry, and writes them as a sensor log.
+//
+// The log holds one column per field, plus the ranges of all scans, each
+// delta coded from the previous beam and stored as a zigzag varint: the
+// range differences between neighboring beams are mostly a few centimeters,
+// which takes one or two bytes instead of the four of a float.
+class SensorLogWriter {
+ public:
+  SensorLogWriter() : scan_offset_(1, 0) {}
+
+  void AddScan(const LaserScan& scan);
+  void AddOdometry(const Odometry& odometry);
+
+  size_t NumScans() const { return scan_time_.size(); }
+  size_t NumOdometry() const { return odom_time_.size(); }
+
+  // Writes everything added so far to file. Returns false, with a message
+  // on stderr, if the file could not be written.
+  bool Write(const std::string& file) const;
+
+ private:
+  std::vector<double> scan_time_;
+  std::vector<float> scan_angle_min_;
+  std::vector<float> scan_angle_max_;
+  std::vector<float> scan_range_min_;
+  std::vector<float> scan_range_max_;
+  // Where the ranges of each scan start in ranges_, and where the last one
+  // ends.
+  std::vector<uint64_t> scan_offset_;
+  std::vector<uint32_t> scan_num_ranges_;
+  std::vector<uint8_t> ranges_;
+
+  std::vector<double> odom_time_;
+  std::vector<float> odom_x_;
+  std::vector<float> odom_y_;
+  std::vector<float> odom_angle_;
+  std::vector<float> odom_vx_;
+  std::vector<float> odom_vy_;
+  std::vector<float> odom_angular_velocity_;
+};
+
+// Reads a sensor log by mapping it into memory: nothing is read up front,
+// and once the pages have been touched, replaying the log again does no I/O.
+// Accessors are const and the mapping is read-only, so any number of threads
+// can read the same log.
+class SensorLogReader {
+ public:
+  SensorLogReader();
+  ~SensorLogReader();
+
+  // Maps file. Returns false, with a message on stderr, if it could not be
+  // read or is not a sensor log.
+  bool Open(const std::string& file);
+  void Close();
+
+  size_t NumScans() const { return num_scans_; }
+  size_t NumOdometry() const { return num_odometry_; }
+
+  double ScanTime(size_t i) const { return scan_time_[i]; }
+  double OdometryTime(size_t i) const { return odom_time_[i]; }
+
+  // Decodes scan i into scan, reusing its storage.
+  void GetScan(size_t i, LaserScan* scan) const;
+  void GetOdometry(size_t i, Odometry* odometry) const;
+
+  // Calls on_scan and on_odometry for every message in time order, odometry
+  // first on ties. The scan passed to on_scan is only valid during the call.
+  void Replay(const std::function<void(const LaserScan&)>& on_scan,
+              const std::function<void(const Odometry&)>& on_odometry) const;
+
+ private:
+  SensorLogReader(const SensorLogReader&) = delete;
+  SensorLogReader& operator=(const SensorLogReader&) = delete;
+
+  // The mapping.
+  void* data_;
+  size_t size_;
+
+  size_t num_scans_;
+  size_t num_odometry_;
+  // Columns, pointing into the mapping.
+  const double* scan_time_;
+  const float* scan_angle_min_;
+  const float* scan_angle_max_;
+  const float* scan_range_min_;
+  const float* scan_range_max_;
+  const uint64_t* scan_offset_;
+  const uint32_t* scan_num_ranges_;
+  const uint8_t* ranges_;
+  const double* odom_time_;
+  const float* odom_x_;
+  const float* odom_y_;
+  const float* odom_angle_;
+  const float* odom_vx_;
+  const float* odom_vy_;
+  const float* odom_angular_velocity_;
+};
+
+}  // namespace sensor_log
+
+#endif  // SENSOR_LOG_H
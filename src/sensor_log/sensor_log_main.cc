@@ -0,0 +1,159 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    sensor_log_main.cc
+\brief   Converts the laser scans and odometry of a bag to a sensor log, or
+         records them live from ROS.
+*/
+//========================================================================
+
+#include <signal.h>
+#include <stdio.h>
+#include <cmath>
+#include <string>
+
+#include "gflags/gflags.h"
+#include "nav_msgs/Odometry.h"
+#include "ros/ros.h"
+#include "rosbag/bag.h"
+#include "rosbag/view.h"
+#include "sensor_msgs/LaserScan.h"
+
+#include "sensor_log/sensor_log.h"
+#include "shared/util/runtime_config.h"
+
+using sensor_log::SensorLogWriter;
+using std::string;
+
+DEFINE_string(bag, "", "Bag file to convert; records live if empty");
+DEFINE_string(output, "", "Sensor log file to write");
+DEFINE_string(laser_topic, "/scan", "Name of ROS topic for LIDAR data");
+DEFINE_string(odom_topic, "/odom", "Name of ROS topic for odometry data");
+
+namespace {
+
+SensorLogWriter writer_;
+bool run_ = true;
+
+sensor_log::LaserScan ToLaserScan(const sensor_msgs::LaserScan& msg,
+                                  double time) {
+  sensor_log::LaserScan scan;
+  scan.time = time;
+  scan.angle_min = msg.angle_min;
+  scan.angle_max = msg.angle_max;
+  scan.range_min = msg.range_min;
+  scan.range_max = msg.range_max;
+  scan.ranges = msg.ranges;
+  return scan;
+}
+
+sensor_log::Odometry ToOdometry(const nav_msgs::Odometry& msg, double time) {
+  sensor_log::Odometry odometry;
+  odometry.time = time;
+  odometry.loc = Eigen::Vector2f(msg.pose.pose.position.x,
+                                 msg.pose.pose.position.y);
+  odometry.angle =
+      2.0 * atan2(msg.pose.pose.orientation.z, msg.pose.pose.orientation.w);
+  odometry.velocity = Eigen::Vector2f(msg.twist.twist.linear.x,
+                                      msg.twist.twist.linear.y);
+  odometry.angular_velocity = msg.twist.twist.angular.z;
+  return odometry;
+}
+
+bool ConvertBag(const string& file) {
+  rosbag::Bag bag;
+  try {
+    bag.open(file, rosbag::bagmode::Read);
+  } catch(rosbag::BagException& exception) {
+    fprintf(stderr, "Unable to read %s, reason:\n %s\n",
+            file.c_str(), exception.what());
+    return false;
+  }
+  rosbag::View view(bag,
+                    rosbag::TopicQuery({FLAGS_laser_topic, FLAGS_odom_topic}));
+  for (const rosbag::MessageInstance& m : view) {
+    sensor_msgs::LaserScanConstPtr laser_msg =
+        m.instantiate<sensor_msgs::LaserScan>();
+    if (laser_msg != nullptr) {
+      writer_.AddScan(ToLaserScan(*laser_msg, m.getTime().toSec()));
+      continue;
+    }
+    nav_msgs::OdometryConstPtr odom_msg = m.instantiate<nav_msgs::Odometry>();
+    if (odom_msg != nullptr) {
+      writer_.AddOdometry(ToOdometry(*odom_msg, m.getTime().toSec()));
+    }
+  }
+  bag.close();
+  return true;
+}
+
+void LaserCallback(const sensor_msgs::LaserScan& msg) {
+  writer_.AddScan(ToLaserScan(msg, ros::Time::now().toSec()));
+}
+
+void OdometryCallback(const nav_msgs::Odometry& msg) {
+  writer_.AddOdometry(ToOdometry(msg, ros::Time::now().toSec()));
+}
+
+void SignalHandler(int) {
+  if (!run_) {
+    printf("Force Exit.\n");
+    exit(0);
+  }
+  run_ = false;
+}
+
+void RecordLive(ros::NodeHandle* n) {
+  ros::Subscriber laser_sub = n->subscribe(
+      FLAGS_laser_topic.c_str(),
+      100,
+      LaserCallback);
+  ros::Subscriber odom_sub = n->subscribe(
+      FLAGS_odom_topic.c_str(),
+      100,
+      OdometryCallback);
+  printf("Recording %s and %s, press Ctrl-C to stop\n",
+         FLAGS_laser_topic.c_str(), FLAGS_odom_topic.c_str());
+  while (ros::ok() && run_) {
+    ros::spinOnce();
+    ros::Duration(0.005).sleep();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, false);
+  runtime_config::Initialize();
+  if (FLAGS_output.empty()) {
+    fprintf(stderr, "Usage: %s [--bag <bag file>] --output <log%s>\n",
+            argv[0], sensor_log::kExtension);
+    return 1;
+  }
+  if (FLAGS_bag.empty()) {
+    signal(SIGINT, SignalHandler);
+    ros::init(argc, argv, "sensor_log", ros::init_options::NoSigintHandler);
+    ros::NodeHandle n;
+    RecordLive(&n);
+  } else {
+    ros::Time::init();
+    if (!ConvertBag(FLAGS_bag)) return 1;
+  }
+  printf("Writing %d scans and %d odometry messages to %s\n",
+         static_cast<int>(writer_.NumScans()),
+         static_cast<int>(writer_.NumOdometry()),
+         FLAGS_output.c_str());
+  return writer_.Write(FLAGS_output) ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#ifndef SRC_MATH_DISTANCE_TRANSFORM_H_
+#define SRC_MATH_DISTANCE_TRANSFORM_H_
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace distance_transform {
+
+// 1D squared distance transform of f (Felzenszwalb & Huttenlocher), over n
+// samples spaced stride apart. d, v and z are scratch space of at least n,
+// n and n + 1 elements.
+inline void SquaredEuclidean1D(float* f, int n, int stride,
+                               std::vector<float>* d_ptr,
+                               std::vector<int>* v_ptr,
+                               std::vector<float>* z_ptr) {
+  std::vector<float>& d = *d_ptr;
+  std::vector<int>& v = *v_ptr;
+  std::vector<float>& z = *z_ptr;
+  const float kInf = std::numeric_limits<float>::infinity();
+  // Lower envelope of the parabolas rooted at the occupied samples.
+  int q0 = 0;
+  while (q0 < n && f[q0 * stride] == kInf) ++q0;
+  if (q0 == n) return;
+  int k = 0;
+  v[0] = q0;
+  z[0] = -kInf;
+  z[1] = kInf;
+  for (int q = q0 + 1; q < n; ++q) {
+    const float fq = f[q * stride];
+    if (fq == kInf) continue;
+    float s = ((fq + q * q) - (f[v[k] * stride] + v[k] * v[k])) /
+        (2 * q - 2 * v[k]);
+    while (k > 0 && s <= z[k]) {
+      --k;
+      s = ((fq + q * q) - (f[v[k] * stride] + v[k] * v[k])) /
+          (2 * q - 2 * v[k]);
+    }
+    ++k;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = kInf;
+  }
+  k = 0;
+  for (int q = 0; q < n; ++q) {
+    while (z[k + 1] < q) ++k;
+    d[q] = (q - v[k]) * (q - v[k]) + f[v[k] * stride];
+  }
+  for (int q = 0; q < n; ++q) {
+    f[q * stride] = d[q];
+  }
+}
+
+// Exact squared Euclidean distance transform of a row-major width x height
+// grid, in place. Occupied cells must be 0 and free cells infinity; on
+// return every cell holds the squared distance, in cells, to the nearest
+// occupied one (infinity if there is none).
+inline void SquaredEuclidean(std::vector<float>* grid, int width, int height) {
+  const int n = std::max(width, height);
+  std::vector<float> d(n), z(n + 1);
+  std::vector<int> v(n);
+  float* const f = grid->data();
+  for (int x = 0; x < width; ++x) {
+    SquaredEuclidean1D(&f[x], height, width, &d, &v, &z);
+  }
+  for (int y = 0; y < height; ++y) {
+    SquaredEuclidean1D(&f[y * width], width, 1, &d, &v, &z);
+  }
+}
+
+}  // namespace distance_transform
+
+#endif  // SRC_MATH_DISTANCE_TRANSFORM_H_
@@ -0,0 +1,92 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+//
+// Polynomial approximations of trigonometric functions for hot loops, with
+// bounded absolute error. They are branch-free apart from selects and use no
+// tables, so loops over them can be vectorized. Inputs must be finite.
+
+#ifndef SRC_MATH_FAST_MATH_H_
+#define SRC_MATH_FAST_MATH_H_
+
+#include <cmath>
+
+namespace fast_math {
+
+// atan(x) for 0 <= x <= 1. Arguments above tan(pi/8) are mapped below it
+// with atan(x) = pi/4 + atan((x - 1) / (x + 1)), and the polynomial is that
+// of Cephes atanf; absolute error below 2e-7 rad.
+inline float FastAtanUnit(float x) {
+  const bool upper = x > 0.41421356f;
+  x = upper ? (x - 1.0f) / (x + 1.0f) : x;
+  const float x2 = x * x;
+  const float a = x + x * x2 * (-3.33329491539e-1f + x2 * (1.99777106478e-1f +
+      x2 * (-1.38776856032e-1f + x2 * 8.05374449538e-2f)));
+  return upper ? static_cast<float>(M_PI_4) + a : a;
+}
+
+// atan2(y, x), with absolute error below 5e-7 rad. Returns 0 for (0, 0),
+// and like atan2 follows the sign of y, including that of a zero y.
+inline float FastAtan2(float y, float x) {
+  const float ax = std::abs(x);
+  const float ay = std::abs(y);
+  const float num = (ax < ay) ? ax : ay;
+  const float den = (ax < ay) ? ay : ax;
+  float a = FastAtanUnit((den == 0) ? 0 : num / den);
+  a = (ay > ax) ? static_cast<float>(M_PI_2) - a : a;
+  a = std::signbit(x) ? static_cast<float>(M_PI) - a : a;
+  return std::copysign(a, y);
+}
+
+// acos(x) for |x| <= 1, with absolute error below 5e-7 rad (Abramowitz &
+// Stegun 4.4.46, which is within 2e-8 in exact arithmetic).
+inline float FastAcos(float x) {
+  const float ax = std::abs(x);
+  const float a = std::sqrt(1.0f - ax) * (1.5707963050f + ax * (-0.2145988016f +
+      ax * (0.0889789874f + ax * (-0.0501743046f + ax * (0.0308918810f +
+      ax * (-0.0170881256f + ax * (0.0066700901f + ax * -0.0012624911f)))))));
+  return (x < 0) ? static_cast<float>(M_PI) - a : a;
+}
+
+// asin(x) for |x| <= 1, with absolute error below 5e-7 rad.
+inline float FastAsin(float x) {
+  return static_cast<float>(M_PI_2) - FastAcos(x);
+}
+
+// Sine and cosine of a, with absolute error below 2e-7 for |a| <= 100 rad;
+// the error grows with |a| beyond that, from the range reduction. a is
+// reduced to r in [-pi/4, pi/4] plus a multiple of pi/2, and sin(r) and
+// cos(r) are evaluated with minimax polynomials (Cephes sinf/cosf).
+inline void FastSinCos(float a, float* sin_a, float* cos_a) {
+  // pi/2 split in three, so that q * pi/2 is exact for moderate q.
+  const float kPio2Hi = 1.5703125f;
+  const float kPio2Mid = 4.837512969970703125e-4f;
+  const float kPio2Lo = 7.54978995489188216e-8f;
+  const float q = std::nearbyint(a * static_cast<float>(2.0 / M_PI));
+  const float r = ((a - q * kPio2Hi) - q * kPio2Mid) - q * kPio2Lo;
+  const float r2 = r * r;
+  const float s = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f +
+      r2 * -1.9515295891e-4f));
+  const float c = 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568298827e-2f +
+      r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+  // Rotate (c, s) by the quadrant.
+  const int quadrant = static_cast<int>(q) & 3;
+  const float sin_r = (quadrant & 1) ? c : s;
+  const float cos_r = (quadrant & 1) ? s : c;
+  *sin_a = (quadrant & 2) ? -sin_r : sin_r;
+  *cos_a = ((quadrant + 1) & 2) ? -cos_r : cos_r;
+}
+
+}  // namespace fast_math
+
+#endif  // SRC_MATH_FAST_MATH_H_
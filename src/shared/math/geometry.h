@@ -463,8 +463,15 @@ T MinDistanceLineLine(const Eigen::Matrix<T, 2, 1>& a0,
   return std::sqrt(min_diff_sq);
 }
 
-// Check if line segment collides min and max angle on a circle, moving in a
-// counterclockwise direction from min_angle to max_angle.
+// Minimum distance between the line segment l0-l1 and the arc of the circle
+// around a_center with radius a_radius, from a_angle_start to a_angle_end
+// counterclockwise (rotation_sign 1) or clockwise (rotation_sign -1). Zero if
+// they intersect.
+//
+// The closest points are either an intersection, an end of one of them and
+// the closest point of the other, or the interior points on the ray from
+// a_center perpendicular to the segment; each candidate is a distance between
+// points of the two, so their minimum is the exact distance.
 template <typename T>
 T MinDistanceLineArc(const Eigen::Matrix<T, 2, 1>& l0,
                      const Eigen::Matrix<T, 2, 1>& l1,
@@ -473,148 +480,52 @@ T MinDistanceLineArc(const Eigen::Matrix<T, 2, 1>& l0,
                      T a_angle_start,
                      T a_angle_end,
                      const int rotation_sign) {
+  typedef Eigen::Matrix<T, 2, 1> Vector2T;
   a_angle_start = math_util::AngleMod(a_angle_start);
   a_angle_end = math_util::AngleMod(a_angle_end);
-  const auto proj_center_segment =
-      ProjectPointOntoLineSegment(a_center, l0, l1);
-  const auto proj_dir_segment = proj_center_segment - a_center;
-
-  const auto l0_dir = l0 - a_center;
-  const auto l1_dir = l1 - a_center;
-
-  if (proj_dir_segment.squaredNorm() >= Sq(a_radius) ||
-      (l0_dir.squaredNorm() < Sq(a_radius) &&
-       l1_dir.squaredNorm() < Sq(a_radius))) {
-    // Out of the circle, tangent to circle, or completely in circle.
-    const T angle = math_util::AngleMod(Angle<T>(proj_dir_segment));
-    if (math_util::IsAngleBetween(
-        angle, a_angle_start, a_angle_end, rotation_sign)) {
-      // Vector of the center projected onto line segment is in arc.
-      const float distance_to_proj = (proj_dir_segment.norm() - a_radius);
-      if (distance_to_proj >= T(0)) {
-        return distance_to_proj;
+  const auto in_arc = [&](const Vector2T& p) {
+    return math_util::IsAngleBetween(
+        math_util::AngleMod(Angle<T>(Vector2T(p - a_center))),
+        a_angle_start, a_angle_end, rotation_sign);
+  };
+  const Vector2T a0 = a_center + Heading(a_angle_start) * a_radius;
+  const Vector2T a1 = a_center + Heading(a_angle_end) * a_radius;
+
+  // Intersections of the segment with the circle, at l0 + t (l1 - l0).
+  const Vector2T d = l1 - l0;
+  const Vector2T f = l0 - a_center;
+  const T a = d.squaredNorm();
+  if (a > T(0)) {
+    const T b = f.dot(d);
+    const T discriminant = Sq(b) - a * (f.squaredNorm() - Sq(a_radius));
+    if (discriminant >= T(0)) {
+      const T root = std::sqrt(discriminant);
+      for (const T t : {(-b - root) / a, (-b + root) / a}) {
+        if (t >= T(0) && t <= T(1) && in_arc(Vector2T(l0 + t * d))) {
+          return T(0);
+        }
       }
     }
-    // Vector of the center projected onto line segment is not in arc.
-    const auto a_angle_min_v = Heading(a_angle_start) * a_radius;
-    const auto a_angle_max_v = Heading(a_angle_end) * a_radius;
-    return std::sqrt(
-        std::min((proj_dir_segment - a_angle_min_v).squaredNorm(),
-                 (proj_dir_segment - a_angle_max_v).squaredNorm()));
   }
 
-  const auto proj_center_line = ProjectPointOntoLine(a_center, l0, l1);
-  const auto proj_dir_line = proj_center_line - a_center;
-  const T along_line_dist =
-      std::sqrt(Sq(a_radius) - proj_dir_line.squaredNorm());
-
-  static const auto direction_line_intersects_arc =
-      [](const Eigen::Matrix<T, 2, 1>& proj_center_line,
-         const T& along_line_dist,
-         const T& a_angle_start,
-         const T& a_angle_end,
-         const Eigen::Matrix<T, 2, 1>& a_center,
-         const int& rotation_sign,
-         const Eigen::Matrix<T, 2, 1>& direction_line) -> bool {
-        const auto circle_intersect_point =
-            direction_line * along_line_dist + proj_center_line;
-
-        const T angle = math_util::AngleMod(
-            Angle<T>(circle_intersect_point - a_center));
-        return math_util::IsAngleBetween(
-            angle, a_angle_start, a_angle_end, rotation_sign);
-      };
-
-  static const auto no_arc_intersect_min_distance =
-      [](const Eigen::Matrix<T, 2, 1>& a_center,
-         const T& a_angle_start,
-         const T& a_angle_end,
-         const T& a_radius,
-         const Eigen::Matrix<T, 2, 1>& l0,
-         const Eigen::Matrix<T, 2, 1>& l1) -> float {
-    const auto a_angle_min_v = Heading(a_angle_start) * a_radius + a_center;
-    const auto a_angle_max_v = Heading(a_angle_end) * a_radius + a_center;
-    const auto proj_a_angle_min_v =
-        ProjectPointOntoLineSegment<T>(a_angle_min_v, l0, l1);
-    const auto proj_a_angle_max_v =
-        ProjectPointOntoLineSegment<T>(a_angle_max_v, l0, l1);
-    const Eigen::Matrix<T, 2, 1> del_min_v = proj_a_angle_min_v - a_angle_min_v;
-    const T del_min_v_sq_norm = del_min_v.squaredNorm();
-    const Eigen::Matrix<T, 2, 1> del_max_v = proj_a_angle_max_v - a_angle_max_v;
-    const T del_max_v_sq_norm = del_max_v.squaredNorm();
-    const T min_dist =
-        std::sqrt(std::min(del_min_v_sq_norm, del_max_v_sq_norm));
-    return min_dist;
-  };
-
-  // l0 inside the circle, l1 outside the circle.
-  if (l0_dir.squaredNorm() < Sq(a_radius) &&
-      l1_dir.squaredNorm() >= Sq(a_radius)) {
-    const auto direction_line =
-        GetNormalizedOrZero(Eigen::Matrix<T, 2, 1>(l1 - l0));
-    if (direction_line_intersects_arc(proj_center_line,
-                                      along_line_dist,
-                                      a_angle_start,
-                                      a_angle_end,
-                                      a_center,
-                                      rotation_sign,
-                                      direction_line)) {
-      // Arc intersects with line.
-      return 0;
-    }
-
-    return no_arc_intersect_min_distance(
-        a_center, a_angle_start, a_angle_end, a_radius, l0, l1);
-  }
-
-  // l1 inside the circle, l0 outside the circle.
-  if (l0_dir.squaredNorm() >= Sq(a_radius) &&
-      l1_dir.squaredNorm() < Sq(a_radius)) {
-    const auto direction_line =
-        GetNormalizedOrZero(Eigen::Matrix<T, 2, 1>(l0 - l1));
-    if (direction_line_intersects_arc(proj_center_line,
-                                      along_line_dist,
-                                      a_angle_start,
-                                      a_angle_end,
-                                      a_center,
-                                      rotation_sign,
-                                      direction_line)) {
-      // Arc intersects with line.
-      return 0;
+  // Ends of the arc to the segment.
+  T min_distance_sq = std::min(
+      (a0 - ProjectPointOntoLineSegment(a0, l0, l1)).squaredNorm(),
+      (a1 - ProjectPointOntoLineSegment(a1, l0, l1)).squaredNorm());
+  // Ends of the segment, and its point closest to the center, to the arc.
+  const Vector2T projected_center =
+      (a > T(0)) ? ProjectPointOntoLineSegment(a_center, l0, l1) : l0;
+  for (const Vector2T& p : {l0, l1, projected_center}) {
+    const T r = (p - a_center).norm();
+    if (in_arc(p)) {
+      min_distance_sq = std::min(min_distance_sq, Sq(r - a_radius));
+    } else {
+      min_distance_sq = std::min(
+          min_distance_sq,
+          std::min((p - a0).squaredNorm(), (p - a1).squaredNorm()));
     }
-    return no_arc_intersect_min_distance(
-        a_center, a_angle_start, a_angle_end, a_radius, l0, l1);
-  }
-
-  // Both l0 and l1 are not in the circle, but the line goes through the circle.
-  const auto direction_line =
-      GetNormalizedOrZero(Eigen::Matrix<T, 2, 1>(l1 - l0));
-
-  const bool positive_direction_intersect =
-      direction_line_intersects_arc(proj_center_line,
-                                    along_line_dist,
-                                    a_angle_start,
-                                    a_angle_end,
-                                    a_center,
-                                    rotation_sign,
-                                    direction_line);
-  const bool negative_direction_intersect =
-      direction_line_intersects_arc(proj_center_line,
-                                    along_line_dist,
-                                    a_angle_start,
-                                    a_angle_end,
-                                    a_center,
-                                    rotation_sign,
-                                    -direction_line);
-
-  if (positive_direction_intersect || negative_direction_intersect) {
-    // Arc intersects with line.
-    return 0;
   }
-
-  const T min_distance = no_arc_intersect_min_distance(
-      a_center, a_angle_start, a_angle_end, a_radius, l0, l1);
-  return min_distance;
+  return std::sqrt(min_distance_sq);
 }
 
 // Returns the scalar projection of vector1 onto vector2
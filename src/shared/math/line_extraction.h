@@ -0,0 +1,120 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+//
+// Split-and-merge extraction of line segments from a scan, so that consumers
+// can work on the few dozen segments of a scene instead of its ~1000 points.
+
+#ifndef SRC_MATH_LINE_EXTRACTION_H_
+#define SRC_MATH_LINE_EXTRACTION_H_
+
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#include "math/geometry.h"
+#include "math/line2d.h"
+
+namespace line_extraction {
+
+struct LineExtractionOptions {
+  LineExtractionOptions() : max_error(0.03), max_gap(0.25) {}
+  // No point is farther than this from its segment (m).
+  float max_error;
+  // Consecutive points farther apart than this are not joined (m). Joining
+  // closes the gap, so this should be less than the width of the narrowest
+  // opening that matters.
+  float max_gap;
+};
+
+// Largest distance of points[begin + 1 .. end - 1] from the segment between
+// points[begin] and points[end], and the index of the farthest one.
+inline float MaxDeviation(const std::vector<Eigen::Vector2f>& points,
+                          size_t begin,
+                          size_t end,
+                          size_t* farthest) {
+  float max_distance_sq = 0;
+  *farthest = begin;
+  for (size_t i = begin + 1; i < end; ++i) {
+    const Eigen::Vector2f p = geometry::ProjectPointOntoLineSegment(
+        points[i], points[begin], points[end]);
+    const float distance_sq = (points[i] - p).squaredNorm();
+    if (distance_sq > max_distance_sq) {
+      max_distance_sq = distance_sq;
+      *farthest = i;
+    }
+  }
+  return std::sqrt(max_distance_sq);
+}
+
+// Appends segments covering points, which must be in scan order, to lines.
+// Each segment joins two of the points, and every point is within
+// options.max_error of a segment, so obstacles grown by max_error cover all
+// of the points. A point without neighbors within options.max_gap becomes a
+// segment of zero length.
+//
+// Runs of points closer than max_gap are split recursively at the point
+// farthest from the segment joining their ends, and neighboring segments
+// are merged again where one segment fits both.
+inline void ExtractLines(const std::vector<Eigen::Vector2f>& points,
+                         const LineExtractionOptions& options,
+                         std::vector<geometry::line2f>* lines) {
+  const float max_gap_sq = options.max_gap * options.max_gap;
+  // Indices of the points the segments of the current run join.
+  std::vector<size_t> vertices;
+  std::vector<std::pair<size_t, size_t>> stack;
+  size_t run_begin = 0;
+  while (run_begin < points.size()) {
+    size_t run_end = run_begin;
+    while (run_end + 1 < points.size() &&
+           (points[run_end + 1] - points[run_end]).squaredNorm() <=
+               max_gap_sq) {
+      ++run_end;
+    }
+    // Split.
+    vertices.assign(1, run_begin);
+    stack.assign(1, std::make_pair(run_begin, run_end));
+    while (!stack.empty()) {
+      const std::pair<size_t, size_t> range = stack.back();
+      stack.pop_back();
+      size_t farthest;
+      if (MaxDeviation(points, range.first, range.second, &farthest) >
+          options.max_error) {
+        // The first half is handled first, so vertices stay in order.
+        stack.emplace_back(farthest, range.second);
+        stack.emplace_back(range.first, farthest);
+      } else {
+        vertices.push_back(range.second);
+      }
+    }
+    // Merge.
+    size_t start = 0;
+    for (size_t i = 1; i < vertices.size(); ++i) {
+      size_t farthest;
+      if (i + 1 < vertices.size() &&
+          MaxDeviation(points, vertices[start], vertices[i + 1], &farthest) <=
+              options.max_error) {
+        continue;
+      }
+      lines->emplace_back(points[vertices[start]], points[vertices[i]]);
+      start = i;
+    }
+    run_begin = run_end + 1;
+  }
+}
+
+}  // namespace line_extraction
+
+#endif  // SRC_MATH_LINE_EXTRACTION_H_
@@ -69,6 +69,104 @@ class Pose2Df {
     Eigen::Vector2f translation;
 };
 
+// Returns @pose, which is expressed in the frame @frame, expressed in the
+// parent frame of @frame.
+inline Pose2Df Compose(const Pose2Df& frame, const Pose2Df& pose) {
+  const float c = std::cos(frame.angle);
+  const float s = std::sin(frame.angle);
+  const Eigen::Vector2f& t = pose.translation;
+  return Pose2Df(math_util::AngleMod(frame.angle + pose.angle),
+                 frame.translation +
+                     Eigen::Vector2f(c * t.x() - s * t.y(),
+                                     s * t.x() + c * t.y()));
+}
+
+// Returns the pose that undoes @pose.
+inline Pose2Df Inverse(const Pose2Df& pose) {
+  const float c = std::cos(pose.angle);
+  const float s = std::sin(pose.angle);
+  const Eigen::Vector2f& t = pose.translation;
+  return Pose2Df(-pose.angle,
+                 Eigen::Vector2f(-c * t.x() - s * t.y(),
+                                 s * t.x() - c * t.y()));
+}
+
+// Returns @pose, which is expressed in the parent frame of @frame, expressed in
+// the frame @frame. Equivalent to Compose(Inverse(frame), pose).
+inline Pose2Df Relative(const Pose2Df& pose, const Pose2Df& frame) {
+  const float c = std::cos(frame.angle);
+  const float s = std::sin(frame.angle);
+  const Eigen::Vector2f d = pose.translation - frame.translation;
+  return Pose2Df(math_util::AngleMod(pose.angle - frame.angle),
+                 Eigen::Vector2f(c * d.x() + s * d.y(),
+                                 -s * d.x() + c * d.y()));
+}
+
+// Returns the point @p, expressed in the frame @pose, expressed in the parent
+// frame of @pose.
+inline Eigen::Vector2f TransformPoint(const Pose2Df& pose,
+                                      const Eigen::Vector2f& p) {
+  const float c = std::cos(pose.angle);
+  const float s = std::sin(pose.angle);
+  return Eigen::Vector2f(c * p.x() - s * p.y() + pose.translation.x(),
+                         s * p.x() + c * p.y() + pose.translation.y());
+}
+
+// Returns the covariance @covariance of a pose, ordered x, y, angle, with its
+// translation part rotated by @angle: the covariance of a pose measured in a
+// frame, expressed in a frame rotated by -@angle from it.
+inline Eigen::Matrix3d RotateCovariance(const Eigen::Matrix3d& covariance,
+                                        double angle) {
+  Eigen::Matrix3d rotation = Eigen::Matrix3d::Identity();
+  rotation.topLeftCorner<2, 2>() =
+      Eigen::Rotation2Dd(angle).toRotationMatrix();
+  return rotation * covariance * rotation.transpose();
+}
+
+// Applies @pose to @n contiguous points from @src, writing them to @dst. The
+// sine and cosine are evaluated once, and the loop runs over the raw
+// interleaved floats so that the compiler can vectorise it. @src and @dst may
+// be the same array, for in-place transforms.
+inline void TransformPoints(const Pose2Df& pose,
+                            const Eigen::Vector2f* src,
+                            size_t n,
+                            Eigen::Vector2f* dst) {
+  if (n == 0) return;
+  const float c = std::cos(pose.angle);
+  const float s = std::sin(pose.angle);
+  const float tx = pose.translation.x();
+  const float ty = pose.translation.y();
+  const float* in = src->data();
+  float* out = dst->data();
+  for (size_t i = 0; i < 2 * n; i += 2) {
+    const float x = in[i];
+    const float y = in[i + 1];
+    out[i] = c * x - s * y + tx;
+    out[i + 1] = s * x + c * y + ty;
+  }
+}
+
+// Applies @pose to every point of @src, writing the result to @dst. @dst is
+// resized to match @src, so no allocation takes place when it is reused with
+// sufficient capacity. @dst may point to @src.
+inline void TransformPointCloud(const Pose2Df& pose,
+                                const std::vector<Eigen::Vector2f>& src,
+                                std::vector<Eigen::Vector2f>* dst) {
+  dst->resize(src.size());
+  if (src.empty()) return;
+  TransformPoints(pose, src.data(), src.size(), dst->data());
+}
+
+// Applies @pose to every point of @src, appending the results to @dst.
+inline void AppendTransformedPointCloud(const Pose2Df& pose,
+                                        const std::vector<Eigen::Vector2f>& src,
+                                        std::vector<Eigen::Vector2f>* dst) {
+  const size_t offset = dst->size();
+  dst->resize(offset + src.size());
+  if (src.empty()) return;
+  TransformPoints(pose, src.data(), src.size(), dst->data() + offset);
+}
+
 // template <typename num>
 // struct Pose2D {
 //   Eigen::Matrix<num, 2, 1> translation;
@@ -0,0 +1,71 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "math/fast_math.h"
+
+TEST(FastAtan2, MatchesLibm) {
+  double max_error = 0;
+  for (int i = 0; i < 100000; ++i) {
+    const double a = -M_PI + 2 * M_PI * i / 100000.0;
+    for (const float r : {1e-3f, 1.0f, 1e3f}) {
+      const float x = r * std::cos(a);
+      const float y = r * std::sin(a);
+      const double error = fast_math::FastAtan2(y, x) -
+          std::atan2(static_cast<double>(y), static_cast<double>(x));
+      max_error = std::max(max_error, std::abs(error));
+    }
+  }
+  EXPECT_LE(max_error, 5e-7);
+}
+
+TEST(FastAtan2, Axes) {
+  EXPECT_EQ(0, fast_math::FastAtan2(0, 0));
+  EXPECT_EQ(0, fast_math::FastAtan2(0, 1));
+  EXPECT_NEAR(M_PI_2, fast_math::FastAtan2(1, 0), 1e-6);
+  EXPECT_NEAR(-M_PI_2, fast_math::FastAtan2(-1, 0), 1e-6);
+  EXPECT_NEAR(M_PI, fast_math::FastAtan2(0, -1), 1e-6);
+  EXPECT_NEAR(-M_PI, fast_math::FastAtan2(-0.0f, -1), 1e-6);
+}
+
+TEST(FastAsinAcos, MatchesLibm) {
+  double max_asin_error = 0;
+  double max_acos_error = 0;
+  for (int i = 0; i <= 100000; ++i) {
+    const float x = -1 + 2 * i / 100000.0f;
+    const double asin_error = fast_math::FastAsin(x) - std::asin(double(x));
+    const double acos_error = fast_math::FastAcos(x) - std::acos(double(x));
+    max_asin_error = std::max(max_asin_error, std::abs(asin_error));
+    max_acos_error = std::max(max_acos_error, std::abs(acos_error));
+  }
+  EXPECT_LE(max_asin_error, 5e-7);
+  EXPECT_LE(max_acos_error, 5e-7);
+}
+
+TEST(FastSinCos, MatchesLibm) {
+  double max_error = 0;
+  for (int i = 0; i <= 1000000; ++i) {
+    const float a = -100 + 200 * i / 1000000.0f;
+    float s, c;
+    fast_math::FastSinCos(a, &s, &c);
+    const double ad = a;
+    max_error = std::max(max_error, std::abs(s - std::sin(ad)));
+    max_error = std::max(max_error, std::abs(c - std::cos(ad)));
+  }
+  EXPECT_LE(max_error, 2e-7);
+}
@@ -0,0 +1,77 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#include "math/geometry.h"
+#include "math/line2d.h"
+#include "math/line_extraction.h"
+
+using Eigen::Vector2f;
+using geometry::line2f;
+using line_extraction::ExtractLines;
+using line_extraction::LineExtractionOptions;
+using std::vector;
+
+TEST(ExtractLines, Corner) {
+  vector<Vector2f> points;
+  for (int i = 0; i <= 10; ++i) points.push_back(Vector2f(1, 0.1 * i));
+  for (int i = 1; i <= 10; ++i) points.push_back(Vector2f(1 - 0.1 * i, 1));
+  vector<line2f> lines;
+  ExtractLines(points, LineExtractionOptions(), &lines);
+  ASSERT_EQ(2u, lines.size());
+  EXPECT_NEAR(0, (lines[0].p0 - Vector2f(1, 0)).norm(), 1e-6);
+  EXPECT_NEAR(0, (lines[0].p1 - Vector2f(1, 1)).norm(), 1e-6);
+  EXPECT_NEAR(0, (lines[1].p0 - Vector2f(1, 1)).norm(), 1e-6);
+  EXPECT_NEAR(0, (lines[1].p1 - Vector2f(0, 1)).norm(), 1e-6);
+}
+
+TEST(ExtractLines, Gap) {
+  vector<Vector2f> points;
+  for (int i = 0; i <= 5; ++i) points.push_back(Vector2f(2, 0.05 * i));
+  points.push_back(Vector2f(2, 1));
+  vector<line2f> lines;
+  ExtractLines(points, LineExtractionOptions(), &lines);
+  ASSERT_EQ(2u, lines.size());
+  EXPECT_NEAR(0, (lines[0].p1 - Vector2f(2, 0.25)).norm(), 1e-6);
+  // The lone point becomes a segment of zero length.
+  EXPECT_EQ(lines[1].p0, lines[1].p1);
+}
+
+TEST(ExtractLines, MaxError) {
+  vector<Vector2f> points;
+  for (int i = 0; i <= 100; ++i) {
+    const float x = 0.02 * i;
+    points.push_back(Vector2f(x, 0.5 * x * x));
+  }
+  LineExtractionOptions options;
+  vector<line2f> lines;
+  ExtractLines(points, options, &lines);
+  EXPECT_LT(1u, lines.size());
+  EXPECT_GT(points.size(), lines.size());
+  for (const Vector2f& p : points) {
+    float min_distance = 1e10;
+    for (const line2f& line : lines) {
+      const Vector2f q =
+          geometry::ProjectPointOntoLineSegment(p, line.p0, line.p1);
+      min_distance = std::min(min_distance, (p - q).norm());
+    }
+    EXPECT_LE(min_distance, options.max_error + 1e-6);
+  }
+}
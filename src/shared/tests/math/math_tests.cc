@@ -190,5 +190,38 @@ TEST(LineLineIntersection, CollidesAndIntersection) {
   }
 }
 
-
-
+TEST(MinDistanceLineArc, QuarterCircle) {
+  // The arc of the unit circle from (1, 0) to (0, 1).
+  const Eigen::Vector2f center(0, 0);
+  const float radius = 1;
+  const float start = 0;
+  const float end = M_PI_2;
+  // Crosses the arc.
+  EXPECT_FLOAT_EQ(geometry::MinDistanceLineArc(
+      Eigen::Vector2f(0.5, 0.5), Eigen::Vector2f(2, 2),
+      center, radius, start, end, 1), 0);
+  // Outside the circle, closest to the end of the arc at (1, 0).
+  EXPECT_FLOAT_EQ(geometry::MinDistanceLineArc(
+      Eigen::Vector2f(2, -1), Eigen::Vector2f(2, 3),
+      center, radius, start, end, 1), 1);
+  // Inside the circle, in front of the arc.
+  EXPECT_NEAR(geometry::MinDistanceLineArc(
+      Eigen::Vector2f(0, 0), Eigen::Vector2f(0.3, 0.3),
+      center, radius, start, end, 1), 1 - 0.3 * M_SQRT2, 1e-6);
+  // Crosses the circle, but not the arc.
+  EXPECT_FLOAT_EQ(geometry::MinDistanceLineArc(
+      Eigen::Vector2f(-1.5, -1), Eigen::Vector2f(-1.5, 1),
+      center, radius, start, end, 1), 1.5);
+  // Inside the circle, outside the arc, closest to its end at (0, 1).
+  EXPECT_NEAR(geometry::MinDistanceLineArc(
+      Eigen::Vector2f(-0.9, 0.1), Eigen::Vector2f(-0.1, 0.9),
+      center, radius, start, end, 1), 0.1 * M_SQRT2, 1e-6);
+  // The same arc, clockwise.
+  EXPECT_FLOAT_EQ(geometry::MinDistanceLineArc(
+      Eigen::Vector2f(2, -1), Eigen::Vector2f(2, 3),
+      center, radius, end, start, -1), 1);
+  // The rest of the circle, counterclockwise from (0, 1) to (1, 0).
+  EXPECT_FLOAT_EQ(geometry::MinDistanceLineArc(
+      Eigen::Vector2f(-1.5, -1), Eigen::Vector2f(-1.5, 1),
+      center, radius, end, start, 1), 0.5);
+}
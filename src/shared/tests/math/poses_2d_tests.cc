@@ -0,0 +1,82 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+
+#include "math/poses_2d.h"
+
+using pose_2d::Pose2Df;
+
+namespace {
+
+// Variance of @covariance along the unit direction @direction.
+double Variance(const Eigen::Matrix3d& covariance,
+                const Eigen::Vector2d& direction) {
+  return direction.dot(covariance.topLeftCorner<2, 2>() * direction);
+}
+
+// A scan match against a keyframe at 90 degrees, constrained along the x axis
+// of the keyframe (a wall across it) and loose along its y axis (a
+// corridor). The prior on the matched pose measures its error in the body
+// frame of the matched pose, so the tight axis must be the keyframe x axis
+// seen from there.
+void CheckScanMatchPrior(float relative_angle) {
+  const Pose2Df keyframe(M_PI / 2, Eigen::Vector2f(3, -1));
+  const Pose2Df relative(relative_angle, Eigen::Vector2f(0.5, 0.2));
+  const Pose2Df measured = pose_2d::Compose(keyframe, relative);
+  const Eigen::Matrix3d keyframe_covariance =
+      Eigen::Vector3d(0.01, 1.0, 0.001).asDiagonal();
+
+  const Eigen::Matrix3d prior_covariance =
+      pose_2d::RotateCovariance(keyframe_covariance, -relative.angle);
+
+  const Eigen::Vector2d constrained_in_map =
+      Eigen::Rotation2Dd(keyframe.angle) * Eigen::Vector2d(1, 0);
+  const Eigen::Vector2d constrained =
+      Eigen::Rotation2Dd(-measured.angle) * constrained_in_map;
+  const Eigen::Vector2d loose(-constrained.y(), constrained.x());
+  EXPECT_NEAR(0.01, Variance(prior_covariance, constrained), 1e-6);
+  EXPECT_NEAR(1.0, Variance(prior_covariance, loose), 1e-6);
+  EXPECT_DOUBLE_EQ(0.001, prior_covariance(2, 2));
+}
+
+}  // namespace
+
+TEST(RotateCovariance, Identity) {
+  const Eigen::Matrix3d covariance =
+      Eigen::Vector3d(1, 2, 3).asDiagonal();
+  EXPECT_TRUE(covariance.isApprox(pose_2d::RotateCovariance(covariance, 0)));
+}
+
+TEST(RotateCovariance, QuarterTurnSwapsAxes) {
+  const Eigen::Matrix3d covariance =
+      Eigen::Vector3d(1, 4, 9).asDiagonal();
+  const Eigen::Matrix3d rotated =
+      pose_2d::RotateCovariance(covariance, M_PI / 2);
+  EXPECT_NEAR(4, rotated(0, 0), 1e-9);
+  EXPECT_NEAR(1, rotated(1, 1), 1e-9);
+  EXPECT_NEAR(0, rotated(0, 1), 1e-9);
+  EXPECT_NEAR(9, rotated(2, 2), 1e-9);
+}
+
+TEST(RotateCovariance, ScanMatchPriorAlongKeyframe) {
+  CheckScanMatchPrior(0);
+}
+
+TEST(RotateCovariance, ScanMatchPriorTurnedFromKeyframe) {
+  CheckScanMatchPrior(M_PI / 6);
+  CheckScanMatchPrior(-M_PI / 3);
+}
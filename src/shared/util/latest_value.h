@@ -0,0 +1,72 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+//
+// Lock-free slot handing the latest value from one thread to another.
+
+#include <atomic>
+#include <utility>
+
+#ifndef SRC_UTIL_LATEST_VALUE_H_
+#define SRC_UTIL_LATEST_VALUE_H_
+
+// Passes values from one writer thread to one reader thread, keeping only the
+// most recent: a reader that falls behind skips to the latest value, and
+// neither side ever waits for the other. Triple buffered: the writer fills the
+// back buffer and swaps it with the middle one, the reader swaps the middle
+// buffer with the front one when it holds a value not read yet. Buffers are
+// reused, so values with heap storage (e.g. vectors) stop allocating once
+// their capacity has grown.
+template <typename T>
+class LatestValue {
+ public:
+  LatestValue() : back_(0), middle_(1), front_(2) {}
+
+  // Publishes value, replacing any value that was not read yet.
+  // Writer thread only.
+  void Write(const T& value) {
+    buffers_[back_] = value;
+    back_ = middle_.exchange(back_ | kFresh, std::memory_order_acq_rel) &
+        kIndexMask;
+  }
+
+  // If a value was written since the last read, moves it into value and
+  // returns true; otherwise leaves value as is. Reader thread only.
+  bool Read(T* value) {
+    if ((middle_.load(std::memory_order_relaxed) & kFresh) == 0) {
+      return false;
+    }
+    front_ = middle_.exchange(front_, std::memory_order_acq_rel) & kIndexMask;
+    std::swap(*value, buffers_[front_]);
+    return true;
+  }
+
+ private:
+  LatestValue(const LatestValue&) = delete;
+  LatestValue& operator=(const LatestValue&) = delete;
+
+  // The middle index carries a flag for whether it holds an unread value.
+  static const int kFresh = 4;
+  static const int kIndexMask = 3;
+
+  T buffers_[3];
+  // Owned by the writer.
+  int back_;
+  // Shared.
+  std::atomic<int> middle_;
+  // Owned by the reader.
+  int front_;
+};
+
+#endif  // SRC_UTIL_LATEST_VALUE_H_
@@ -0,0 +1,189 @@
+//========================================================================
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+
+#include "util/memory_accounting.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Registered accounts, and the bytes of each name at the previous report.
+// Never destroyed, so that accounts with static storage can unregister at
+// exit in any order.
+struct Registry {
+  std::mutex mutex;
+  vector<const memory_accounting::MemoryAccount*> accounts;
+  std::map<string, int64_t> reported_bytes;
+};
+
+Registry& GetRegistry() {
+  static Registry* registry = new Registry();
+  return *registry;
+}
+
+string FormatBytes(int64_t bytes) {
+  char buffer[32];
+  const double magnitude = std::abs(static_cast<double>(bytes));
+  if (magnitude >= 1024.0 * 1024.0 * 1024.0) {
+    snprintf(buffer, sizeof(buffer), "%.2f GB",
+             bytes / (1024.0 * 1024.0 * 1024.0));
+  } else if (magnitude >= 1024.0 * 1024.0) {
+    snprintf(buffer, sizeof(buffer), "%.1f MB", bytes / (1024.0 * 1024.0));
+  } else if (magnitude >= 1024.0) {
+    snprintf(buffer, sizeof(buffer), "%.1f kB", bytes / 1024.0);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%d B", static_cast<int>(bytes));
+  }
+  return buffer;
+}
+
+// Background thread of StartPeriodicReports().
+class PeriodicReporter {
+ public:
+  PeriodicReporter() : stop_(false) {}
+  ~PeriodicReporter() { Stop(); }
+
+  void Start(double period) {
+    Stop();
+    stop_ = false;
+    thread_ = std::thread([this, period]() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      const auto interval = std::chrono::duration<double>(period);
+      while (!condition_.wait_for(lock, interval, [this]() { return stop_; })) {
+        printf("%s", memory_accounting::Report().c_str());
+        fflush(stdout);
+      }
+    });
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    condition_.notify_all();
+    if (thread_.joinable()) thread_.join();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stop_;
+  std::thread thread_;
+};
+
+PeriodicReporter periodic_reporter_;
+
+}  // namespace
+
+namespace memory_accounting {
+
+MemoryAccount::MemoryAccount(const string& name) :
+    name_(name), bytes_(0), peak_(0) {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.accounts.push_back(this);
+}
+
+MemoryAccount::~MemoryAccount() {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.accounts.erase(std::remove(registry.accounts.begin(),
+                                      registry.accounts.end(),
+                                      this),
+                          registry.accounts.end());
+}
+
+vector<AccountUsage> GetAccountUsage() {
+  std::map<string, AccountUsage> usage;
+  {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const MemoryAccount* account : registry.accounts) {
+      AccountUsage& u = usage[account->name()];
+      u.name = account->name();
+      u.bytes += account->Bytes();
+      u.peak_bytes += account->PeakBytes();
+    }
+  }
+  vector<AccountUsage> result;
+  result.reserve(usage.size());
+  for (const auto& entry : usage) {
+    result.push_back(entry.second);
+  }
+  return result;
+}
+
+int64_t GetResidentSetSize() {
+  FILE* fid = fopen("/proc/self/statm", "r");
+  if (fid == nullptr) return -1;
+  long long size = 0;
+  long long resident = 0;
+  const bool ok = fscanf(fid, "%lld %lld", &size, &resident) == 2;
+  fclose(fid);
+  if (!ok) return -1;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+string Report() {
+  const vector<AccountUsage> usage = GetAccountUsage();
+  const int64_t rss = GetResidentSetSize();
+  int64_t total = 0;
+  for (const AccountUsage& u : usage) {
+    total += u.bytes;
+  }
+  string report = "Memory: resident " +
+      (rss >= 0 ? FormatBytes(rss) : string("unknown")) +
+      ", accounted " + FormatBytes(total) + "\n";
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  for (const AccountUsage& u : usage) {
+    int64_t& reported = registry.reported_bytes[u.name];
+    char line[256];
+    snprintf(line, sizeof(line), "  %-32s %10s (peak %s, %s%s)\n",
+             u.name.c_str(), FormatBytes(u.bytes).c_str(),
+             FormatBytes(u.peak_bytes).c_str(),
+             u.bytes >= reported ? "+" : "-",
+             FormatBytes(std::abs(u.bytes - reported)).c_str());
+    report += line;
+    reported = u.bytes;
+  }
+  return report;
+}
+
+void StartPeriodicReports(double period) {
+  periodic_reporter_.Start(period);
+}
+
+void StopPeriodicReports() {
+  periodic_reporter_.Stop();
+}
+
+}  // namespace memory_accounting
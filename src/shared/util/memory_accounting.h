@@ -0,0 +1,150 @@
+//========================================================================
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+//
+// Per-subsystem memory accounting: subsystems keep the bytes they hold in
+// named accounts, which can be queried and reported next to the resident
+// set size of the process, so that growth shows up long before the robot
+// runs out of memory.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifndef SRC_UTIL_MEMORY_ACCOUNTING_H_
+#define SRC_UTIL_MEMORY_ACCOUNTING_H_
+
+namespace memory_accounting {
+
+// Bytes held by a subsystem, registered under a name such as
+// "slam/pg_node_clouds" for as long as the account exists. Accounts with the
+// same name are reported together. Updates are atomic, so any thread can
+// update an account.
+class MemoryAccount {
+ public:
+  explicit MemoryAccount(const std::string& name);
+  ~MemoryAccount();
+
+  void Add(int64_t bytes) {
+    UpdatePeak(bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+  }
+  void Subtract(int64_t bytes) {
+    bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+  // For subsystems that recount what they hold instead.
+  void Set(int64_t bytes) {
+    bytes_.store(bytes, std::memory_order_relaxed);
+    UpdatePeak(bytes);
+  }
+
+  int64_t Bytes() const { return bytes_.load(std::memory_order_relaxed); }
+  int64_t PeakBytes() const { return peak_.load(std::memory_order_relaxed); }
+  const std::string& name() const { return name_; }
+
+ private:
+  MemoryAccount(const MemoryAccount&) = delete;
+  MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+  void UpdatePeak(int64_t bytes) {
+    int64_t peak = peak_.load(std::memory_order_relaxed);
+    while (bytes > peak &&
+           !peak_.compare_exchange_weak(peak, bytes,
+                                        std::memory_order_relaxed)) {}
+  }
+
+  const std::string name_;
+  std::atomic<int64_t> bytes_;
+  std::atomic<int64_t> peak_;
+};
+
+// Allocator that charges what a container allocates to an account, for
+// containers that opt into tracking, e.g.
+//   std::vector<Particle, TrackingAllocator<Particle>> particles(
+//       TrackingAllocator<Particle>(&account));
+// Copies of the allocator charge the same account. Default constructed, it
+// charges nothing.
+template <typename T>
+class TrackingAllocator {
+ public:
+  typedef T value_type;
+
+  TrackingAllocator() : account_(nullptr) {}
+  explicit TrackingAllocator(MemoryAccount* account) : account_(account) {}
+  template <typename U>
+  TrackingAllocator(const TrackingAllocator<U>& other) :
+      account_(other.account()) {}
+
+  T* allocate(size_t n) {
+    T* p = static_cast<T*>(::operator new(n * sizeof(T)));
+    if (account_ != nullptr) account_->Add(n * sizeof(T));
+    return p;
+  }
+  void deallocate(T* p, size_t n) {
+    if (account_ != nullptr) account_->Subtract(n * sizeof(T));
+    ::operator delete(p);
+  }
+
+  MemoryAccount* account() const { return account_; }
+
+ private:
+  MemoryAccount* account_;
+};
+
+template <typename T, typename U>
+bool operator==(const TrackingAllocator<T>& a, const TrackingAllocator<U>& b) {
+  return a.account() == b.account();
+}
+
+template <typename T, typename U>
+bool operator!=(const TrackingAllocator<T>& a, const TrackingAllocator<U>& b) {
+  return !(a == b);
+}
+
+// Bytes of the heap storage of a vector.
+template <typename T, typename Allocator>
+int64_t HeapBytes(const std::vector<T, Allocator>& v) {
+  return v.capacity() * sizeof(T);
+}
+
+struct AccountUsage {
+  AccountUsage() : bytes(0), peak_bytes(0) {}
+  std::string name;
+  int64_t bytes;
+  // Sum of the peaks of the accounts with the name.
+  int64_t peak_bytes;
+};
+
+// Usage of all accounts, by name.
+std::vector<AccountUsage> GetAccountUsage();
+
+// Resident set size of the process in bytes, or -1 if it is not available.
+int64_t GetResidentSetSize();
+
+// The resident set size, the accounts, and how much each changed since the
+// previous report.
+std::string Report();
+
+// Prints Report() to stdout every period seconds from a background thread,
+// until StopPeriodicReports() is called or the program exits. Restarts the
+// reports if they are running already.
+void StartPeriodicReports(double period);
+void StopPeriodicReports();
+
+}  // namespace memory_accounting
+
+#endif  // SRC_UTIL_MEMORY_ACCOUNTING_H_
@@ -0,0 +1,247 @@
+//========================================================================
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+
+#include "util/runtime_config.h"
+
+#include <alloca.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "gflags/gflags.h"
+
+using std::string;
+using std::vector;
+
+DEFINE_string(cpus, "",
+              "CPUs to run the threads of this node on, e.g. 0-3,6; "
+              "all if empty");
+DEFINE_string(worker_cpus, "",
+              "CPUs to run worker pools and OpenMP on; --cpus if empty");
+DEFINE_string(realtime_cpus, "",
+              "CPUs to run real-time control threads on; --cpus if empty");
+DEFINE_int32(realtime_priority, 0,
+             "SCHED_FIFO priority of real-time control threads, 1 to 99; "
+             "0 leaves them to the normal scheduler");
+DEFINE_bool(lock_memory, false,
+            "Lock the memory of the process into RAM, so that it is never "
+            "paged out or faulted in during a cycle");
+DEFINE_int32(max_threads, 0,
+             "Worker threads that OpenMP and the worker pools of this node "
+             "may run at once; the number of worker CPUs if 0");
+
+namespace {
+
+// Parsed from the flags by Initialize(), and only read afterwards.
+vector<int> node_cpus_;
+vector<int> worker_cpus_;
+vector<int> realtime_cpus_;
+
+thread_local bool worker_configured_ = false;
+
+std::atomic<int>& AvailableThreads() {
+  static std::atomic<int> available(runtime_config::ThreadBudget());
+  return available;
+}
+
+int NumCpus() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Returns the error number, or 0 on success.
+int PinThread(const vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+bool ParseFlag(const char* name, const string& value, vector<int>* cpus) {
+  if (runtime_config::ParseCpuList(value, cpus)) return true;
+  fprintf(stderr, "Invalid CPU list --%s=%s\n", name, value.c_str());
+  cpus->clear();
+  return false;
+}
+
+}  // namespace
+
+namespace runtime_config {
+
+bool ParseCpuList(const string& list, vector<int>* cpus) {
+  cpus->clear();
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == string::npos) end = list.size();
+    const string range = list.substr(start, end - start);
+    int first = 0;
+    int last = 0;
+    char extra = 0;
+    if (sscanf(range.c_str(), "%d-%d%c", &first, &last, &extra) != 2) {
+      if (sscanf(range.c_str(), "%d%c", &first, &extra) != 1) return false;
+      last = first;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(cpu);
+    }
+    start = end + 1;
+  }
+  std::sort(cpus->begin(), cpus->end());
+  cpus->erase(std::unique(cpus->begin(), cpus->end()), cpus->end());
+  return !list.empty() && !cpus->empty();
+}
+
+bool Initialize() {
+  bool ok = true;
+  if (!FLAGS_cpus.empty()) {
+    ok = ParseFlag("cpus", FLAGS_cpus, &node_cpus_) && ok;
+  }
+  worker_cpus_ = node_cpus_;
+  if (!FLAGS_worker_cpus.empty()) {
+    ok = ParseFlag("worker_cpus", FLAGS_worker_cpus, &worker_cpus_) && ok;
+  }
+  realtime_cpus_ = node_cpus_;
+  if (!FLAGS_realtime_cpus.empty()) {
+    ok = ParseFlag("realtime_cpus", FLAGS_realtime_cpus, &realtime_cpus_) &&
+        ok;
+  }
+
+  if (!node_cpus_.empty()) {
+    const int error = PinThread(node_cpus_);
+    if (error != 0) {
+      fprintf(stderr, "Unable to run on CPUs %s: %s\n",
+              FLAGS_cpus.c_str(), strerror(error));
+      ok = false;
+    }
+  }
+
+  if (FLAGS_lock_memory) {
+    // Keep freed memory in the process rather than returning it to the
+    // system, so that it does not have to be faulted in again.
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+      fprintf(stderr, "Unable to lock memory: %s\n", strerror(errno));
+      ok = false;
+    }
+  }
+
+  AvailableThreads() = ThreadBudget();
+#ifdef _OPENMP
+  omp_set_num_threads(ThreadBudget());
+#endif
+  return ok;
+}
+
+void ConfigureWorkerThread() {
+  if (worker_configured_ || worker_cpus_.empty()) return;
+  worker_configured_ = true;
+  const int error = PinThread(worker_cpus_);
+  if (error != 0) {
+    fprintf(stderr, "Unable to run a worker on CPUs %s: %s\n",
+            FLAGS_worker_cpus.c_str(), strerror(error));
+  }
+}
+
+void ConfigureOpenMPThread() {
+#ifdef _OPENMP
+  if (omp_get_thread_num() != 0) ConfigureWorkerThread();
+#endif
+}
+
+bool ConfigureRealtimeThread() {
+  bool ok = true;
+  if (!realtime_cpus_.empty()) {
+    const int error = PinThread(realtime_cpus_);
+    if (error != 0) {
+      fprintf(stderr, "Unable to run a real-time thread on CPUs %s: %s\n",
+              FLAGS_realtime_cpus.c_str(), strerror(error));
+      ok = false;
+    }
+  }
+  if (FLAGS_realtime_priority > 0) {
+    sched_param param;
+    param.sched_priority = std::min(FLAGS_realtime_priority,
+                                    sched_get_priority_max(SCHED_FIFO));
+    const int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error != 0) {
+      fprintf(stderr, "Unable to schedule a thread SCHED_FIFO %d: %s\n",
+              param.sched_priority, strerror(error));
+      ok = false;
+    }
+  }
+  if (FLAGS_lock_memory) {
+    PrefaultStack(256 * 1024);
+  }
+  return ok;
+}
+
+void Prefault(void* data, size_t size) {
+  if (size == 0) return;
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  volatile char* bytes = static_cast<volatile char*>(data);
+  for (size_t i = 0; i < size; i += page_size) {
+    bytes[i] = bytes[i];
+  }
+  bytes[size - 1] = bytes[size - 1];
+}
+
+void PrefaultStack(size_t size) {
+  void* stack = alloca(size);
+  memset(stack, 0, size);
+  // Keep the compiler from dropping the writes.
+  asm volatile("" : : "r"(stack) : "memory");
+}
+
+int ThreadBudget() {
+  if (FLAGS_max_threads > 0) return FLAGS_max_threads;
+  return worker_cpus_.empty() ?
+      NumCpus() : static_cast<int>(worker_cpus_.size());
+}
+
+WorkerThreads::WorkerThreads(size_t max_threads) : count_(1), reserved_(0) {
+  std::atomic<int>& available = AvailableThreads();
+  int current = available.load();
+  do {
+    reserved_ = (current > 0) ?
+        static_cast<int>(std::min<size_t>(current, max_threads)) : 0;
+  } while (!available.compare_exchange_weak(current, current - reserved_));
+  count_ = std::max(1, reserved_);
+}
+
+WorkerThreads::~WorkerThreads() {
+  AvailableThreads() += reserved_;
+}
+
+}  // namespace runtime_config
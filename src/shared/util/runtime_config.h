@@ -0,0 +1,105 @@
+//========================================================================
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+//
+// Runtime configuration shared by all nodes: which CPUs the threads of a
+// node and of its worker pools run on, real-time scheduling for control
+// threads, locking the process memory, and a budget of worker threads that
+// OpenMP and our own pools draw from, so that the nodes on one computer do
+// not all take every core at once. Configured with the flags below, e.g.
+//   navigation --cpus=0 --realtime_priority=50 --lock_memory
+//   slam --cpus=1-3 --max_threads=2
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+
+#ifndef SRC_UTIL_RUNTIME_CONFIG_H_
+#define SRC_UTIL_RUNTIME_CONFIG_H_
+
+// CPU lists such as "0-3,6"; empty for all CPUs.
+DECLARE_string(cpus);
+DECLARE_string(worker_cpus);
+DECLARE_string(realtime_cpus);
+DECLARE_int32(realtime_priority);
+DECLARE_bool(lock_memory);
+DECLARE_int32(max_threads);
+
+namespace runtime_config {
+
+// Parses a CPU list such as "0-3,6" into sorted CPU numbers. Returns false
+// if it is malformed.
+bool ParseCpuList(const std::string& list, std::vector<int>* cpus);
+
+// Applies the flags to the process: pins the calling thread, and with it
+// the threads it starts from then on, to --cpus, locks the memory with
+// --lock_memory, and sets the thread budget. Call from main() after parsing
+// the flags and before starting threads. Returns false, with a message on
+// stderr, if something could not be applied, e.g. for lack of privileges;
+// the rest is applied regardless.
+bool Initialize();
+
+// Pins the calling thread of a worker pool to --worker_cpus. Cheap to call
+// again from the same thread.
+void ConfigureWorkerThread();
+
+// Same, for the threads of an OpenMP parallel region: call at the start of
+// the region. The thread that entered the region is left as it is.
+void ConfigureOpenMPThread();
+
+// Pins the calling thread to --realtime_cpus and, with --realtime_priority,
+// schedules it SCHED_FIFO; with --lock_memory, also faults in its stack.
+// Returns false, with a message on stderr, if that could not be done.
+bool ConfigureRealtimeThread();
+
+// Writes to every page of [data, data + size), so that the page faults
+// happen now rather than in a time-critical loop.
+void Prefault(void* data, size_t size);
+
+// Faults in size bytes of the calling thread's stack.
+void PrefaultStack(size_t size);
+
+// Number of threads in the budget: --max_threads, or the number of worker
+// CPUs if that is not set.
+int ThreadBudget();
+
+// Worker threads reserved from the budget for as long as the object exists,
+// e.g.
+//   runtime_config::WorkerThreads threads(tasks.size());
+//   for (int i = 0; i < threads.count(); ++i) ...
+// Reserves up to max_threads threads, depending on what the other pools of
+// the process hold, but at least one so that the work always gets done.
+// With one, run the work on the calling thread.
+class WorkerThreads {
+ public:
+  explicit WorkerThreads(size_t max_threads);
+  ~WorkerThreads();
+
+  int count() const { return count_; }
+
+ private:
+  WorkerThreads(const WorkerThreads&) = delete;
+  WorkerThreads& operator=(const WorkerThreads&) = delete;
+
+  int count_;
+  // Taken from the budget, which may be one less than count_.
+  int reserved_;
+};
+
+}  // namespace runtime_config
+
+#endif  // SRC_UTIL_RUNTIME_CONFIG_H_
@@ -19,12 +19,15 @@
 
 #include "util/timer.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <time.h>
 #include <stdio.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <cmath>
+#include <mutex>
 #include <string>
 
 using std::max;
@@ -62,11 +65,33 @@ double GetMonotonicTime() {
   return time;
 }
 
+double GetThreadCpuTime() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  const double time =
+      static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec)*(1.0E-9);
+  return time;
+}
+
 void Sleep(double duration) {
   const useconds_t duration_usec = static_cast<useconds_t>(duration * 1.0E6);
   usleep(duration_usec);
 }
 
+void SleepUntil(double monotonic_time) {
+  timespec ts;
+  ts.tv_sec = static_cast<time_t>(monotonic_time);
+  ts.tv_nsec = static_cast<long>(
+      (monotonic_time - static_cast<double>(ts.tv_sec)) * 1.0E9);
+  if (ts.tv_nsec >= 1000000000L) {
+    ++ts.tv_sec;
+    ts.tv_nsec -= 1000000000L;
+  }
+  // Restart if interrupted by a signal.
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) ==
+         EINTR) {}
+}
+
 RateLoop::RateLoop(double rate) :
     t_last_run_(0.0), delay_interval_(1.0 / rate) { }
 
@@ -77,6 +102,53 @@ void RateLoop::Sleep() {
   t_last_run_ = t_now + sleep_duration;
 }
 
+DeadlineMonitor::DeadlineMonitor(double period) : period_(period) {
+  Reset();
+}
+
+double DeadlineMonitor::Tick() {
+  return Tick(GetMonotonicTime());
+}
+
+double DeadlineMonitor::Tick(double t_now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!ticked_) {
+    ticked_ = true;
+    t_last_tick_ = t_now;
+    return period_;
+  }
+  const double period = t_now - t_last_tick_;
+  const double jitter = std::abs(period - period_);
+  t_last_tick_ = t_now;
+  const double num_periods = std::floor(period / period_ + 0.5);
+  if (num_periods > 1.0) {
+    stats_.num_overruns += static_cast<uint64_t>(num_periods) - 1;
+  }
+  ++stats_.num_cycles;
+  sum_period_ += period;
+  sum_jitter_ += jitter;
+  stats_.last_period = period;
+  stats_.mean_period = sum_period_ / stats_.num_cycles;
+  stats_.max_period = max(stats_.max_period, period);
+  stats_.mean_jitter = sum_jitter_ / stats_.num_cycles;
+  stats_.max_jitter = max(stats_.max_jitter, jitter);
+  return period;
+}
+
+void DeadlineMonitor::Reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ticked_ = false;
+  t_last_tick_ = 0.0;
+  sum_period_ = 0.0;
+  sum_jitter_ = 0.0;
+  stats_ = Stats{0, 0, period_, period_, 0.0, 0.0, 0.0};
+}
+
+DeadlineMonitor::Stats DeadlineMonitor::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
 FunctionTimer::FunctionTimer(const char* name) :
     name_(name), t_start_(GetMonotonicTime()), t_lap_start_(t_start_) {}
 
@@ -21,6 +21,7 @@
 
 #include <stdint.h>
 
+#include <mutex>
 #include <string>
 
 #ifndef SRC_UTIL_TIMER_H_
@@ -44,6 +45,58 @@ class RateLoop {
   const double delay_interval_;
 };
 
+// Measures how well a loop keeps to its period: call Tick() once at the start
+// of every cycle. Records the measured period of each cycle, its jitter (how
+// far it was from the nominal period), and the deadlines missed by cycles
+// that took too long. The loop ticks from one thread, and GetStats() can be
+// called from any other while it runs.
+class DeadlineMonitor {
+ public:
+  struct Stats {
+    // Cycles with a measured period, i.e. all but the first.
+    uint64_t num_cycles;
+    // Deadlines missed: the nominal periods in excess of one that a cycle
+    // took, rounded to the nearest.
+    uint64_t num_overruns;
+    double last_period;
+    double mean_period;
+    double max_period;
+    // Absolute difference between the measured and the nominal period.
+    double mean_jitter;
+    double max_jitter;
+  };
+
+  // Primary constructor, with the nominal period in seconds.
+  explicit DeadlineMonitor(double period);
+
+  // Marks the start of a cycle. Returns the period measured since the
+  // previous Tick(), or the nominal period on the first.
+  double Tick();
+  // As above, with the monotonic time of the start of the cycle.
+  double Tick(double t_now);
+
+  // Forgets the cycles so far: the next Tick() is the first.
+  void Reset();
+
+  Stats GetStats() const;
+
+  double period() const { return period_; }
+
+ private:
+  // Disable default constructor.
+  DeadlineMonitor();
+
+ private:
+  const double period_;
+  mutable std::mutex mutex_;
+  // Whether there was a Tick() since the last Reset(), and its time.
+  bool ticked_;
+  double t_last_tick_;
+  double sum_period_;
+  double sum_jitter_;
+  Stats stats_;
+};
+
 // Return the value of the CPU TSC register.
 uint64_t RDTSC();
 
@@ -54,9 +107,16 @@ double GetWallTime();
 // for code profiling.
 double GetMonotonicTime();
 
+// Get the CPU time in seconds consumed by the calling thread.
+double GetThreadCpuTime();
+
 // Sleep for the specified duration in seconds.
 void Sleep(double duration);
 
+// Sleep until the specified GetMonotonicTime() time, without the drift of
+// computing a duration first. Returns immediately if it has passed.
+void SleepUntil(double monotonic_time);
+
 // Timer to profile function time execution. To use the timer, place the
 // following statement at the begining of the function:
 // FunctionTimer ft(__PRETTY_FUNCTION__);
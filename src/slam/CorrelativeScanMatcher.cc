@@ -1,15 +1,54 @@
 #include "./CorrelativeScanMatcher.h"
+#include <algorithm>
 #include <iostream>
 
-vector<Vector2f> CorrelativeScanMatcher::RotatePointcloud(
-    const vector<Vector2f> &pointcloud, const double rotation) {
-  const Eigen::Matrix2f rot_matrix =
-      Eigen::Rotation2Df(rotation).toRotationMatrix();
-  vector<Vector2f> rotated_pointcloud;
-  for (const Vector2f &point : pointcloud) {
-    rotated_pointcloud.push_back(rot_matrix * point);
+#include "shared/util/runtime_config.h"
+
+namespace {
+
+// The rotation search grid, the same for all searches.
+const double kRotationStep = M_PI / 180.;
+const int kNumRotationSteps = 360;
+
+// Index of a rotation step into the rotated point clouds.
+int RotationIndex(int rotation_step) {
+  const int index = rotation_step % kNumRotationSteps;
+  return (index < 0) ? index + kNumRotationSteps : index;
+}
+
+}  // namespace
+
+void CorrelativeScanMatcher::RotatePointcloud(
+    const vector<Vector2f> &pointcloud, const double rotation,
+    vector<Vector2f> *rotated_pointcloud) {
+  pose_2d::TransformPointCloud(
+      pose_2d::Pose2Df(rotation, Vector2f(0, 0)), pointcloud,
+      rotated_pointcloud);
+}
+
+void CorrelativeScanMatcher::RotatePointclouds(
+    const vector<Vector2f> &pointcloud, const vector<int> &rotation_steps,
+    RotatedPointclouds *rotated_pointclouds) {
+  rotated_pointclouds->resize(kNumRotationSteps);
+  vector<int> missing;
+  for (const int step : rotation_steps) {
+    const int index = RotationIndex(step);
+    if ((*rotated_pointclouds)[index].empty() && !pointcloud.empty()) {
+      // Mark it, so that duplicates are only rotated once.
+      (*rotated_pointclouds)[index].resize(pointcloud.size());
+      missing.push_back(index);
+    }
+  }
+  const runtime_config::WorkerThreads threads(missing.size());
+#pragma omp parallel num_threads(threads.count())
+  {
+    runtime_config::ConfigureOpenMPThread();
+#pragma omp for
+    for (size_t i = 0; i < missing.size(); ++i) {
+      RotatePointcloud(pointcloud, missing[i] * kRotationStep,
+                       &(*rotated_pointclouds)[missing[i]]);
+    }
   }
-  return rotated_pointcloud;
 }
 
 double CorrelativeScanMatcher::CalculatePointcloudCost(
@@ -26,8 +65,18 @@ double CorrelativeScanMatcher::CalculatePointcloudCost(
 }
 
 CostTable CorrelativeScanMatcher::CostTableFromPointCloud(
-    const vector<Vector2f> &pointcloud) {
-  CostTable table(scanner_range_, resolution);
+    const vector<Vector2f> &pointcloud) const {
+  // Only cover the points and the tail of the blur around them: further out
+  // every lookup returns the minimum anyway, and a table over the full
+  // scanner range is mostly empty for indoor scans. The blur is recursive,
+  // so its tail only drops below MIN_VALUE_FOR_LOOKUP after ~20 sigma.
+  float extent = 0;
+  for (const Vector2f &point : pointcloud) {
+    extent = std::max(extent, point.cwiseAbs().maxCoeff());
+  }
+  const double blur_margin = 20 * DEFAULT_GAUSSIAN_SIGMA * resolution;
+  CostTable table(std::min(scanner_range_, extent + blur_margin + resolution),
+                  resolution);
   for (const Vector2f &point : pointcloud) {
     table.SetPointValue(point, 1);
   }
@@ -37,22 +86,31 @@ CostTable CorrelativeScanMatcher::CostTableFromPointCloud(
 }
 
 void CorrelativeScanMatcher::GenerateSearchParams(
-    vector<pair<double, double>> &tranlations, vector<double> &rotations,
-    const Trans &odom) {
-  rotations.clear();
-  rotations.reserve(360);
-  for (int i = 0; i < 360; i++) {
-    rotations.push_back(i * M_PI / 180.);
+    vector<pair<double, double>> &tranlations, vector<int> &rotation_steps,
+    const Trans &odom, double trans_window, double rotation_window) {
+  rotation_steps.clear();
+  if (rotation_window >= M_PI) {
+    rotation_steps.reserve(kNumRotationSteps);
+    for (int i = 0; i < kNumRotationSteps; i++) {
+      rotation_steps.push_back(i);
+    }
+  } else {
+    // Stay on the same 1 degree grid as the full search.
+    const int center = std::round(odom.second / kRotationStep);
+    const int half_width = std::ceil(rotation_window / kRotationStep);
+    for (int i = center - half_width; i <= center + half_width; i++) {
+      rotation_steps.push_back(i);
+    }
   }
 
-  int num_translations = std::ceil((trans_range_ * 2 - EPSILON) / resolution);
+  int num_translations = std::ceil((trans_window * 2 - EPSILON) / resolution);
   tranlations.clear();
   tranlations.reserve(num_translations * num_translations);
 
   for (int i = 0; i < num_translations; i++) {
-    double x_trans = i * resolution - trans_range_ + EPSILON + odom.first.x();
+    double x_trans = i * resolution - trans_window + EPSILON + odom.first.x();
     for (int j = 0; j < num_translations; j++) {
-      double y_trans = j * resolution - trans_range_ + EPSILON + odom.first.y();
+      double y_trans = j * resolution - trans_window + EPSILON + odom.first.y();
       tranlations.push_back(std::make_pair(x_trans, y_trans));
     }
   }
@@ -61,34 +119,90 @@ void CorrelativeScanMatcher::GenerateSearchParams(
 bool CorrelativeScanMatcher::GetTransform(
     const vector<Vector2f> &pointcloud_a, const vector<Vector2f> &pointcloud_b,
     const Trans &odom, pair<Trans, Eigen::Matrix3f> &transform) {
-  vector<double> rotations(360);
-  vector<pair<double, double>> translations;
-  GenerateSearchParams(translations, rotations, odom);
   const CostTable cost_table = CostTableFromPointCloud(pointcloud_b);
+  return GetTransform(
+      pointcloud_a, cost_table, odom, trans_range_, M_PI, transform);
+}
 
+bool CorrelativeScanMatcher::GetTransform(
+    const vector<Vector2f> &pointcloud_a, const CostTable &cost_table,
+    const Trans &odom, double trans_window, double rotation_window,
+    pair<Trans, Eigen::Matrix3f> &transform) {
+  vector<int> rotation_steps;
+  vector<pair<double, double>> translations;
+  GenerateSearchParams(
+      translations, rotation_steps, odom, trans_window, rotation_window);
+  RotatedPointclouds rotated_pointclouds_a;
+  RotatePointclouds(pointcloud_a, rotation_steps, &rotated_pointclouds_a);
+  return MatchRotated(rotated_pointclouds_a, cost_table, odom, translations,
+                      rotation_steps, transform);
+}
+
+vector<bool> CorrelativeScanMatcher::GetTransforms(
+    const vector<Vector2f> &pointcloud_a,
+    const vector<const vector<Vector2f> *> &pointclouds_b,
+    const vector<Trans> &odoms,
+    vector<pair<Trans, Eigen::Matrix3f>> *results) {
+  CHECK_EQ(pointclouds_b.size(), odoms.size());
+  results->resize(pointclouds_b.size());
+  vector<bool> converged(pointclouds_b.size(), false);
+  RotatedPointclouds rotated_pointclouds_a;
+  vector<int> rotation_steps;
+  vector<pair<double, double>> translations;
+  for (size_t i = 0; i < pointclouds_b.size(); ++i) {
+    GenerateSearchParams(
+        translations, rotation_steps, odoms[i], trans_range_, M_PI);
+    RotatePointclouds(pointcloud_a, rotation_steps, &rotated_pointclouds_a);
+    const CostTable cost_table = CostTableFromPointCloud(*pointclouds_b[i]);
+    converged[i] = MatchRotated(rotated_pointclouds_a, cost_table,
+                                odoms[i], translations, rotation_steps,
+                                (*results)[i]);
+  }
+  return converged;
+}
+
+bool CorrelativeScanMatcher::MatchRotated(
+    const RotatedPointclouds &rotated_pointclouds_a,
+    const CostTable &cost_table, const Trans &odom,
+    const vector<pair<double, double>> &translations,
+    const vector<int> &rotation_steps,
+    pair<Trans, Eigen::Matrix3f> &transform) {
   // Calculation Method taken from Realtime Correlative Scan Matching
   // by Edward Olsen.
   Eigen::Matrix3f K = Eigen::Matrix3f::Zero();
   Eigen::Vector3f u(0, 0, 0);
   double s = 0;
-#pragma omp parallel for
-  for (double rotation : rotations) {
-    const vector<Vector2f> rotated_pointcloud_a =
-        RotatePointcloud(pointcloud_a, rotation);
-    for (const pair<double, double> &translation : translations) {
-      double x_trans = translation.first, y_trans = translation.second;
-      double cost = CalculatePointcloudCost(
-        rotated_pointcloud_a, x_trans, y_trans, cost_table);
+  const runtime_config::WorkerThreads threads(rotation_steps.size());
+#pragma omp parallel num_threads(threads.count())
+  {
+    runtime_config::ConfigureOpenMPThread();
+    // Each thread sums its share, and adds it to the totals once.
+    Eigen::Matrix3f thread_K = Eigen::Matrix3f::Zero();
+    Eigen::Vector3f thread_u(0, 0, 0);
+    double thread_s = 0;
+#pragma omp for
+    for (size_t i = 0; i < rotation_steps.size(); ++i) {
+      const double rotation = rotation_steps[i] * kRotationStep;
+      const vector<Vector2f> &rotated_pointcloud_a =
+          rotated_pointclouds_a[RotationIndex(rotation_steps[i])];
+      for (const pair<double, double> &translation : translations) {
+        double x_trans = translation.first, y_trans = translation.second;
+        double cost = CalculatePointcloudCost(
+          rotated_pointcloud_a, x_trans, y_trans, cost_table);
         const Trans trans = std::make_pair(Vector2f(x_trans, y_trans), rotation);
         cost += EvaluateMotionModel(trans, odom);
         Eigen::Vector3f x(x_trans, y_trans, rotation);
         cost = exp(cost);
-        #pragma omp critical
-        {
-          K += x * x.transpose() * cost;
-          u += x * cost;
-          s += cost;
-        }
+        thread_K += x * x.transpose() * cost;
+        thread_u += x * cost;
+        thread_s += cost;
+      }
+    }
+    #pragma omp critical
+    {
+      K += thread_K;
+      u += thread_u;
+      s += thread_s;
     }
   }
 
@@ -4,6 +4,7 @@
 #include <vector>
 #include "eigen3/Eigen/Dense"
 #include "visualization/CImg.h"
+#include "shared/math/poses_2d.h"
 #include "shared/math/statistics.h"
 
 #define DEFAULT_GAUSSIAN_SIGMA 1
@@ -95,16 +96,76 @@ class CorrelativeScanMatcher {
     const Trans &odom,
     pair<Trans, Eigen::Matrix3f> &results);
 
+  /**
+   * @brief Same as above, but matches against a cost table built beforehand
+   * with CostTableFromPointCloud() and only searches translations within
+   * trans_window and rotations within rotation_window of odom.
+   *
+   * @param pointcloud_a [in]
+   * @param cost_table_b [in] cost table of pointcloud_b
+   * @param odom [in]
+   * @param trans_window [in] half width of the translation search window
+   * @param rotation_window [in] half width of the rotation search window
+   * @param results [out]
+   * @return true if csm converged, false otherwise
+   */
+  bool GetTransform(
+    const vector<Vector2f> &pointcloud_a,
+    const CostTable &cost_table_b,
+    const Trans &odom,
+    double trans_window,
+    double rotation_window,
+    pair<Trans, Eigen::Matrix3f> &results);
+
+  /**
+   * @brief Matches pointcloud_a against several point clouds in one call,
+   * each with its own odometry, over the full search window. Each rotation
+   * of pointcloud_a is computed once and shared by all matches and threads,
+   * instead of once per GetTransform() call. The cost tables are built one
+   * at a time, so only one of them is in memory at once.
+   *
+   * @param pointcloud_a [in]
+   * @param pointclouds_b [in]
+   * @param odoms [in] odometry for each of pointclouds_b
+   * @param results [out] transform for each of pointclouds_b
+   * @return for each of pointclouds_b, true if csm converged, false otherwise
+   */
+  vector<bool> GetTransforms(
+    const vector<Vector2f> &pointcloud_a,
+    const vector<const vector<Vector2f> *> &pointclouds_b,
+    const vector<Trans> &odoms,
+    vector<pair<Trans, Eigen::Matrix3f>> *results);
+
+  CostTable CostTableFromPointCloud(const vector<Vector2f> &pointcloud) const;
+
  private:
-  static vector<Vector2f> RotatePointcloud(
-    const vector<Vector2f> &pointcloud, const double rotation);
+  // Rotations of a point cloud, indexed by rotation step modulo a full turn.
+  // Only the rotations some search needs are filled in.
+  typedef vector<vector<Vector2f>> RotatedPointclouds;
+
+  static void RotatePointcloud(
+    const vector<Vector2f> &pointcloud, const double rotation,
+    vector<Vector2f> *rotated_pointcloud);
+  // Fills in the rotations of pointcloud in rotation_steps that are not in
+  // rotated_pointclouds yet, in parallel.
+  static void RotatePointclouds(
+    const vector<Vector2f> &pointcloud, const vector<int> &rotation_steps,
+    RotatedPointclouds *rotated_pointclouds);
+  // GetTransform() for search parameters from GenerateSearchParams(), with
+  // the rotations of pointcloud_a from RotatePointclouds().
+  bool MatchRotated(
+    const RotatedPointclouds &rotated_pointclouds_a,
+    const CostTable &cost_table_b, const Trans &odom,
+    const vector<pair<double, double>> &translations,
+    const vector<int> &rotation_steps,
+    pair<Trans, Eigen::Matrix3f> &results);
   static double CalculatePointcloudCost(
     const vector<Vector2f> &pointcloud, const double x_trans,
     const double y_trans, const CostTable &cost_table);
-  CostTable CostTableFromPointCloud(const vector<Vector2f> &pointcloud);
+  // Rotations are in steps of kRotationStep.
   void GenerateSearchParams(
-    vector<pair<double, double>> &tranlations, vector<double> &rotations,
-    const Trans &odom);
+    vector<pair<double, double>> &tranlations, vector<int> &rotation_steps,
+    const Trans &odom, double trans_window, double rotation_window);
   double EvaluateMotionModel(const Trans &trans, const Trans &odom);
   double scanner_range_;
   double trans_range_;
@@ -0,0 +1,98 @@
+#ifndef SRC_SLAM_KEYFRAME_INDEX_H_
+#define SRC_SLAM_KEYFRAME_INDEX_H_
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+namespace slam {
+
+// Uniform grid over keyframe locations, for finding the keyframes near a
+// pose without scanning all of them. Keyframes are identified by their index.
+class KeyframeIndex {
+ public:
+  explicit KeyframeIndex(float cell_size = 2.0) : cell_size_(cell_size) {}
+
+  void Clear() {
+    cells_.clear();
+    locations_.clear();
+  }
+
+  // Add a keyframe at loc. Ids are expected to be 0, 1, 2, ...
+  void Insert(size_t id, const Eigen::Vector2f& loc) {
+    if (locations_.size() <= id) locations_.resize(id + 1);
+    locations_[id] = loc;
+    cells_[CellKey(CellX(loc.x()), CellY(loc.y()))].push_back(id);
+  }
+
+  size_t Size() const { return locations_.size(); }
+
+  // Number of keyframes within max_dist of loc.
+  size_t CountWithin(const Eigen::Vector2f& loc, float max_dist) const {
+    size_t count = 0;
+    const int x0 = CellX(loc.x() - max_dist), x1 = CellX(loc.x() + max_dist);
+    const int y0 = CellY(loc.y() - max_dist), y1 = CellY(loc.y() + max_dist);
+    for (int x = x0; x <= x1; ++x) {
+      for (int y = y0; y <= y1; ++y) {
+        const auto cell = cells_.find(CellKey(x, y));
+        if (cell == cells_.end()) continue;
+        for (const size_t id : cell->second) {
+          if ((locations_[id] - loc).squaredNorm() < max_dist * max_dist) {
+            ++count;
+          }
+        }
+      }
+    }
+    return count;
+  }
+
+  // Ids of at most k keyframes within max_dist of loc, nearest first.
+  void Nearest(const Eigen::Vector2f& loc,
+               size_t k,
+               float max_dist,
+               std::vector<size_t>* ids) const {
+    ids->clear();
+    std::vector<std::pair<float, size_t>> candidates;
+    const int x0 = CellX(loc.x() - max_dist), x1 = CellX(loc.x() + max_dist);
+    const int y0 = CellY(loc.y() - max_dist), y1 = CellY(loc.y() + max_dist);
+    for (int x = x0; x <= x1; ++x) {
+      for (int y = y0; y <= y1; ++y) {
+        const auto cell = cells_.find(CellKey(x, y));
+        if (cell == cells_.end()) continue;
+        for (const size_t id : cell->second) {
+          const float sq_dist = (locations_[id] - loc).squaredNorm();
+          if (sq_dist <= max_dist * max_dist) {
+            candidates.push_back(std::make_pair(sq_dist, id));
+          }
+        }
+      }
+    }
+    const size_t n = std::min(k, candidates.size());
+    std::partial_sort(
+        candidates.begin(), candidates.begin() + n, candidates.end());
+    for (size_t i = 0; i < n; ++i) {
+      ids->push_back(candidates[i].second);
+    }
+  }
+
+ private:
+  int CellX(float x) const { return static_cast<int>(std::floor(x / cell_size_)); }
+  int CellY(float y) const { return static_cast<int>(std::floor(y / cell_size_)); }
+
+  static uint64_t CellKey(int x, int y) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) |
+        static_cast<uint32_t>(y);
+  }
+
+  float cell_size_;
+  std::unordered_map<uint64_t, std::vector<size_t>> cells_;
+  std::vector<Eigen::Vector2f> locations_;
+};
+
+}  // namespace slam
+
+#endif  // SRC_SLAM_KEYFRAME_INDEX_H_
@@ -52,7 +52,7 @@ namespace slam
          * Get the point cloud
          * @return
          */
-        std::vector<Eigen::Vector2f> getPointCloud() const
+        const std::vector<Eigen::Vector2f> &getPointCloud() const
         {
             return point_cloud;
         }
@@ -19,9 +19,12 @@
 */
 //========================================================================
 
+#include <stdio.h>
 #include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <map>
+#include <thread>
 #include <ros/ros.h>
 #include <gtsam/nonlinear/ISAM2.h>
 #include "eigen3/Eigen/Dense"
@@ -30,6 +33,8 @@
 #include "glog/logging.h"
 #include "shared/math/geometry.h"
 #include "shared/math/math_util.h"
+#include "shared/util/helpers.h"
+#include "shared/util/runtime_config.h"
 #include "shared/util/timer.h"
 
 #include "slam.h"
@@ -37,8 +42,6 @@
 #include "vector_map/vector_map.h"
 #include "config_reader/config_reader.h"
 
-#include "config_reader/config_reader.h"
-
 using namespace gtsam;
 using namespace math_util;
 using Eigen::Affine2f;
@@ -57,6 +60,16 @@ using vector_map::VectorMap;
 CONFIG_FLOAT(min_angle_diff_between_nodes, "min_angle_diff_between_nodes");
 CONFIG_FLOAT(min_trans_diff_between_nodes, "min_trans_diff_between_nodes");
 
+// Adaptive keyframe selection
+CONFIG_BOOL(adaptive_keyframes, "adaptive_keyframes");
+CONFIG_FLOAT(keyframe_min_trans_diff, "keyframe_min_trans_diff");
+CONFIG_FLOAT(keyframe_min_angle_diff, "keyframe_min_angle_diff");
+CONFIG_FLOAT(keyframe_max_trans_diff, "keyframe_max_trans_diff");
+CONFIG_FLOAT(keyframe_voxel_size, "keyframe_voxel_size");
+CONFIG_FLOAT(keyframe_min_novelty, "keyframe_min_novelty");
+CONFIG_FLOAT(keyframe_density_radius, "keyframe_density_radius");
+CONFIG_INT(keyframe_max_nodes_per_area, "keyframe_max_nodes_per_area");
+
 // PoseGraph Parameters
 CONFIG_FLOAT(new_node_x_std, "new_node_x_std");
 CONFIG_FLOAT(new_node_y_std, "new_node_y_std");
@@ -64,9 +77,13 @@ CONFIG_FLOAT(new_node_theta_std, "new_node_theta_std");
 CONFIG_FLOAT(max_factors_per_node, "max_factors_per_node");
 CONFIG_FLOAT(maximum_node_dis_scan_comparison, "maximum_node_dis_scan_comparison");
 CONFIG_BOOL(non_successive_scan_constraints, "non_successive_scan_constraints");
+CONFIG_FLOAT(loop_closure_gate_sigmas, "loop_closure_gate_sigmas");
+CONFIG_FLOAT(loop_closure_max_gate_margin, "loop_closure_max_gate_margin");
 CONFIG_FLOAT(initial_node_global_x, "initial_node_global_x");
 CONFIG_FLOAT(initial_node_global_y, "initial_node_global_y");
 CONFIG_FLOAT(initial_node_global_theta, "initial_node_global_theta");
+CONFIG_FLOAT(frozen_node_xy_std, "frozen_node_xy_std");
+CONFIG_FLOAT(frozen_node_theta_std, "frozen_node_theta_std");
 
 // Motion Model Parameters
 CONFIG_FLOAT(motion_model_trans_err_from_trans, "motion_model_trans_err_from_trans");
@@ -78,6 +95,23 @@ CONFIG_FLOAT(motion_model_rot_err_from_rot, "motion_model_rot_err_from_rot");
 CONFIG_BOOL(runOnline, "runOnline");
 CONFIG_BOOL(runOffline, "runOffline");
 
+// Localization only
+CONFIG_BOOL(localization_only, "localization_only");
+CONFIG_INT(localization_num_keyframes, "localization_num_keyframes");
+CONFIG_FLOAT(localization_max_keyframe_dist, "localization_max_keyframe_dist");
+CONFIG_FLOAT(localization_trans_window, "localization_trans_window");
+CONFIG_FLOAT(localization_rot_window, "localization_rot_window");
+CONFIG_FLOAT(localization_min_trans_diff, "localization_min_trans_diff");
+CONFIG_FLOAT(localization_min_angle_diff, "localization_min_angle_diff");
+CONFIG_INT(localization_window_size, "localization_window_size");
+CONFIG_FLOAT(localization_anchor_xy_std, "localization_anchor_xy_std");
+CONFIG_FLOAT(localization_anchor_theta_std, "localization_anchor_theta_std");
+CONFIG_INT(localization_cost_table_cache_size, "localization_cost_table_cache_size");
+
+// Offline optimization
+CONFIG_FLOAT(offline_preview_interval, "offline_preview_interval");
+CONFIG_FLOAT(offline_checkpoint_interval, "offline_checkpoint_interval");
+
 // Debugging ScanMatch
 CONFIG_BOOL(fix_mean, "fix_mean");
 CONFIG_BOOL(fix_covariance, "fix_covariance");
@@ -90,22 +124,243 @@ float k2 = 0.05;
 float k3 = 0.1;
 float k4 = 0.1;
 
-namespace slam
+namespace
 {
+  // Pack the integer voxel coordinates of a point into a single hash key.
+  uint64_t voxelKey(const int ix, const int iy)
+  {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(ix)) << 32) |
+           static_cast<uint32_t>(iy);
+  }
+
+  uint64_t voxelKey(const Vector2f &p, const float voxel_size)
+  {
+    return voxelKey(static_cast<int>(floor(p.x() / voxel_size)),
+                    static_cast<int>(floor(p.y() / voxel_size)));
+  }
+
+  Pose2 toPose2(const pose_2d::Pose2Df &pose)
+  {
+    return Pose2(pose.translation.x(), pose.translation.y(), pose.angle);
+  }
+
+  // Pose graph file: magic, node count, then per node the estimated pose
+  // (x, y, theta), the number of points and the points (x, y) as floats.
+  const char kPoseGraphMagic[4] = {'P', 'G', 'R', '1'};
+
+  // Offline checkpoint file: magic, the nodes as in a pose graph file, the
+  // number of frozen nodes, the number of nodes already matched and the
+  // number of constraints, then per constraint the two node numbers, the
+  // relative pose (x, y, theta) and the row-major covariance as floats.
+  const char kOfflineCheckpointMagic[4] = {'P', 'G', 'C', '1'};
+
+  bool writeNodes(FILE *fid, const vector<slam::PgNode> &nodes)
+  {
+    const uint64_t num_nodes = nodes.size();
+    bool ok = fwrite(&num_nodes, sizeof(num_nodes), 1, fid) == 1;
+    for (size_t i = 0; ok && i < nodes.size(); i++)
+    {
+      const pose_2d::Pose2Df pose = nodes[i].getEstimatedPose();
+      const float pose_data[3] = {pose.translation.x(), pose.translation.y(), pose.angle};
+      const vector<Vector2f> &point_cloud = nodes[i].getPointCloud();
+      const uint64_t num_points = point_cloud.size();
+      ok = fwrite(pose_data, sizeof(pose_data), 1, fid) == 1 &&
+           fwrite(&num_points, sizeof(num_points), 1, fid) == 1 &&
+           fwrite(point_cloud.data(), sizeof(Vector2f), num_points, fid) == num_points;
+    }
+    return ok;
+  }
+
+  // Node numbers are indices into nodes.
+  bool readNodes(FILE *fid, vector<slam::PgNode> *nodes)
+  {
+    uint64_t num_nodes = 0;
+    if (fread(&num_nodes, sizeof(num_nodes), 1, fid) != 1)
+    {
+      return false;
+    }
+    nodes->clear();
+    nodes->reserve(num_nodes);
+    for (uint64_t i = 0; i < num_nodes; i++)
+    {
+      float pose_data[3];
+      uint64_t num_points = 0;
+      if (fread(pose_data, sizeof(pose_data), 1, fid) != 1 ||
+          fread(&num_points, sizeof(num_points), 1, fid) != 1)
+      {
+        return false;
+      }
+      vector<Vector2f> point_cloud(num_points);
+      if (fread(point_cloud.data(), sizeof(Vector2f), num_points, fid) != num_points)
+      {
+        return false;
+      }
+      nodes->emplace_back(pose_2d::Pose2Df(pose_data[2], Vector2f(pose_data[0], pose_data[1])),
+                          nodes->size(), std::move(point_cloud));
+    }
+    return true;
+  }
+
+  // Runs fn(i) for every i < n on worker threads from the thread budget, or
+  // on the calling thread if the budget only allows one.
+  template <typename Fn>
+  void parallelFor(size_t n, const Fn &fn)
+  {
+    const runtime_config::WorkerThreads threads(n);
+    const size_t num_threads = threads.count();
+    if (num_threads <= 1)
+    {
+      for (size_t i = 0; i < n; ++i)
+      {
+        fn(i);
+      }
+      return;
+    }
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads);
+    for (size_t t = 0; t < num_threads; ++t)
+    {
+      workers.emplace_back([&, t]() {
+        runtime_config::ConfigureWorkerThread();
+        for (size_t i = t; i < n; i += num_threads)
+        {
+          fn(i);
+        }
+      });
+    }
+    for (auto &worker : workers)
+    {
+      worker.join();
+    }
+  }
+} // namespace
 
-  // load config from file
-  config_reader::ConfigReader config_reader_({"config/slam.lua"});
+namespace slam
+{
 
   SLAM::SLAM() : prev_odom_loc_(0, 0),
                  prev_odom_angle_(0),
                  odom_initialized_(false),
                  first_scan(true),
                  last_node_cumulative_dist_(0),
+                 keyframe_rejected_(false),
+                 rejected_cumulative_dist_(0),
+                 rejected_odom_angle_(0),
+                 graph_(nullptr),
+                 isam_(nullptr),
+                 num_frozen_nodes_(0),
                  matcher(scanner_range, trans_range, resolution, k1, k2, k3, k4),
-                 stopSlamCmdRecv_(false)
+                 stopSlamCmdRecv_(false),
+                 node_index_dirty_(true),
+                 next_localization_key_(0),
+                 offline_progress_(),
+                 offline_cancel_(false),
+                 num_scan_matches_(0),
+                 offline_next_node_(0),
+                 node_cloud_memory_("slam/pg_node_clouds"),
+                 cost_table_memory_("slam/cost_tables")
   {
-    graph_ = new NonlinearFactorGraph();
-    isam_ = new ISAM2();
+  }
+
+  SLAM::~SLAM()
+  {
+    // An unfinished offline optimization saves a checkpoint and stops.
+    offline_cancel_ = true;
+    WaitForOfflineOptimization();
+    delete graph_;
+    delete isam_;
+  }
+
+  void SLAM::initPoseGraph()
+  {
+    // The factor graph and iSAM2 are only needed once the first node is
+    // added, so don't pay for them at startup.
+    if (graph_ == nullptr)
+    {
+      graph_ = new NonlinearFactorGraph();
+    }
+    if (isam_ == nullptr)
+    {
+      isam_ = new ISAM2();
+    }
+  }
+
+  void SLAM::addFrozenNodePriors()
+  {
+    noiseModel::Diagonal::shared_ptr frozen_noise =
+        noiseModel::Diagonal::Sigmas(Vector3(CONFIG_frozen_node_xy_std,
+                                             CONFIG_frozen_node_xy_std,
+                                             CONFIG_frozen_node_theta_std));
+    for (size_t i = 0; i < num_frozen_nodes_; i++)
+    {
+      const pose_2d::Pose2Df pose = pg_nodes_[i].getEstimatedPose();
+      graph_->add(PriorFactor<Pose2>(pg_nodes_[i].getNodeNumber(),
+                                     Pose2(pose.translation.x(), pose.translation.y(), pose.angle),
+                                     frozen_noise));
+    }
+  }
+
+  void SLAM::addInitialNodePrior(size_t node_number)
+  {
+    Pose2 init_pos(CONFIG_initial_node_global_x, CONFIG_initial_node_global_y, CONFIG_initial_node_global_theta);
+    noiseModel::Diagonal::shared_ptr init_noise =
+        noiseModel::Diagonal::Sigmas(Vector3(CONFIG_new_node_x_std,
+                                             CONFIG_new_node_y_std,
+                                             CONFIG_new_node_theta_std));
+    graph_->add(PriorFactor<Pose2>(node_number, init_pos, init_noise));
+  }
+
+  bool SLAM::SavePoseGraph(const string &file) const
+  {
+    ScopedFile fid(file, "wb", true);
+    if (fid() == NULL)
+    {
+      return false;
+    }
+    const bool ok = fwrite(kPoseGraphMagic, sizeof(kPoseGraphMagic), 1, fid) == 1 &&
+                    writeNodes(fid, pg_nodes_);
+    if (!ok)
+    {
+      ROS_ERROR_STREAM("Failed to write pose graph to " << file);
+    }
+    return ok;
+  }
+
+  bool SLAM::LoadPoseGraph(const string &file)
+  {
+    if (!first_scan || !pg_nodes_.empty())
+    {
+      ROS_ERROR_STREAM("A pose graph can only be loaded before the first scan");
+      return false;
+    }
+    ScopedFile fid(file, "rb", true);
+    if (fid() == NULL)
+    {
+      return false;
+    }
+    char magic[sizeof(kPoseGraphMagic)];
+    if (fread(magic, sizeof(magic), 1, fid) != 1 ||
+        !std::equal(magic, magic + sizeof(magic), kPoseGraphMagic))
+    {
+      ROS_ERROR_STREAM(file << " is not a pose graph file");
+      return false;
+    }
+    vector<PgNode> nodes;
+    if (!readNodes(fid, &nodes))
+    {
+      ROS_ERROR_STREAM("Truncated pose graph file " << file);
+      return false;
+    }
+    pg_nodes_.swap(nodes);
+    updateMemoryAccounts();
+    node_index_dirty_ = true;
+    num_frozen_nodes_ = pg_nodes_.size();
+    keyframe_index_.Clear();
+    for (const PgNode &node : pg_nodes_)
+    {
+      keyframe_index_.Insert(node.getNodeNumber(), node.getEstimatedPose().translation);
+    }
+    return true;
   }
 
   // return global frame
@@ -114,7 +369,24 @@ namespace slam
     // Return the latest pose estimate of the robot.
     // *loc = Vector2f(0, 0);
     // *angle = 0;
-    if (pg_nodes_.size() == 0)
+    if (CONFIG_localization_only)
+    {
+      // Extrapolate the latest localized pose with odometry.
+      const pose_2d::Pose2Df odom_pose(prev_odom_angle_, prev_odom_loc_);
+      pose_2d::Pose2Df ref_map_pose(CONFIG_initial_node_global_theta,
+                                    Vector2f(CONFIG_initial_node_global_x, CONFIG_initial_node_global_y));
+      pose_2d::Pose2Df ref_odom_pose = odom_pose;
+      if (!localization_window_.empty())
+      {
+        ref_map_pose = localization_window_.back().estimate;
+        ref_odom_pose = localization_window_.back().odom_pose;
+      }
+      const pose_2d::Pose2Df pos_map = transformPoseFromSrc2Map(
+          transformPoseFromMap2Target(odom_pose, ref_odom_pose), ref_map_pose);
+      *angle = pos_map.angle;
+      *loc = pos_map.translation;
+    }
+    else if (first_scan)
     {
       *loc = Vector2f(0, 0);
       *angle = 0;
@@ -126,8 +398,13 @@ namespace slam
           pose_2d::Pose2Df(prev_odom_angle_, prev_odom_loc_),
           last_node_odom_pose_);
 
+      pose_2d::Pose2Df last_node_pose;
+      {
+        std::lock_guard<std::mutex> lock(offline_mutex_);
+        last_node_pose = displayPose(pg_nodes_.size() - 1);
+      }
       // Transform rel_pos_to_last_node_odom_pose to global frame. Get M(i, global_frame) = M(i, i-1) * M(i-1, global_frame)
-      pose_2d::Pose2Df pos_map = transformPoseFromSrc2Map(rel_pos_to_last_node_odom_pose, pg_nodes_.back().getEstimatedPose());
+      pose_2d::Pose2Df pos_map = transformPoseFromSrc2Map(rel_pos_to_last_node_odom_pose, last_node_pose);
 
       *angle = pos_map.angle;
       *loc = pos_map.translation;
@@ -136,7 +413,13 @@ namespace slam
 
   std::vector<PgNode> SLAM::GetPgNodes() const
   {
-    return pg_nodes_;
+    std::lock_guard<std::mutex> lock(offline_mutex_);
+    std::vector<PgNode> nodes = pg_nodes_;
+    for (size_t i = 0; i < offline_preview_poses_.size(); i++)
+    {
+      nodes[i].setPose(offline_preview_poses_[i].translation, offline_preview_poses_[i].angle);
+    }
+    return nodes;
   }
 
   void SLAM::ObserveLaser(const vector<float> &ranges,
@@ -149,12 +432,32 @@ namespace slam
     // for SLAM. If decided to add, align it to the scan from the last saved pose,
     // and save both the scan and the optimized pose.
 
-    if (!stopSlamCmdRecv_ && shouldAddPgNode())
+    if (CONFIG_localization_only)
+    {
+      bool localize = localization_window_.empty();
+      if (!localize)
+      {
+        const LocalizationFrame &last_frame = localization_window_.back();
+        localize = (prev_odom_loc_ - last_frame.odom_pose.translation).norm() > CONFIG_localization_min_trans_diff ||
+                   math_util::AngleDist(prev_odom_angle_, last_frame.odom_pose.angle) > CONFIG_localization_min_angle_diff;
+      }
+      if (localize)
+      {
+        convertLidar2PointCloud(ranges, range_min, range_max, angle_min, angle_max);
+        localizeScan();
+      }
+      return;
+    }
+
+    if (!stopSlamCmdRecv_ && isKeyframeCandidate())
     {
-      ROS_INFO_STREAM("Adding new node...");
       // convert recent lidar scan to recent_point_cloud_
       convertLidar2PointCloud(ranges, range_min, range_max, angle_min, angle_max);
-      updatePoseGraph();
+      if (shouldAddPgNode())
+      {
+        ROS_INFO_STREAM("Adding new node...");
+        updatePoseGraph();
+      }
     }
 
     // if (stopSlamCmdRecv_ && CONFIG_runOffline) {
@@ -162,41 +465,147 @@ namespace slam
     // }
   }
 
-  bool SLAM::shouldAddPgNode()
+  bool SLAM::isKeyframeCandidate()
   {
     // Check if odom has changed enough since the last node.
     float angle_diff = math_util::AngleDist(prev_odom_angle_, last_node_odom_pose_.angle);
 
-    if ((last_node_cumulative_dist_ > CONFIG_min_trans_diff_between_nodes) || (angle_diff > CONFIG_min_angle_diff_between_nodes))
+    if (!CONFIG_adaptive_keyframes || first_scan)
+    {
+      return (last_node_cumulative_dist_ > CONFIG_min_trans_diff_between_nodes) ||
+             (angle_diff > CONFIG_min_angle_diff_between_nodes);
+    }
+    if (last_node_cumulative_dist_ > CONFIG_keyframe_max_trans_diff)
     {
-      last_node_cumulative_dist_ = 0.0;
       return true;
     }
-    return false;
+    if (keyframe_rejected_)
+    {
+      // Don't re-evaluate every scan after a rejection.
+      return (last_node_cumulative_dist_ - rejected_cumulative_dist_ > CONFIG_keyframe_min_trans_diff) ||
+             (math_util::AngleDist(prev_odom_angle_, rejected_odom_angle_) > CONFIG_keyframe_min_angle_diff);
+    }
+    return (last_node_cumulative_dist_ > CONFIG_keyframe_min_trans_diff) ||
+           (angle_diff > CONFIG_keyframe_min_angle_diff);
+  }
+
+  bool SLAM::shouldAddPgNode()
+  {
+    if (CONFIG_adaptive_keyframes && !first_scan &&
+        last_node_cumulative_dist_ <= CONFIG_keyframe_max_trans_diff)
+    {
+      // Don't keep adding nodes to an area that is already well covered, e.g.
+      // when driving the same loop again.
+      Vector2f loc;
+      float angle;
+      GetPose(&loc, &angle);
+      // Skip scans that mostly re-observe what the last node already saw.
+      if (countPgNodesNear(loc, CONFIG_keyframe_density_radius) >= CONFIG_keyframe_max_nodes_per_area ||
+          computeScanNovelty() < CONFIG_keyframe_min_novelty)
+      {
+        keyframe_rejected_ = true;
+        rejected_cumulative_dist_ = last_node_cumulative_dist_;
+        rejected_odom_angle_ = prev_odom_angle_;
+        return false;
+      }
+    }
+    last_node_cumulative_dist_ = 0.0;
+    keyframe_rejected_ = false;
+    return true;
+  }
+
+  float SLAM::computeScanNovelty()
+  {
+    const float voxel_size = CONFIG_keyframe_voxel_size;
+    // Current pose in the frame of the last node, from odometry.
+    const pose_2d::Pose2Df rel_pose = transformPoseFromMap2Target(
+        pose_2d::Pose2Df(prev_odom_angle_, prev_odom_loc_),
+        last_node_odom_pose_);
+    const Eigen::Rotation2Df rotation(rel_pose.angle);
+
+    std::unordered_set<uint64_t> scan_voxels;
+    scan_voxels.reserve(recent_point_cloud_.size());
+    int num_voxels = 0;
+    int num_novel = 0;
+    for (const Vector2f &point : recent_point_cloud_)
+    {
+      if (!scan_voxels.insert(voxelKey(point, voxel_size)).second)
+      {
+        continue;
+      }
+      num_voxels++;
+      // Look the point up in the last node's voxels, allowing one voxel of
+      // slack for odometry error.
+      const Vector2f p = rotation * point + rel_pose.translation;
+      const int ix = static_cast<int>(floor(p.x() / voxel_size));
+      const int iy = static_cast<int>(floor(p.y() / voxel_size));
+      bool seen = false;
+      for (int dx = -1; dx <= 1 && !seen; ++dx)
+      {
+        for (int dy = -1; dy <= 1 && !seen; ++dy)
+        {
+          seen = last_node_voxels_.count(voxelKey(ix + dx, iy + dy)) > 0;
+        }
+      }
+      if (!seen)
+      {
+        num_novel++;
+      }
+    }
+    if (num_voxels == 0)
+    {
+      return 0;
+    }
+    return static_cast<float>(num_novel) / num_voxels;
+  }
+
+  int SLAM::countPgNodesNear(const Vector2f &loc, float radius)
+  {
+    if (node_index_dirty_ || node_index_.Size() != pg_nodes_.size())
+    {
+      node_index_.Clear();
+      for (const PgNode &node : pg_nodes_)
+      {
+        node_index_.Insert(node.getNodeNumber(), node.getEstimatedPose().translation);
+      }
+      node_index_dirty_ = false;
+    }
+    return node_index_.CountWithin(loc, radius);
+  }
+
+  void SLAM::updateLastNodeVoxels()
+  {
+    last_node_voxels_.clear();
+    for (const Vector2f &point : recent_point_cloud_)
+    {
+      last_node_voxels_.insert(voxelKey(point, CONFIG_keyframe_voxel_size));
+    }
   }
 
   void SLAM::updatePoseGraph()
   {
+    if (CONFIG_runOnline)
+    {
+      initPoseGraph();
+    }
+
     if (first_scan)
     {
-      ROS_INFO_STREAM("[Create Node] Id=0");
+      // first scan of this session. When warm-started, it follows the nodes
+      // loaded from file.
       first_scan = false;
-      // first scan
 
       // Add prior instead of odom
       // We set global frame as (0, 0, 0).
       pose_2d::Pose2Df _pose(CONFIG_initial_node_global_theta, Vector2f(CONFIG_initial_node_global_x, CONFIG_initial_node_global_y));
       uint32_t node_number = pg_nodes_.size();
+      ROS_INFO_STREAM("[Create Node] Id=" << node_number);
       PgNode new_node(_pose, node_number, recent_point_cloud_);
 
       if (CONFIG_runOnline)
       {
-        Pose2 init_pos(CONFIG_initial_node_global_x, CONFIG_initial_node_global_y, CONFIG_initial_node_global_theta);
-        noiseModel::Diagonal::shared_ptr init_noise =
-            noiseModel::Diagonal::Sigmas(Vector3(CONFIG_new_node_x_std,
-                                                 CONFIG_new_node_y_std,
-                                                 CONFIG_new_node_theta_std));
-        graph_->add(PriorFactor<Pose2>(new_node.getNodeNumber(), init_pos, init_noise));
+        addFrozenNodePriors();
+        addInitialNodePrior(new_node.getNodeNumber());
       }
 
       // odom_only_estimates_.emplace_back(std::make_pair(prev_odom_loc_, prev_odom_angle_));
@@ -206,14 +615,19 @@ namespace slam
 
       // TODO: add a node without observation constraints
       pg_nodes_.push_back(new_node);
+      updateMemoryAccounts();
 
       if (CONFIG_runOnline)
       {
 
         gtsam::Values init_estimate_for_new_node;
-        init_estimate_for_new_node.insert(new_node.getNodeNumber(), Pose2(new_node.getEstimatedPose().translation.x(),
-                                                                          new_node.getEstimatedPose().translation.y(),
-                                                                          new_node.getEstimatedPose().angle));
+        // includes the nodes loaded from file, if any
+        for (const PgNode &node : pg_nodes_)
+        {
+          init_estimate_for_new_node.insert(node.getNodeNumber(), Pose2(node.getEstimatedPose().translation.x(),
+                                                                        node.getEstimatedPose().translation.y(),
+                                                                        node.getEstimatedPose().angle));
+        }
         optimizePoseGraph(init_estimate_for_new_node);
       }
     }
@@ -249,6 +663,7 @@ namespace slam
       }
 
       pg_nodes_.push_back(new_node);
+      updateMemoryAccounts();
 
       if (CONFIG_runOnline)
       {
@@ -260,6 +675,11 @@ namespace slam
       }
     }
 
+    if (CONFIG_adaptive_keyframes)
+    {
+      updateLastNodeVoxels();
+    }
+
     if (CONFIG_runOnline)
     {
       // if offline, the edges and nodes will be added only in the end
@@ -277,6 +697,12 @@ namespace slam
     noiseModel::Gaussian::shared_ptr factor_noise = noiseModel::Gaussian::Covariance(constraint_info.second.cast<double>());
     //        ROS_INFO_STREAM("Adding constraint from node " << from_node_num << " to node " << to_node_num <<" factor " << factor_transl.x() << ", " << factor_transl.y() << ", " << factor_transl.theta());
     graph_->add(BetweenFactor<Pose2>(from_node_num, to_node_num, factor_translation, factor_noise));
+    ObservationConstraint constraint;
+    constraint.from_node = from_node_num;
+    constraint.to_node = to_node_num;
+    constraint.pose = constraint_info.first;
+    constraint.covariance = constraint_info.second;
+    constraints_.push_back(constraint);
   }
 
   void SLAM::ObserveOdometry(const Vector2f &odom_loc, const float odom_angle)
@@ -363,28 +789,78 @@ namespace slam
       int skip_count = 1;
       size_t start_num = 0;
       int num_added_factors = 0;
-      // for every non-successive scan
-      for (size_t i = start_num; i < (new_node.getNodeNumber() - 2); i += skip_count)
+
+      // Widen the search radius by the relative position uncertainty of
+      // the two nodes, so that loop closures are still attempted when the
+      // graph has drifted.
+      std::unordered_map<size_t, float> gate_margins;
+      if (CONFIG_loop_closure_gate_sigmas > 0)
       {
-        if (num_added_factors >= CONFIG_max_factors_per_node)
+        std::vector<size_t> gate_nodes;
+        for (size_t i = start_num; i < (new_node.getNodeNumber() - 2); i += skip_count)
         {
-          break;
+          float node_dist = (pg_nodes_[i].getEstimatedPose().translation -
+                             preceding_node.getEstimatedPose().translation)
+                                .norm();
+          if (node_dist > CONFIG_maximum_node_dis_scan_comparison &&
+              node_dist <= CONFIG_maximum_node_dis_scan_comparison + CONFIG_loop_closure_max_gate_margin)
+          {
+            gate_nodes.push_back(i);
+          }
         }
-
-        PgNode node = pg_nodes_[i];
-
-        float node_dist = (node.getEstimatedPose().translation -
+        std::vector<Eigen::Matrix2d> covariances;
+        // Nodes that are not in the optimized graph yet (e.g. when running
+        // offline) fall back to the plain distance test.
+        if (!gate_nodes.empty() &&
+            GetRelativePositionCovariances(gate_nodes, preceding_node.getNodeNumber(), &covariances))
+        {
+          for (size_t j = 0; j < gate_nodes.size(); ++j)
+          {
+            const double sigma = sqrt(covariances[j].trace());
+            gate_margins[gate_nodes[j]] = std::min<float>(
+                CONFIG_loop_closure_gate_sigmas * sigma, CONFIG_loop_closure_max_gate_margin);
+          }
+        }
+      }
+      // every non-successive scan within range
+      std::vector<size_t> candidates;
+      for (size_t i = start_num; i < (new_node.getNodeNumber() - 2); i += skip_count)
+      {
+        float node_dist = (pg_nodes_[i].getEstimatedPose().translation -
                            preceding_node.getEstimatedPose().translation)
                               .norm();
 
-        if (node_dist <= CONFIG_maximum_node_dis_scan_comparison)
+        float gate_margin = 0;
+        if (gate_margins.count(i) > 0)
+        {
+          gate_margin = gate_margins[i];
+        }
+
+        if (node_dist <= CONFIG_maximum_node_dis_scan_comparison + gate_margin)
         {
-          std::pair<pose_2d::Pose2Df, Eigen::Matrix3f> non_successive_scan_offset;
-          if (ScanMatch(node, preceding_node, non_successive_scan_offset))
+          candidates.push_back(i);
+        }
+      }
+      // Match as many candidates at once as factors are still missing, oldest
+      // first, so that the same ones are matched as one at a time.
+      size_t next_candidate = 0;
+      while (num_added_factors < CONFIG_max_factors_per_node && next_candidate < candidates.size())
+      {
+        const size_t batch_size = std::min<size_t>(
+            candidates.size() - next_candidate,
+            std::ceil(CONFIG_max_factors_per_node - num_added_factors));
+        const std::vector<size_t> batch(candidates.begin() + next_candidate,
+                                        candidates.begin() + next_candidate + batch_size);
+        next_candidate += batch_size;
+        std::vector<std::pair<pose_2d::Pose2Df, Eigen::Matrix3f>> non_successive_scan_offsets;
+        const std::vector<bool> converged = ScanMatchMany(batch, preceding_node, non_successive_scan_offsets);
+        for (size_t j = 0; j < batch.size(); ++j)
+        {
+          if (converged[j])
           {
             // build edge of observation constraint
-            addObservationConstraint(node.getNodeNumber(), preceding_node.getNodeNumber(),
-                                     non_successive_scan_offset);
+            addObservationConstraint(pg_nodes_[batch[j]].getNodeNumber(), preceding_node.getNodeNumber(),
+                                     non_successive_scan_offsets[j]);
             num_added_factors++;
           }
         }
@@ -394,16 +870,10 @@ namespace slam
 
   void SLAM::offlineOptimizePoseGraph()
   {
-    // make sure that this function will only be called once
-    static bool run_before = false;
-
-    if (run_before)
-    {
-      return;
-    }
     // TODO: We cannot run online and offline together right now.
     // Need to clear the graph and reconstruct the eddge constraints again and optimize it again.
     ROS_INFO_STREAM("Running Offline Optimization...");
+    const double t_start = GetMonotonicTime();
 
     // clear the graph
     delete graph_;
@@ -412,23 +882,89 @@ namespace slam
     graph_ = new NonlinearFactorGraph();
     isam_ = new ISAM2();
 
-    for (size_t i = 0; i < pg_nodes_.size(); i++)
+    // Nodes loaded from a previous session are already optimized; keep them
+    // fixed and skip matching them against each other.
+    addFrozenNodePriors();
+    // need to add prior factor for first node of this session
+    const size_t first_node = num_frozen_nodes_;
+    if (first_node < pg_nodes_.size())
     {
-      if (i == 0)
+      addInitialNodePrior(pg_nodes_[first_node].getNodeNumber());
+    }
+
+    // Constraints found online are found again below; those of a checkpoint
+    // are not.
+    vector<ObservationConstraint> checkpoint_constraints;
+    checkpoint_constraints.swap(constraints_);
+    if (offline_next_node_ > 0)
+    {
+      ROS_INFO_STREAM("[Offline Optim] Resuming at node " << offline_next_node_ << " with "
+                                                          << checkpoint_constraints.size() << " constraints");
+      for (const ObservationConstraint &constraint : checkpoint_constraints)
       {
-        // need to add prior factor for first node
-        Pose2 init_pos(CONFIG_initial_node_global_x, CONFIG_initial_node_global_y, CONFIG_initial_node_global_theta);
-        noiseModel::Diagonal::shared_ptr init_noise =
-            noiseModel::Diagonal::Sigmas(Vector3(CONFIG_new_node_x_std,
-                                                 CONFIG_new_node_y_std,
-                                                 CONFIG_new_node_theta_std));
-        graph_->add(PriorFactor<Pose2>(pg_nodes_[i].getNodeNumber(), init_pos, init_noise));
+        std::pair<pose_2d::Pose2Df, Eigen::Matrix3f> constraint_info(constraint.pose, constraint.covariance);
+        addObservationConstraint(constraint.from_node, constraint.to_node, constraint_info);
       }
-      else
+    }
+
+    const size_t start_node = std::max(first_node + 1, offline_next_node_);
+    {
+      std::lock_guard<std::mutex> lock(offline_mutex_);
+      offline_progress_.nodes_total = pg_nodes_.size() > first_node + 1 ? pg_nodes_.size() - first_node - 1 : 0;
+      offline_progress_.nodes_matched = start_node - std::min(start_node, first_node + 1);
+      offline_progress_.constraints = constraints_.size();
+    }
+
+    ISAM2 preview;
+    bool preview_ok = true;
+    size_t num_preview_factors = 0;
+    size_t num_preview_nodes = 0;
+    double t_last_preview = t_start;
+    double t_last_checkpoint = t_start;
+    for (size_t i = start_node; i < pg_nodes_.size(); i++)
+    {
+      if (offline_cancel_)
       {
-        updatePoseGraphObsConstraints(pg_nodes_[i]);
+        ROS_INFO_STREAM("[Offline Optim] Cancelled at node " << i);
+        if (!offline_checkpoint_file_.empty())
+        {
+          saveOfflineCheckpoint(offline_checkpoint_file_, i);
+        }
+        std::lock_guard<std::mutex> lock(offline_mutex_);
+        offline_progress_.running = false;
+        return;
+      }
+      updatePoseGraphObsConstraints(pg_nodes_[i]);
+
+      const double t_now = GetMonotonicTime();
+      {
+        std::lock_guard<std::mutex> lock(offline_mutex_);
+        OfflineProgress &progress = offline_progress_;
+        progress.nodes_matched++;
+        progress.scan_matches = num_scan_matches_;
+        progress.constraints = constraints_.size();
+        progress.elapsed = t_now - t_start;
+        // Later nodes have more nodes to be matched against, so this is
+        // optimistic.
+        progress.eta = progress.elapsed / (i + 1 - start_node) * (pg_nodes_.size() - i - 1);
+      }
+      if (preview_ok && CONFIG_offline_preview_interval > 0 &&
+          t_now - t_last_preview > CONFIG_offline_preview_interval)
+      {
+        preview_ok = updateOfflinePreview(i + 1, &preview, &num_preview_factors, &num_preview_nodes);
+        t_last_preview = GetMonotonicTime();
+      }
+      if (CONFIG_offline_checkpoint_interval > 0 && !offline_checkpoint_file_.empty() &&
+          t_now - t_last_checkpoint > CONFIG_offline_checkpoint_interval)
+      {
+        saveOfflineCheckpoint(offline_checkpoint_file_, i + 1);
+        t_last_checkpoint = GetMonotonicTime();
       }
     }
+    if (!offline_checkpoint_file_.empty())
+    {
+      saveOfflineCheckpoint(offline_checkpoint_file_, pg_nodes_.size());
+    }
 
     ROS_INFO_STREAM("[Offline Optim] Num edges " << graph_->size());
     ROS_INFO_STREAM("[Offline Optim] Num nodes " << graph_->keys().size());
@@ -442,10 +978,13 @@ namespace slam
                                                                         pg_node.getEstimatedPose().angle));
     }
 
-    // isam calculation
+    // isam calculation, of the whole graph at once as the intermediate
+    // estimates are only previews.
     isam_->update(*graph_, init_estimate_for_all_nodes);
+    marginal_cache_.clear();
     Values result = isam_->calculateEstimate();
 
+    std::lock_guard<std::mutex> lock(offline_mutex_);
     // update each node in the graph using the optimized values
     for (PgNode &pg_node : pg_nodes_)
     {
@@ -454,14 +993,213 @@ namespace slam
       Pose2 estimated_pose = result.at<Pose2>(pg_node.getNodeNumber());
       pg_node.setPose(Vector2f(estimated_pose.x(), estimated_pose.y()), estimated_pose.theta());
     }
-    ROS_INFO_STREAM("[Offline Optim] Done");
-    run_before = true;
+    node_index_dirty_ = true;
+    offline_preview_poses_.clear();
+    offline_progress_.running = false;
+    offline_progress_.done = true;
+    offline_progress_.elapsed = GetMonotonicTime() - t_start;
+    offline_progress_.eta = 0;
+    ROS_INFO_STREAM("[Offline Optim] Done in " << offline_progress_.elapsed << "s");
+  }
+
+  bool SLAM::updateOfflinePreview(size_t num_nodes, ISAM2 *preview,
+                                  size_t *num_preview_factors,
+                                  size_t *num_preview_nodes)
+  {
+    NonlinearFactorGraph new_factors;
+    for (size_t i = *num_preview_factors; i < graph_->size(); i++)
+    {
+      new_factors.push_back(graph_->at(i));
+    }
+    // Initialize the new nodes from the latest estimate of the node before
+    // them and their relative pose from the front end.
+    Values estimate;
+    if (*num_preview_nodes > 0)
+    {
+      estimate = preview->calculateEstimate();
+    }
+    gtsam::Values new_nodes;
+    for (size_t i = *num_preview_nodes; i < num_nodes; i++)
+    {
+      Pose2 pose;
+      if (i < num_frozen_nodes_ || i == 0)
+      {
+        const pose_2d::Pose2Df &node_pose = pg_nodes_[i].getEstimatedPose();
+        pose = Pose2(node_pose.translation.x(), node_pose.translation.y(), node_pose.angle);
+      }
+      else
+      {
+        const pose_2d::Pose2Df rel = transformPoseFromMap2Target(pg_nodes_[i].getEstimatedPose(),
+                                                                 pg_nodes_[i - 1].getEstimatedPose());
+        const Pose2 &previous = (i == *num_preview_nodes) ? estimate.at<Pose2>(i - 1) : new_nodes.at<Pose2>(i - 1);
+        pose = previous.compose(Pose2(rel.translation.x(), rel.translation.y(), rel.angle));
+      }
+      new_nodes.insert(i, pose);
+    }
+    try
+    {
+      preview->update(new_factors, new_nodes);
+      estimate = preview->calculateEstimate();
+    }
+    catch (const std::exception &e)
+    {
+      ROS_ERROR_STREAM("[Offline Optim] No more intermediate estimates: " << e.what());
+      std::lock_guard<std::mutex> lock(offline_mutex_);
+      offline_preview_poses_.clear();
+      return false;
+    }
+    *num_preview_factors = graph_->size();
+    *num_preview_nodes = num_nodes;
+
+    // Nodes that are not matched yet follow the last previewed one.
+    vector<pose_2d::Pose2Df> poses(pg_nodes_.size());
+    for (size_t i = 0; i < pg_nodes_.size(); i++)
+    {
+      if (i < num_nodes)
+      {
+        const Pose2 &pose = estimate.at<Pose2>(i);
+        poses[i] = pose_2d::Pose2Df(pose.theta(), Vector2f(pose.x(), pose.y()));
+      }
+      else
+      {
+        const pose_2d::Pose2Df rel = transformPoseFromMap2Target(pg_nodes_[i].getEstimatedPose(),
+                                                                 pg_nodes_[i - 1].getEstimatedPose());
+        poses[i] = transformPoseFromSrc2Map(rel, poses[i - 1]);
+      }
+    }
+    std::lock_guard<std::mutex> lock(offline_mutex_);
+    offline_preview_poses_.swap(poses);
+    return true;
+  }
+
+  pose_2d::Pose2Df SLAM::displayPose(size_t i) const
+  {
+    if (i < offline_preview_poses_.size())
+    {
+      return offline_preview_poses_[i];
+    }
+    return pg_nodes_[i].getEstimatedPose();
+  }
+
+  bool SLAM::saveOfflineCheckpoint(const string &file, size_t next_node) const
+  {
+    const string tmp_file = file + ".tmp";
+    FILE *fid = fopen(tmp_file.c_str(), "wb");
+    if (fid == NULL)
+    {
+      ROS_ERROR_STREAM("Failed to write offline checkpoint to " << tmp_file);
+      return false;
+    }
+    const uint64_t header[3] = {num_frozen_nodes_, next_node, constraints_.size()};
+    bool ok = fwrite(kOfflineCheckpointMagic, sizeof(kOfflineCheckpointMagic), 1, fid) == 1 &&
+              writeNodes(fid, pg_nodes_) &&
+              fwrite(header, sizeof(header), 1, fid) == 1;
+    for (size_t i = 0; ok && i < constraints_.size(); i++)
+    {
+      const ObservationConstraint &constraint = constraints_[i];
+      const uint64_t nodes[2] = {constraint.from_node, constraint.to_node};
+      const float pose[3] = {constraint.pose.translation.x(), constraint.pose.translation.y(), constraint.pose.angle};
+      const Eigen::Matrix<float, 3, 3, Eigen::RowMajor> covariance = constraint.covariance;
+      ok = fwrite(nodes, sizeof(nodes), 1, fid) == 1 &&
+           fwrite(pose, sizeof(pose), 1, fid) == 1 &&
+           fwrite(covariance.data(), sizeof(float), 9, fid) == 9;
+    }
+    ok = (fclose(fid) == 0) && ok && rename(tmp_file.c_str(), file.c_str()) == 0;
+    if (!ok)
+    {
+      ROS_ERROR_STREAM("Failed to write offline checkpoint to " << file);
+    }
+    return ok;
   }
+
+  bool SLAM::LoadOfflineCheckpoint(const string &file)
+  {
+    if (!first_scan || !pg_nodes_.empty())
+    {
+      ROS_ERROR_STREAM("A checkpoint can only be loaded before the first scan");
+      return false;
+    }
+    ScopedFile fid(file, "rb", true);
+    if (fid() == NULL)
+    {
+      return false;
+    }
+    char magic[sizeof(kOfflineCheckpointMagic)];
+    if (fread(magic, sizeof(magic), 1, fid) != 1 ||
+        !std::equal(magic, magic + sizeof(magic), kOfflineCheckpointMagic))
+    {
+      ROS_ERROR_STREAM(file << " is not an offline checkpoint file");
+      return false;
+    }
+    vector<PgNode> nodes;
+    uint64_t header[3];
+    if (!readNodes(fid, &nodes) || fread(header, sizeof(header), 1, fid) != 1 ||
+        header[0] > nodes.size() || header[1] > nodes.size())
+    {
+      ROS_ERROR_STREAM("Truncated offline checkpoint file " << file);
+      return false;
+    }
+    vector<ObservationConstraint> constraints(header[2]);
+    for (ObservationConstraint &constraint : constraints)
+    {
+      uint64_t node_numbers[2];
+      float pose[3];
+      Eigen::Matrix<float, 3, 3, Eigen::RowMajor> covariance;
+      if (fread(node_numbers, sizeof(node_numbers), 1, fid) != 1 ||
+          fread(pose, sizeof(pose), 1, fid) != 1 ||
+          fread(covariance.data(), sizeof(float), 9, fid) != 9 ||
+          node_numbers[0] >= nodes.size() || node_numbers[1] >= nodes.size())
+      {
+        ROS_ERROR_STREAM("Truncated offline checkpoint file " << file);
+        return false;
+      }
+      constraint.from_node = node_numbers[0];
+      constraint.to_node = node_numbers[1];
+      constraint.pose = pose_2d::Pose2Df(pose[2], Vector2f(pose[0], pose[1]));
+      constraint.covariance = covariance;
+    }
+    pg_nodes_.swap(nodes);
+    updateMemoryAccounts();
+    node_index_dirty_ = true;
+    constraints_.swap(constraints);
+    num_frozen_nodes_ = header[0];
+    offline_next_node_ = header[1];
+    keyframe_index_.Clear();
+    for (const PgNode &node : pg_nodes_)
+    {
+      keyframe_index_.Insert(node.getNodeNumber(), node.getEstimatedPose().translation);
+    }
+    // The front end is done; only the offline optimization is left.
+    first_scan = false;
+    stopSlamCmdRecv_ = true;
+    return true;
+  }
+
+  void SLAM::SetOfflineCheckpointFile(const string &file)
+  {
+    offline_checkpoint_file_ = file;
+  }
+
+  OfflineProgress SLAM::GetOfflineProgress() const
+  {
+    std::lock_guard<std::mutex> lock(offline_mutex_);
+    return offline_progress_;
+  }
+
+  void SLAM::WaitForOfflineOptimization()
+  {
+    if (offline_thread_.joinable())
+    {
+      offline_thread_.join();
+    }
+  }
+
   void SLAM::optimizePoseGraph(gtsam::Values &new_node_init_estimates)
   {
     // Optimize the trajectory and update the nodes' position estimates
     // TODO do we need other params here?
     isam_->update(*graph_, new_node_init_estimates);
+    marginal_cache_.clear();
     Values result = isam_->calculateEstimate();
 
     // update each node int the graph using the optimized values
@@ -472,23 +1210,165 @@ namespace slam
       Pose2 estimated_pose = result.at<Pose2>(pg_node.getNodeNumber());
       pg_node.setPose(Vector2f(estimated_pose.x(), estimated_pose.y()), estimated_pose.theta());
     }
+    node_index_dirty_ = true;
+  }
+
+  bool SLAM::GetMarginalCovariances(const std::vector<size_t> &node_numbers,
+                                    std::vector<Eigen::Matrix3d> *covariances)
+  {
+    if (isam_ == nullptr)
+    {
+      return false;
+    }
+    const Values &estimates = isam_->getLinearizationPoint();
+    // Group the nodes that are not cached yet by the clique that contains
+    // them. A clique's marginal is shared by all its frontal variables, so
+    // each group is handled by a single thread.
+    std::map<const ISAM2Clique *, std::vector<size_t>> clique_groups;
+    for (const size_t node_number : node_numbers)
+    {
+      if (!estimates.exists(node_number))
+      {
+        return false;
+      }
+      if (marginal_cache_.count(node_number) == 0)
+      {
+        clique_groups[isam_->clique(node_number).get()].push_back(node_number);
+      }
+    }
+
+    if (!clique_groups.empty())
+    {
+      std::vector<std::vector<size_t>> groups;
+      groups.reserve(clique_groups.size());
+      std::vector<size_t> group_nodes;
+      for (const auto &clique_group : clique_groups)
+      {
+        groups.push_back(clique_group.second);
+        group_nodes.push_back(clique_group.second.front());
+      }
+      // The workers below then only read the caches.
+      fillSeparatorMarginals(group_nodes);
+
+      std::vector<std::vector<Eigen::Matrix3d>> group_covariances(groups.size());
+      parallelFor(groups.size(), [&](size_t i) {
+        for (const size_t node_number : groups[i])
+        {
+          group_covariances[i].push_back(Eigen::Matrix3d(isam_->marginalCovariance(node_number)));
+        }
+      });
+
+      for (size_t i = 0; i < groups.size(); ++i)
+      {
+        for (size_t j = 0; j < groups[i].size(); ++j)
+        {
+          marginal_cache_[groups[i][j]] = group_covariances[i][j];
+        }
+      }
+    }
+
+    covariances->resize(node_numbers.size());
+    for (size_t i = 0; i < node_numbers.size(); ++i)
+    {
+      (*covariances)[i] = marginal_cache_[node_numbers[i]];
+    }
+    return true;
+  }
+
+  bool SLAM::GetRelativePositionCovariances(const std::vector<size_t> &node_numbers,
+                                            size_t reference_node,
+                                            std::vector<Eigen::Matrix2d> *covariances)
+  {
+    if (isam_ == nullptr)
+    {
+      return false;
+    }
+    const Values &estimates = isam_->getLinearizationPoint();
+    std::vector<size_t> all_nodes = node_numbers;
+    all_nodes.push_back(reference_node);
+    for (const size_t node_number : all_nodes)
+    {
+      if (!estimates.exists(node_number))
+      {
+        return false;
+      }
+    }
+    // The joints below then only read the caches.
+    fillSeparatorMarginals(all_nodes);
+
+    const GaussianFactorGraph::Eliminate eliminate = isam_->params().getEliminationFunction();
+    const double reference_angle = estimates.at<Pose2>(reference_node).theta();
+    covariances->resize(node_numbers.size());
+    parallelFor(node_numbers.size(), [&](size_t i) {
+      const GaussianFactorGraph::shared_ptr joint =
+          isam_->joint(node_numbers[i], reference_node, eliminate);
+      Ordering ordering;
+      ordering.push_back(node_numbers[i]);
+      ordering.push_back(reference_node);
+      const Matrix joint_covariance = joint->hessian(ordering).first.inverse();
+      // The pose covariances are in the body frames: map the position
+      // difference of the two nodes to the map frame.
+      Eigen::Matrix<double, 2, 6> jacobian = Eigen::Matrix<double, 2, 6>::Zero();
+      jacobian.block<2, 2>(0, 0) = Eigen::Rotation2Dd(estimates.at<Pose2>(node_numbers[i]).theta()).toRotationMatrix();
+      jacobian.block<2, 2>(0, 3) = -Eigen::Rotation2Dd(reference_angle).toRotationMatrix();
+      (*covariances)[i] = jacobian * joint_covariance * jacobian.transpose();
+    });
+    return true;
+  }
+
+  void SLAM::fillSeparatorMarginals(const std::vector<size_t> &node_numbers)
+  {
+    // Each clique needs the separator marginal of its parent. Collect the
+    // cliques of the nodes and all their ancestors by depth, and fill one
+    // level at a time from the root: the cliques of a level only read their
+    // parents' caches, so they can be filled in parallel.
+    std::map<const ISAM2Clique *, size_t> depths;
+    std::vector<std::vector<ISAM2::sharedClique>> levels;
+    for (const size_t node_number : node_numbers)
+    {
+      std::vector<ISAM2::sharedClique> path;
+      ISAM2::sharedClique clique = isam_->clique(node_number);
+      while (clique && depths.count(clique.get()) == 0)
+      {
+        path.push_back(clique);
+        clique = clique->parent();
+      }
+      const size_t base_depth = clique ? depths[clique.get()] + 1 : 0;
+      for (size_t k = 0; k < path.size(); ++k)
+      {
+        const size_t depth = base_depth + path.size() - 1 - k;
+        depths[path[k].get()] = depth;
+        if (levels.size() <= depth)
+        {
+          levels.resize(depth + 1);
+        }
+        levels[depth].push_back(path[k]);
+      }
+    }
+    const GaussianFactorGraph::Eliminate eliminate = isam_->params().getEliminationFunction();
+    for (const std::vector<ISAM2::sharedClique> &level : levels)
+    {
+      parallelFor(level.size(), [&](size_t i) {
+        level[i]->separatorMarginal(eliminate);
+      });
+    }
   }
 
   vector<Eigen::Vector2f> SLAM::GetMap()
   {
     vector<Eigen::Vector2f> map;
+    std::lock_guard<std::mutex> lock(offline_mutex_);
+    size_t num_points = 0;
+    for (const PgNode &node : pg_nodes_)
+    {
+      num_points += node.getPointCloud().size();
+    }
+    map.reserve(num_points);
     // Reconstruct the map as a single aligned point cloud from all saved poses
     // and their respective scans.
     for (size_t i = 0; i < pg_nodes_.size(); i++)
     {
-      PgNode node = pg_nodes_[i];
-      std::vector<Eigen::Vector2f> point_cloud = node.getPointCloud();
-
-      pose_2d::Pose2Df node_pose = node.getEstimatedPose();
-      for (Eigen::Vector2f point : point_cloud)
-      {
-        map.push_back(transformPoseFromSrc2Map(pose_2d::Pose2Df(0, point), node_pose).translation);
-      }
+      pose_2d::AppendTransformedPointCloud(displayPose(i), pg_nodes_[i].getPointCloud(), &map);
     }
     return map;
   }
@@ -498,35 +1378,17 @@ namespace slam
   // Get M(i, global) = M(i, i-1) * M(i-1, global)
   pose_2d::Pose2Df SLAM::transformPoseFromSrc2Map(const pose_2d::Pose2Df &pose_rel_src_frame, const pose_2d::Pose2Df &src_frame_pose_rel_map_frame)
   {
-    // Rotate the point first
-    Eigen::Rotation2Df rotation_mat(src_frame_pose_rel_map_frame.angle);
-    Eigen::Vector2f rotated_still_src_transl = rotation_mat * pose_rel_src_frame.translation;
-
-    // Then translate
-    Eigen::Vector2f rotated_and_translated = src_frame_pose_rel_map_frame.translation + rotated_still_src_transl;
-    float target_angle = AngleMod(src_frame_pose_rel_map_frame.angle + pose_rel_src_frame.angle);
-
-    return pose_2d::Pose2Df(target_angle, rotated_and_translated);
+    return pose_2d::Compose(src_frame_pose_rel_map_frame, pose_rel_src_frame);
   }
 
   // trasfrom a 2D pose from map frame to target frame
   // Get M(i, i-1) = M(i, global) * M(i-1, global)^-1
   pose_2d::Pose2Df SLAM::transformPoseFromMap2Target(const pose_2d::Pose2Df &pose_rel_map_frame, const pose_2d::Pose2Df &target_frame_pose_rel_map_frame)
   {
-    // Translate the point
-    Eigen::Vector2f trans = pose_rel_map_frame.translation - target_frame_pose_rel_map_frame.translation;
-
-    // Then rotate
-    Eigen::Rotation2Df rot_mat(-target_frame_pose_rel_map_frame.angle);
-    Eigen::Vector2f final_trans = rot_mat * trans;
-
-    float final_angle = AngleMod(pose_rel_map_frame.angle - target_frame_pose_rel_map_frame.angle);
-
-    return pose_2d::Pose2Df(final_angle, final_trans);
+    return pose_2d::Relative(pose_rel_map_frame, target_frame_pose_rel_map_frame);
   }
 
-  bool SLAM::ScanMatch(PgNode &base_node, PgNode &match_node,
-                       pair<pose_2d::Pose2Df, Eigen::Matrix3f> &result)
+  Trans SLAM::scanMatchOdometry(const PgNode &base_node, const PgNode &match_node)
   {
     // Calculate initial guess of the relative pose from odometry.
     ROS_INFO_STREAM("[ScanMatch] nodes: (" <<
@@ -535,11 +1397,16 @@ namespace slam
     const pose_2d::Pose2Df &match_pose = match_node.getEstimatedPose();
     pose_2d::Pose2Df odom_match_rel_base = transformPoseFromMap2Target(
       match_pose, base_pose);
-    const Trans odom(
-        odom_match_rel_base.translation,
-        odom_match_rel_base.angle);
+    return Trans(odom_match_rel_base.translation, odom_match_rel_base.angle);
+  }
+
+  bool SLAM::ScanMatch(PgNode &base_node, PgNode &match_node,
+                       pair<pose_2d::Pose2Df, Eigen::Matrix3f> &result)
+  {
+    const Trans odom = scanMatchOdometry(base_node, match_node);
 
     // Run the scan matcher to get the relative pose and uncertainty.
+    num_scan_matches_++;
     pair<Trans, Eigen::Matrix3f> transform;
     bool converged = matcher.GetTransform(
       match_node.getPointCloud(), base_node.getPointCloud(), odom, transform);
@@ -547,6 +1414,43 @@ namespace slam
     if (!converged)
       return false;
 
+    scanMatchResult(odom, transform, result);
+    // csm converged, return true
+    return true;
+  }
+
+  std::vector<bool> SLAM::ScanMatchMany(
+      const std::vector<size_t> &base_node_numbers, PgNode &match_node,
+      std::vector<pair<pose_2d::Pose2Df, Eigen::Matrix3f>> &results)
+  {
+    std::vector<const std::vector<Vector2f> *> base_clouds(base_node_numbers.size());
+    std::vector<Trans> odoms(base_node_numbers.size());
+    for (size_t i = 0; i < base_node_numbers.size(); ++i)
+    {
+      const PgNode &base_node = pg_nodes_[base_node_numbers[i]];
+      odoms[i] = scanMatchOdometry(base_node, match_node);
+      base_clouds[i] = &base_node.getPointCloud();
+    }
+
+    num_scan_matches_ += base_node_numbers.size();
+    std::vector<pair<Trans, Eigen::Matrix3f>> transforms;
+    const std::vector<bool> converged = matcher.GetTransforms(
+      match_node.getPointCloud(), base_clouds, odoms, &transforms);
+    results.resize(base_node_numbers.size());
+    for (size_t i = 0; i < base_node_numbers.size(); ++i)
+    {
+      if (converged[i])
+      {
+        scanMatchResult(odoms[i], transforms[i], results[i]);
+      }
+    }
+    return converged;
+  }
+
+  void SLAM::scanMatchResult(const Trans &odom,
+                             const pair<Trans, Eigen::Matrix3f> &transform,
+                             pair<pose_2d::Pose2Df, Eigen::Matrix3f> &result)
+  {
     result.first = pose_2d::Pose2Df(
       transform.first.second, transform.first.first);
     result.second = transform.second;
@@ -554,7 +1458,7 @@ namespace slam
     // --- Debugging: use odom as mean --------------------------------
     if (CONFIG_fix_mean)
     {
-      result.first = odom_match_rel_base;
+      result.first = pose_2d::Pose2Df(odom.second, odom.first);
     }
 
     // --- Debugging: use fix diagonal covariances --------------------
@@ -564,17 +1468,173 @@ namespace slam
           0, 1.0, 0,
           0, 0, 1.0;
     }
-
-    // csm converged, return true
-    return true;
   }
 
   void SLAM::stop_frontend()
   {
     stopSlamCmdRecv_ = true;
+    if (CONFIG_localization_only)
+    {
+      // The map is fixed, nothing to optimize.
+      return;
+    }
+    if (offline_thread_.joinable() || GetOfflineProgress().done)
+    {
+      // Already started.
+      return;
+    }
     ROS_INFO_STREAM(
       "runOnline=" << CONFIG_runOnline << ", runOffline=" << CONFIG_runOffline);
-    offlineOptimizePoseGraph();
+    {
+      std::lock_guard<std::mutex> lock(offline_mutex_);
+      offline_progress_.running = true;
+    }
+    offline_cancel_ = false;
+    offline_thread_ = std::thread(&SLAM::offlineOptimizePoseGraph, this);
+  }
+
+  const CostTable &SLAM::getKeyframeCostTable(size_t node_number)
+  {
+    auto it = cost_table_cache_.find(node_number);
+    cost_table_cache_order_.erase(std::remove(cost_table_cache_order_.begin(), cost_table_cache_order_.end(), node_number),
+                                  cost_table_cache_order_.end());
+    cost_table_cache_order_.push_back(node_number);
+    if (it != cost_table_cache_.end())
+    {
+      return it->second;
+    }
+    // A table covers its keyframe scan, which can be the full scanner range, so only keep a few of them.
+    while (cost_table_cache_order_.size() > static_cast<size_t>(std::max(1, CONFIG_localization_cost_table_cache_size)))
+    {
+      cost_table_cache_.erase(cost_table_cache_order_.front());
+      cost_table_cache_order_.pop_front();
+    }
+    CostTable &table = cost_table_cache_[node_number];
+    table = matcher.CostTableFromPointCloud(pg_nodes_[node_number].getPointCloud());
+    updateMemoryAccounts();
+    return table;
+  }
+
+  void SLAM::updateMemoryAccounts()
+  {
+    int64_t node_cloud_bytes = 0;
+    for (const PgNode &node : pg_nodes_)
+    {
+      node_cloud_bytes += memory_accounting::HeapBytes(node.getPointCloud());
+    }
+    node_cloud_memory_.Set(node_cloud_bytes);
+    int64_t cost_table_bytes = 0;
+    for (const auto &entry : cost_table_cache_)
+    {
+      cost_table_bytes += entry.second.values.size() * sizeof(double);
+    }
+    cost_table_memory_.Set(cost_table_bytes);
+  }
+
+  void SLAM::localizeScan()
+  {
+    if (num_frozen_nodes_ == 0)
+    {
+      ROS_ERROR_STREAM_THROTTLE(5.0, "localization_only requires a map loaded with --pose_graph_file");
+      return;
+    }
+    const bool initialized = !localization_window_.empty();
+
+    LocalizationFrame frame;
+    frame.key = next_localization_key_;
+    frame.odom_pose.Set(prev_odom_angle_, prev_odom_loc_);
+    GetPose(&frame.estimate.translation, &frame.estimate.angle);
+
+    std::vector<size_t> keyframes;
+    keyframe_index_.Nearest(frame.estimate.translation,
+                            initialized ? CONFIG_localization_num_keyframes : 1,
+                            CONFIG_localization_max_keyframe_dist,
+                            &keyframes);
+    // The initial pose is only a rough guess, so search the whole CSM window
+    // once. The rotation window is centered on the guess so that the mean
+    // angle is not split across the 0 / 2pi wrap around.
+    const double trans_window = initialized ? CONFIG_localization_trans_window : trans_range;
+    const double rotation_window = initialized ? CONFIG_localization_rot_window : M_PI - EPSILON;
+    for (const size_t keyframe : keyframes)
+    {
+      const pose_2d::Pose2Df keyframe_pose = pg_nodes_[keyframe].getEstimatedPose();
+      const pose_2d::Pose2Df rel_pose = transformPoseFromMap2Target(frame.estimate, keyframe_pose);
+      pair<Trans, Eigen::Matrix3f> transform;
+      if (!matcher.GetTransform(recent_point_cloud_, getKeyframeCostTable(keyframe),
+                                Trans(rel_pose.translation, rel_pose.angle),
+                                trans_window, rotation_window, transform))
+      {
+        continue;
+      }
+      const pose_2d::Pose2Df measured_pose = transformPoseFromSrc2Map(
+          pose_2d::Pose2Df(transform.first.second, transform.first.first), keyframe_pose);
+      // CSM gives the covariance in the keyframe frame, but the prior below
+      // measures its error in the body frame of measured_pose, which is
+      // rotated by the matched angle from it. Also don't let it collapse below
+      // the search resolution.
+      Eigen::Matrix3d covariance = pose_2d::RotateCovariance(transform.second.cast<double>(), -transform.first.second);
+      covariance += Eigen::Vector3d(Sq(resolution), Sq(resolution), Sq(M_PI / 180.0)).asDiagonal();
+      frame.measurements.push_back(std::make_pair(measured_pose, covariance));
+    }
+
+    if (!initialized && frame.measurements.empty())
+    {
+      ROS_WARN_STREAM_THROTTLE(5.0, "[Localization] Could not match the first scan near the initial pose");
+      return;
+    }
+    next_localization_key_++;
+    localization_window_.push_back(frame);
+    while (localization_window_.size() > static_cast<size_t>(std::max(1, CONFIG_localization_window_size)))
+    {
+      localization_window_.pop_front();
+    }
+    optimizeLocalizationWindow();
+  }
+
+  void SLAM::optimizeLocalizationWindow()
+  {
+    NonlinearFactorGraph graph;
+    Values initial_estimate;
+    noiseModel::Diagonal::shared_ptr anchor_noise =
+        noiseModel::Diagonal::Sigmas(Vector3(CONFIG_localization_anchor_xy_std,
+                                             CONFIG_localization_anchor_xy_std,
+                                             CONFIG_localization_anchor_theta_std));
+    for (size_t i = 0; i < localization_window_.size(); i++)
+    {
+      const LocalizationFrame &frame = localization_window_[i];
+      initial_estimate.insert(frame.key, toPose2(frame.estimate));
+      if (i == 0)
+      {
+        // Stands in for the poses that have left the window.
+        graph.add(PriorFactor<Pose2>(frame.key, toPose2(frame.estimate), anchor_noise));
+      }
+      else
+      {
+        const LocalizationFrame &prev_frame = localization_window_[i - 1];
+        const pose_2d::Pose2Df odom_rel = transformPoseFromMap2Target(frame.odom_pose, prev_frame.odom_pose);
+        const float trans = odom_rel.translation.norm();
+        const float rot = std::fabs(odom_rel.angle);
+        const float trans_std = CONFIG_motion_model_trans_err_from_trans * trans +
+                                CONFIG_motion_model_trans_err_from_rot * rot + resolution;
+        const float rot_std = CONFIG_motion_model_rot_err_from_trans * trans +
+                              CONFIG_motion_model_rot_err_from_rot * rot + M_PI / 180.0;
+        graph.add(BetweenFactor<Pose2>(prev_frame.key, frame.key, toPose2(odom_rel),
+                                       noiseModel::Diagonal::Sigmas(Vector3(trans_std, trans_std, rot_std))));
+      }
+      for (const auto &measurement : frame.measurements)
+      {
+        graph.add(PriorFactor<Pose2>(frame.key, toPose2(measurement.first),
+                                     noiseModel::Gaussian::Covariance(measurement.second)));
+      }
+    }
+
+    LevenbergMarquardtOptimizer optimizer(graph, initial_estimate);
+    const Values result = optimizer.optimize();
+    for (LocalizationFrame &frame : localization_window_)
+    {
+      const Pose2 estimated_pose = result.at<Pose2>(frame.key);
+      frame.estimate.Set(estimated_pose.theta(), Vector2f(estimated_pose.x(), estimated_pose.y()));
+    }
   }
 
 } // namespace slam
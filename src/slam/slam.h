@@ -20,6 +20,13 @@
 //========================================================================
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <gtsam/slam/BetweenFactor.h>
@@ -36,7 +43,9 @@
 #include "shared/math/poses_2d.h"
 
 #include "shared/math/poses_2d.h"
+#include "shared/util/memory_accounting.h"
 #include "./CorrelativeScanMatcher.h"
+#include "./keyframe_index.h"
 
 #ifndef SRC_SLAM_H_
 #define SRC_SLAM_H_
@@ -44,12 +53,49 @@
 namespace slam
 {
 
+  // State of the offline pose graph optimization.
+  struct OfflineProgress
+  {
+    bool running;
+    bool done;
+    // Nodes whose scans are matched against the earlier nodes, in total and
+    // so far.
+    size_t nodes_total;
+    size_t nodes_matched;
+    // Scan matches run and constraints added so far.
+    size_t scan_matches;
+    size_t constraints;
+    // Seconds since the start, and estimated until all nodes are matched.
+    double elapsed;
+    double eta;
+  };
+
   class SLAM
   {
   public:
     // Default Constructor.
     SLAM();
 
+    ~SLAM();
+
+    /**
+     * Write all nodes (estimated pose and point cloud) to a binary pose graph
+     * file, e.g. to warm-start a later session with LoadPoseGraph().
+     *
+     * @return false if the file could not be written.
+     */
+    bool SavePoseGraph(const std::string &file) const;
+
+    /**
+     * Warm-start from a pose graph written by SavePoseGraph(). Must be called
+     * before the first scan. The loaded nodes are frozen at their saved
+     * poses: new nodes are matched against them, but they are not re-matched
+     * against each other.
+     *
+     * @return false if the file could not be read.
+     */
+    bool LoadPoseGraph(const std::string &file);
+
     // Observe a new laser scan.
     void ObserveLaser(const std::vector<float> &ranges,
                       float range_min,
@@ -61,7 +107,8 @@ namespace slam
     void ObserveOdometry(const Eigen::Vector2f &odom_loc,
                          const float odom_angle);
 
-    // Get latest map.
+    // Get latest map. While the offline optimization runs, this is the map
+    // of its latest intermediate estimate.
     std::vector<Eigen::Vector2f> GetMap();
 
     // Get latest robot pose.
@@ -85,10 +132,46 @@ namespace slam
                    pair<pose_2d::Pose2Df, Eigen::Matrix3f> &result);
 
     /**
-     * @return true if the robot has moved far enough.
+     * ScanMatch() of several base nodes against the same match node, in one
+     * call to the scan matcher, so that the scan of match_node is only
+     * rotated once for all of them.
+     *
+     * @param base_node_numbers[in] Numbers of the base nodes.
+     * @param match_node[in]        Match node.
+     * @param results[out]          ScanMatch() result for each base node.
+     * @return for each base node, true if csm was successful.
+     */
+    std::vector<bool> ScanMatchMany(
+        const std::vector<size_t> &base_node_numbers, PgNode &match_node,
+        std::vector<pair<pose_2d::Pose2Df, Eigen::Matrix3f>> &results);
+
+    /**
+     * @return true if the robot has moved far enough that the latest scan is
+     *         worth evaluating as a new node.
+     */
+    bool isKeyframeCandidate();
+
+    /**
+     * Decide whether the latest scan (recent_point_cloud_) becomes a new node.
+     * With adaptive_keyframes, a candidate is accepted when enough of its
+     * downsampled scan is novel w.r.t. the previous node and the area around
+     * the robot is not already saturated with nodes.
+     *
+     * @return true if a new node should be added.
      */
     bool shouldAddPgNode();
 
+    /**
+     * @return fraction in [0, 1] of the downsampled latest scan that is not
+     *         observed in the previous node's scan.
+     */
+    float computeScanNovelty();
+
+    /**
+     * @return number of nodes within radius of loc, from node_index_.
+     */
+    int countPgNodesNear(const Eigen::Vector2f &loc, float radius);
+
     /**
      * @brief update pose graph with latest scans.
      *  1. add node.
@@ -120,8 +203,63 @@ namespace slam
      */
     void optimizePoseGraph(gtsam::Values &new_node_init_estimates);
 
+    /**
+     * Match all nodes against each other and optimize the whole graph. Runs
+     * on the offline optimization thread started by stop_frontend(), which
+     * owns the graph and the nodes until it is done: every
+     * offline_preview_interval seconds it publishes an intermediate estimate
+     * for GetMap(), and every offline_checkpoint_interval seconds it saves the
+     * nodes and the constraints found so far to the checkpoint file, from
+     * which LoadOfflineCheckpoint() resumes.
+     */
     void offlineOptimizePoseGraph();
 
+    // Where the offline optimization saves its checkpoints; none if empty.
+    void SetOfflineCheckpointFile(const std::string &file);
+
+    /**
+     * Resume an offline optimization from a checkpoint. Must be called before
+     * the first scan; stop_frontend() then continues with the nodes that were
+     * not matched yet.
+     *
+     * @return false if the file could not be read.
+     */
+    bool LoadOfflineCheckpoint(const std::string &file);
+
+    OfflineProgress GetOfflineProgress() const;
+
+    // Block until the offline optimization, if started, is done.
+    void WaitForOfflineOptimization();
+
+    /**
+     * Recover the marginal covariances of the requested nodes from the
+     * iSAM2 Bayes tree. Only the requested nodes are marginalized; nodes in
+     * different cliques are processed in parallel, and results are cached
+     * until the next optimization.
+     *
+     * @param node_numbers[in]      Nodes to query.
+     * @param covariances[out]      Covariance of (x, y, theta) of each
+     *                              requested node, in the same order.
+     * @return false if any of the nodes is not in the optimized graph.
+     */
+    bool GetMarginalCovariances(const std::vector<size_t> &node_numbers,
+                                std::vector<Eigen::Matrix3d> *covariances);
+
+    /**
+     * Covariance of the position of each node relative to the reference
+     * node's, in the map frame, from the joint marginal of the two. Unlike
+     * the sum of their marginals, it accounts for their correlation.
+     *
+     * @param node_numbers[in]      Nodes to query.
+     * @param reference_node[in]    Node they are relative to.
+     * @param covariances[out]      Covariance of (x, y) of each requested
+     *                              node minus that of the reference node.
+     * @return false if any of the nodes is not in the optimized graph.
+     */
+    bool GetRelativePositionCovariances(const std::vector<size_t> &node_numbers,
+                                        size_t reference_node,
+                                        std::vector<Eigen::Matrix2d> *covariances);
+
     /**
      * Run CSM on the measurements of the two nodes to get the estimated position of node 2 in the frame of node 1.
      *
@@ -140,16 +278,105 @@ namespace slam
         float angle_min,
         float angle_max);
 
+    // Cache the downsampled voxels of recent_point_cloud_ as the reference for
+    // keyframe novelty.
+    void updateLastNodeVoxels();
+
     pose_2d::Pose2Df transformPoseFromSrc2Map(const pose_2d::Pose2Df &pose_rel_src_frame,
                                               const pose_2d::Pose2Df &src_frame_pose_rel_map_frame);
 
     pose_2d::Pose2Df transformPoseFromMap2Target(const pose_2d::Pose2Df &pose_rel_map_frame,
                                                  const pose_2d::Pose2Df &target_frame_pose_rel_map_frame);
 
-    // stop front end SLAM
+    // Stop front end SLAM, and start the offline optimization in the
+    // background. Returns immediately.
     void stop_frontend();
 
+    // === Localization-only Functions === //
+    /**
+     * Localize the latest scan (recent_point_cloud_) against the nearest
+     * keyframes loaded with LoadPoseGraph(), then re-optimize the sliding
+     * window of recent poses. The keyframes are never modified.
+     */
+    void localizeScan();
+
+    /**
+     * Optimize the poses in localization_window_ given the odometry between
+     * them and their keyframe matches.
+     */
+    void optimizeLocalizationWindow();
+
   private:
+    /**
+     * Fill the separator marginal caches of the cliques of the nodes and of
+     * their ancestors, in parallel where they are independent. gtsam fills
+     * them lazily without locking, so this has to be done before querying
+     * the Bayes tree from several threads.
+     */
+    void fillSeparatorMarginals(const std::vector<size_t> &node_numbers);
+
+    // Allocate graph_ and isam_ if they don't exist yet.
+    void initPoseGraph();
+
+    // Add priors holding the nodes loaded by LoadPoseGraph() in place.
+    void addFrozenNodePriors();
+
+    // Add the prior of the first node of this session.
+    void addInitialNodePrior(size_t node_number);
+
+    // Save the nodes, and the constraints found among the first next_node of
+    // them, for LoadOfflineCheckpoint(). Written to a temporary file that
+    // replaces file once complete, so a crash leaves the previous checkpoint.
+    bool saveOfflineCheckpoint(const std::string &file, size_t next_node) const;
+
+    // Publish the intermediate estimate of an offline optimization, once the
+    // first num_nodes nodes are matched, for GetMap(). preview holds the
+    // first num_preview_factors factors of graph_ and num_preview_nodes
+    // nodes, and is brought up to date incrementally. Returns false if it
+    // failed, after which preview is unusable.
+    bool updateOfflinePreview(size_t num_nodes, gtsam::ISAM2 *preview,
+                              size_t *num_preview_factors,
+                              size_t *num_preview_nodes);
+
+    // Estimated pose of node i as shown to the user, i.e. the intermediate
+    // estimate while the offline optimization runs. Call with
+    // offline_mutex_ held.
+    pose_2d::Pose2Df displayPose(size_t i) const;
+
+    // The odometry of match_node relative to base_node that ScanMatch()
+    // starts from.
+    Trans scanMatchOdometry(const PgNode &base_node, const PgNode &match_node);
+    // The ScanMatch() result for a transform from the scan matcher.
+    void scanMatchResult(const Trans &odom,
+                         const pair<Trans, Eigen::Matrix3f> &transform,
+                         pair<pose_2d::Pose2Df, Eigen::Matrix3f> &result);
+
+    void updateMemoryAccounts();
+
+    // Cost table of a keyframe, built on first use. Keeps the most recently
+    // used tables.
+    const CostTable &getKeyframeCostTable(size_t node_number);
+
+    // An observation constraint, recorded for the offline checkpoints.
+    struct ObservationConstraint
+    {
+      uint64_t from_node;
+      uint64_t to_node;
+      pose_2d::Pose2Df pose;
+      Eigen::Matrix3f covariance;
+    };
+
+    // A localized pose in the sliding window.
+    struct LocalizationFrame
+    {
+      gtsam::Key key;
+      // Odometry when the scan was localized.
+      pose_2d::Pose2Df odom_pose;
+      pose_2d::Pose2Df estimate;
+      // Map poses and covariances from matching the scan to keyframes.
+      std::vector<std::pair<pose_2d::Pose2Df, Eigen::Matrix3d>> measurements;
+    };
+
     // Previous odometry-reported locations.
     Eigen::Vector2f prev_odom_loc_;
     float prev_odom_angle_;
@@ -159,19 +386,75 @@ namespace slam
 
     bool first_scan;
 
+    // Occupied voxels of the previous node's scan, in that node's frame.
+    std::unordered_set<uint64_t> last_node_voxels_;
+
     pose_2d::Pose2Df last_node_odom_pose_;
 
     float last_node_cumulative_dist_;
 
+    // Whether a keyframe candidate was rejected since the last node, and the
+    // odometry then: the next candidate is only evaluated after moving on by
+    // another keyframe_min_trans_diff or keyframe_min_angle_diff.
+    bool keyframe_rejected_;
+    float rejected_cumulative_dist_;
+    float rejected_odom_angle_;
+
     gtsam::NonlinearFactorGraph *graph_;
 
     gtsam::ISAM2 *isam_;
 
     std::vector<PgNode> pg_nodes_;
 
+    // The first num_frozen_nodes_ of pg_nodes_ were loaded from file.
+    size_t num_frozen_nodes_;
+
+    // Marginal covariances computed since the last iSAM2 update.
+    std::unordered_map<size_t, Eigen::Matrix3d> marginal_cache_;
+
     CorrelativeScanMatcher matcher;
 
     bool stopSlamCmdRecv_;
+
+    // Frozen nodes, indexed by location.
+    KeyframeIndex keyframe_index_;
+
+    // All nodes at their estimated poses, for the keyframe density check.
+    // Rebuilt when it is used after the nodes or their poses changed.
+    KeyframeIndex node_index_;
+    bool node_index_dirty_;
+
+    std::unordered_map<size_t, CostTable> cost_table_cache_;
+    // Node numbers in cost_table_cache_, least recently used first.
+    std::deque<size_t> cost_table_cache_order_;
+
+    std::deque<LocalizationFrame> localization_window_;
+
+    gtsam::Key next_localization_key_;
+
+    // All observation constraints added to graph_.
+    std::vector<ObservationConstraint> constraints_;
+
+    // Offline optimization. Its thread owns graph_, isam_, constraints_ and
+    // pg_nodes_ while it runs, other threads only read the nodes; the poses
+    // it writes, the intermediate estimate and the progress are guarded by
+    // offline_mutex_.
+    std::thread offline_thread_;
+    mutable std::mutex offline_mutex_;
+    OfflineProgress offline_progress_;
+    std::vector<pose_2d::Pose2Df> offline_preview_poses_;
+    std::atomic<bool> offline_cancel_;
+    std::atomic<size_t> num_scan_matches_;
+    std::string offline_checkpoint_file_;
+    // Nodes before this one are already matched, from a checkpoint.
+    size_t offline_next_node_;
+
+    // Memory held by the scans of pg_nodes_ and by cost_table_cache_,
+    // recounted by updateMemoryAccounts() whenever they change. The factor
+    // graph and iSAM2 allocate internally, and show in the unaccounted part
+    // of the resident set size.
+    memory_accounting::MemoryAccount node_cloud_memory_;
+    memory_accounting::MemoryAccount cost_table_memory_;
   };
 } // namespace slam
 
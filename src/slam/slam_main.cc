@@ -46,12 +46,15 @@
 #include "config_reader/config_reader.h"
 #include "shared/math/math_util.h"
 #include "shared/math/line2d.h"
+#include "shared/util/memory_accounting.h"
+#include "shared/util/runtime_config.h"
 #include "shared/util/timer.h"
 
 #include "slam.h"
 #include "vector_map/vector_map.h"
 #include "visualization/visualization.h"
 #include <std_msgs/Empty.h>
+#include <std_msgs/String.h>
 
 using amrl_msgs::VisualizationMsg;
 using Eigen::Vector2f;
@@ -72,14 +75,37 @@ using visualization::DrawPoint;
 DEFINE_string(laser_topic, "/scan", "Name of ROS topic for LIDAR data");
 DEFINE_string(odom_topic, "/odom", "Name of ROS topic for odometry data");
 DEFINE_string(stop_slam_topic, "/stop_slam", "Name of ROS topic for stop slam");
+DEFINE_string(config_file, "config/slam.lua", "SLAM config file");
+DEFINE_string(pose_graph_file, "",
+              "Pose graph saved by a previous session to warm-start from");
+DEFINE_string(save_pose_graph_file, "",
+              "Save the optimized pose graph here when SLAM is stopped");
+DEFINE_string(offline_checkpoint_file, "offline_checkpoint.pgc",
+              "Checkpoint of the offline optimization, saved while it runs; "
+              "none if empty");
+DEFINE_bool(resume_offline_checkpoint, false,
+            "Resume the offline optimization saved in "
+            "--offline_checkpoint_file instead of running SLAM");
+DEFINE_bool(self_check, false,
+            "Run a small GTSAM optimization at startup to verify the install");
+DEFINE_double(memory_report_period, 0,
+              "Print the memory usage of the subsystems every this many "
+              "seconds, 0 to disable");
 
 DECLARE_int32(v);
 
+// Taken during static initialization, as close to process start as we get.
+const double t_process_start_ = GetMonotonicTime();
+
 bool run_ = true;
-slam::SLAM slam_;
+// Created in main() once the config has been loaded.
+slam::SLAM *slam_ = nullptr;
 ros::Publisher visualization_publisher_;
 ros::Publisher localization_publisher_;
 ros::Publisher stopSlamComplete_publisher_;
+ros::Publisher offline_progress_publisher_;
+// Set once SLAM was stopped; cleared once the offline optimization is done.
+bool stop_pending_ = false;
 VisualizationMsg vis_msg_;
 sensor_msgs::LaserScan last_laser_msg_;
 
@@ -87,7 +113,7 @@ void writeNodePose(const std::string &fn)
 {
   std::ofstream output_file(fn);
   output_file << "x,y,theta\n";
-  for (const auto &node : slam_.GetPgNodes()) {
+  for (const auto &node : slam_->GetPgNodes()) {
     pose_2d::Pose2Df pose = node.getEstimatedPose();
     output_file << pose.translation.x() << "," << pose.translation.y() << "," << pose.angle << '\n';
   }
@@ -115,7 +141,7 @@ void PublishMap()
   vis_msg_.header.stamp = ros::Time::now();
   ClearVisualizationMsg(vis_msg_);
 
-  const vector<Vector2f> map = slam_.GetMap();
+  const vector<Vector2f> map = slam_->GetMap();
   // printf("Map: %lu points\n", map.size());
   for (const Vector2f &p : map)
   {
@@ -124,7 +150,7 @@ void PublishMap()
 }
 void PublishTrajectory() {
   
-  std::vector<slam::PgNode> pg_nodes_ = slam_.GetPgNodes();
+  std::vector<slam::PgNode> pg_nodes_ = slam_->GetPgNodes();
   for (size_t i = 0; i < pg_nodes_.size(); i++) {
       
       pose_2d::Pose2Df cur_point = pg_nodes_[i].getEstimatedPose();
@@ -145,7 +171,7 @@ void PublishPose()
 {
   Vector2f robot_loc(0, 0);
   float robot_angle(0);
-  slam_.GetPose(&robot_loc, &robot_angle);
+  slam_->GetPose(&robot_loc, &robot_angle);
   amrl_msgs::Localization2DMsg localization_msg;
   localization_msg.pose.x = robot_loc.x();
   localization_msg.pose.y = robot_loc.y();
@@ -162,8 +188,9 @@ void LaserCallback(const sensor_msgs::LaserScan &msg)
   {
     printf("Laser t=%f\n", msg.header.stamp.toSec());
   }
+  static bool first_scan_processed = false;
   last_laser_msg_ = msg;
-  slam_.ObserveLaser(
+  slam_->ObserveLaser(
       msg.ranges,
       msg.range_min,
       msg.range_max,
@@ -173,6 +200,11 @@ void LaserCallback(const sensor_msgs::LaserScan &msg)
   PublishPose();
   PublishTrajectory();
   visualization_publisher_.publish(vis_msg_);
+  if (!first_scan_processed) {
+    first_scan_processed = true;
+    ROS_INFO("Time from process start to first processed scan: %.1f ms",
+             1000.0 * (GetMonotonicTime() - t_process_start_));
+  }
 }
 
 void OdometryCallback(const nav_msgs::Odometry &msg)
@@ -184,84 +216,105 @@ void OdometryCallback(const nav_msgs::Odometry &msg)
   const Vector2f odom_loc(msg.pose.pose.position.x, msg.pose.pose.position.y);
   const float odom_angle =
       2.0 * atan2(msg.pose.pose.orientation.z, msg.pose.pose.orientation.w);
-  slam_.ObserveOdometry(odom_loc, odom_angle);
+  slam_->ObserveOdometry(odom_loc, odom_angle);
 }
 
-int gtsam_test(int argc, char** argv) {
+// Optimize the Pose2 loop from the GTSAM examples and check that it converges
+// to the known solution. Only prints the graph and results with -v > 1.
+bool GtsamSelfCheck() {
   using namespace gtsam;
-  // 1. Create a factor graph container and add factors to it
+  const bool verbose = FLAGS_v > 1;
   NonlinearFactorGraph graph;
-
-  // 2a. Add a prior on the first pose, setting it to the origin
-  // A prior factor consists of a mean and a noise model (covariance matrix)
   auto priorNoise = noiseModel::Diagonal::Sigmas(gtsam::Vector3(0.3, 0.3, 0.1));
   graph.add(PriorFactor<Pose2>(1, Pose2(0, 0, 0), priorNoise));
 
-  // For simplicity, we will use the same noise model for odometry and loop closures
   auto model = noiseModel::Diagonal::Sigmas(gtsam::Vector3(0.2, 0.2, 0.1));
-
-  // 2b. Add odometry factors
-  // Create odometry (Between) factors between consecutive poses
   graph.emplace_shared<BetweenFactor<Pose2> >(1, 2, Pose2(2, 0, 0), model);
   graph.emplace_shared<BetweenFactor<Pose2> >(2, 3, Pose2(2, 0, M_PI_2), model);
   graph.emplace_shared<BetweenFactor<Pose2> >(3, 4, Pose2(2, 0, M_PI_2), model);
   graph.emplace_shared<BetweenFactor<Pose2> >(4, 5, Pose2(2, 0, M_PI_2), model);
-
-  // 2c. Add the loop closure constraint
-  // This factor encodes the fact that we have returned to the same pose. In real systems,
-  // these constraints may be identified in many ways, such as appearance-based techniques
-  // with camera images. We will use another Between Factor to enforce this constraint:
+  // Loop closure.
   graph.emplace_shared<BetweenFactor<Pose2> >(5, 2, Pose2(2, 0, M_PI_2), model);
-  graph.print("\nFactor Graph:\n");  // print
 
-  // 3. Create the data structure to hold the initialEstimate estimate to the solution
-  // For illustrative purposes, these have been deliberately set to incorrect values
+  // Deliberately perturbed initial estimate.
   Values initialEstimate;
   initialEstimate.insert(1, Pose2(0.5, 0.0, 0.2));
   initialEstimate.insert(2, Pose2(2.3, 0.1, -0.2));
   initialEstimate.insert(3, Pose2(4.1, 0.1, M_PI_2));
   initialEstimate.insert(4, Pose2(4.0, 2.0, M_PI));
   initialEstimate.insert(5, Pose2(2.1, 2.1, -M_PI_2));
-  initialEstimate.print("\nInitial Estimate:\n");  // print
+  if (verbose) {
+    graph.print("\nFactor Graph:\n");
+    initialEstimate.print("\nInitial Estimate:\n");
+  }
 
-  // 4. Optimize the initial values using a Gauss-Newton nonlinear optimizer
-  // The optimizer accepts an optional set of configuration parameters,
-  // controlling things like convergence criteria, the type of linear
-  // system solver to use, and the amount of information displayed during
-  // optimization. We will set a few parameters as a demonstration.
   GaussNewtonParams parameters;
-  // Stop iterating once the change in error between steps is less than this value
   parameters.relativeErrorTol = 1e-5;
-  // Do not perform more than N iteration steps
   parameters.maxIterations = 100;
-  parameters.verbosity = GaussNewtonParams::Verbosity::VALUES;
-  // Create the optimizer ...
-  ROS_ERROR_STREAM("Optimizing");
+  parameters.verbosity = verbose ? GaussNewtonParams::Verbosity::VALUES
+                                 : GaussNewtonParams::Verbosity::SILENT;
   gtsam::GaussNewtonOptimizer optimizer(graph, initialEstimate, parameters);
-  // ... and optimize
-  gtsam::Values result = optimizer.optimize();
-  result.print("Final Result:\n");
+  const gtsam::Values result = optimizer.optimize();
 
-  // 5. Calculate and print marginal covariances for all variables
-  cout.precision(3);
+  // Also exercises the linear solver used for marginals.
   gtsam::Marginals marginals(graph, result);
-  cout << "x1 covariance:\n" << marginals.marginalCovariance(1) << endl;
-  cout << "x2 covariance:\n" << marginals.marginalCovariance(2) << endl;
-  cout << "x3 covariance:\n" << marginals.marginalCovariance(3) << endl;
-  cout << "x4 covariance:\n" << marginals.marginalCovariance(4) << endl;
-  cout << "x5 covariance:\n" << marginals.marginalCovariance(5) << endl;
-
-  return 0;
+  const gtsam::Matrix x5_covariance = marginals.marginalCovariance(5);
+  if (verbose) {
+    result.print("Final Result:\n");
+    std::cout << "x5 covariance:\n" << x5_covariance << std::endl;
+  }
+  return result.at<Pose2>(5).equals(Pose2(2, 2, -M_PI_2), 1e-3) &&
+      x5_covariance.allFinite();
 }
 
 void StopSlamCallback(const std_msgs::Empty &msg) {
+    if (stop_pending_) {
+      return;
+    }
     ROS_INFO_STREAM("StopSlam topic recieved!");
     // write node pose before optimization
     ROS_INFO_STREAM("Dump optim_before.csv");
     writeNodePose("optim_before.csv");
-    slam_.stop_frontend();
+    // Returns right away; FinishStopSlam() runs once the optimization is done.
+    slam_->stop_frontend();
+    stop_pending_ = true;
+}
+
+void PublishOfflineProgress()
+{
+  static double t_last = 0;
+  if (GetMonotonicTime() - t_last < 1.0)
+  {
+    return;
+  }
+  t_last = GetMonotonicTime();
+  const slam::OfflineProgress progress = slam_->GetOfflineProgress();
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "Offline optimization: %lu/%lu nodes, %lu scan matches, "
+           "%lu constraints, %.0fs elapsed, ~%.0fs left",
+           progress.nodes_matched, progress.nodes_total,
+           progress.scan_matches, progress.constraints,
+           progress.elapsed, progress.eta);
+  std_msgs::String msg;
+  msg.data = buffer;
+  offline_progress_publisher_.publish(msg);
+  ROS_INFO_STREAM(msg.data);
+
+  // The intermediate estimate.
+  PublishMap();
+  PublishTrajectory();
+  visualization_publisher_.publish(vis_msg_);
+}
+
+void FinishStopSlam() {
+    stop_pending_ = false;
     ROS_INFO_STREAM("Dump optim_after.csv");
     writeNodePose("optim_after.csv");
+    if (!FLAGS_save_pose_graph_file.empty() &&
+        slam_->SavePoseGraph(FLAGS_save_pose_graph_file)) {
+      ROS_INFO_STREAM("Saved pose graph to " << FLAGS_save_pose_graph_file);
+    }
     stopSlamComplete_publisher_.publish(std_msgs::Empty());
 
     // draw new results after optimization
@@ -274,16 +327,43 @@ void StopSlamCallback(const std_msgs::Empty &msg) {
 int main(int argc, char **argv)
 {
   google::ParseCommandLineFlags(&argc, &argv, false);
-  
-  // TODO remove this
-  ROS_INFO_STREAM("Running GTSAM demo to verify install");
-  ROS_INFO_STREAM(gtsam_test(argc, argv));
+  runtime_config::Initialize();
+  if (FLAGS_memory_report_period > 0) {
+    memory_accounting::StartPeriodicReports(FLAGS_memory_report_period);
+  }
 
   // Initialize ROS.
   ros::init(argc, argv, "slam");
   ros::NodeHandle n;
   InitializeMsgs();
 
+  if (FLAGS_self_check) {
+    const double t_start = GetMonotonicTime();
+    if (!GtsamSelfCheck()) {
+      ROS_FATAL_STREAM("GTSAM self-check failed");
+      return 1;
+    }
+    ROS_INFO("GTSAM self-check passed in %.1f ms",
+             1000.0 * (GetMonotonicTime() - t_start));
+  }
+
+  // Load config from file. Must outlive slam_, which reads the config values.
+  config_reader::ConfigReader config_reader({FLAGS_config_file});
+  slam::SLAM slam;
+  slam_ = &slam;
+  if (!FLAGS_pose_graph_file.empty()) {
+    const double t_start = GetMonotonicTime();
+    if (!slam.LoadPoseGraph(FLAGS_pose_graph_file)) {
+      ROS_FATAL_STREAM("Failed to load pose graph " << FLAGS_pose_graph_file);
+      return 1;
+    }
+    ROS_INFO("Loaded %lu nodes from %s in %.1f ms",
+             slam.GetPgNodes().size(), FLAGS_pose_graph_file.c_str(),
+             1000.0 * (GetMonotonicTime() - t_start));
+  }
+  ROS_INFO("Startup took %.1f ms",
+           1000.0 * (GetMonotonicTime() - t_process_start_));
+
   visualization_publisher_ =
       n.advertise<VisualizationMsg>("visualization", 1);
   localization_publisher_ =
@@ -303,7 +383,34 @@ int main(int argc, char **argv)
           FLAGS_stop_slam_topic.c_str(),
           1,
           StopSlamCallback);
-  ros::spin();
+  offline_progress_publisher_ =
+      n.advertise<std_msgs::String>("slam_offline_progress", 1, true);
+
+  slam.SetOfflineCheckpointFile(FLAGS_offline_checkpoint_file);
+  if (FLAGS_resume_offline_checkpoint) {
+    if (!slam.LoadOfflineCheckpoint(FLAGS_offline_checkpoint_file)) {
+      ROS_FATAL_STREAM("Failed to load checkpoint "
+                       << FLAGS_offline_checkpoint_file);
+      return 1;
+    }
+    slam.stop_frontend();
+    stop_pending_ = true;
+  }
+
+  // The offline optimization runs in the background; keep handling messages
+  // and report its progress until it is done.
+  while (ros::ok()) {
+    ros::spinOnce();
+    if (stop_pending_) {
+      if (slam.GetOfflineProgress().running) {
+        PublishOfflineProgress();
+      } else {
+        slam.WaitForOfflineOptimization();
+        FinishStopSlam();
+      }
+    }
+    ros::Duration(0.01).sleep();
+  }
 
   return 0;
 }
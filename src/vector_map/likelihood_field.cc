@@ -0,0 +1,82 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    likelihood_field.cc
+\brief   Distance-to-nearest-line grid for vector maps.
+*/
+//========================================================================
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#include "shared/math/distance_transform.h"
+#include "shared/math/line2d.h"
+#include "vector_map/likelihood_field.h"
+
+using Eigen::Vector2f;
+using geometry::line2f;
+using std::vector;
+
+namespace vector_map {
+
+void LikelihoodField::Build(const VectorMap& map,
+                            float resolution,
+                            float max_distance) {
+  resolution_ = resolution;
+  max_distance_ = max_distance;
+  distances_.clear();
+  width_ = height_ = 0;
+  if (map.lines.empty()) return;
+
+  Vector2f map_min = map.lines[0].p0;
+  Vector2f map_max = map.lines[0].p0;
+  for (const line2f& l : map.lines) {
+    map_min = map_min.cwiseMin(l.p0).cwiseMin(l.p1);
+    map_max = map_max.cwiseMax(l.p0).cwiseMax(l.p1);
+  }
+  origin_ = map_min - Vector2f(max_distance, max_distance);
+  width_ = std::ceil((map_max.x() - map_min.x() + 2 * max_distance) /
+      resolution) + 1;
+  height_ = std::ceil((map_max.y() - map_min.y() + 2 * max_distance) /
+      resolution) + 1;
+
+  // Rasterize the lines, sampling at half the cell size.
+  const float kInf = std::numeric_limits<float>::infinity();
+  vector<float> sq_dist(width_ * height_, kInf);
+  for (const line2f& l : map.lines) {
+    const int num_samples = std::ceil(l.Length() / (0.5 * resolution)) + 1;
+    for (int i = 0; i < num_samples; ++i) {
+      const float t = (num_samples > 1) ?
+          static_cast<float>(i) / (num_samples - 1) : 0;
+      const Vector2f p = l.p0 + t * (l.p1 - l.p0);
+      const int x = std::floor((p.x() - origin_.x()) / resolution);
+      const int y = std::floor((p.y() - origin_.y()) / resolution);
+      sq_dist[y * width_ + x] = 0;
+    }
+  }
+
+  distance_transform::SquaredEuclidean(&sq_dist, width_, height_);
+
+  distances_.resize(sq_dist.size());
+  for (size_t i = 0; i < sq_dist.size(); ++i) {
+    distances_[i] = std::min(max_distance, resolution * std::sqrt(sq_dist[i]));
+  }
+}
+
+}  // namespace vector_map
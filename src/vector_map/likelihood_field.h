@@ -0,0 +1,77 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    likelihood_field.h
+\brief   Distance-to-nearest-line grid for vector maps.
+*/
+//========================================================================
+
+#include <cmath>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#include "vector_map/vector_map.h"
+
+#ifndef LIKELIHOOD_FIELD_H
+#define LIKELIHOOD_FIELD_H
+
+namespace vector_map {
+
+// Distance from every cell of a grid covering the map to the nearest map
+// line, for likelihood field observation models.
+class LikelihoodField {
+ public:
+  LikelihoodField() :
+      resolution_(1), max_distance_(0), width_(0), height_(0) {}
+
+  // Build the field for map, with cells of size resolution. Distances are
+  // clamped to max_distance, and the grid extends max_distance beyond the
+  // map's bounding box.
+  void Build(const VectorMap& map, float resolution, float max_distance);
+
+  bool Empty() const { return distances_.empty(); }
+
+  // Distance from p to the nearest map line, clamped to max_distance. Points
+  // outside the grid are max_distance away.
+  float Distance(const Eigen::Vector2f& p) const {
+    const int x = static_cast<int>(std::floor((p.x() - origin_.x()) / resolution_));
+    const int y = static_cast<int>(std::floor((p.y() - origin_.y()) / resolution_));
+    if (x < 0 || y < 0 || x >= width_ || y >= height_) return max_distance_;
+    return distances_[y * width_ + x];
+  }
+
+  // Corners of the area covered by the grid.
+  Eigen::Vector2f Min() const { return origin_; }
+  Eigen::Vector2f Max() const {
+    return origin_ + resolution_ * Eigen::Vector2f(width_, height_);
+  }
+
+  float Resolution() const { return resolution_; }
+  float MaxDistance() const { return max_distance_; }
+
+ private:
+  float resolution_;
+  float max_distance_;
+  Eigen::Vector2f origin_;
+  int width_;
+  int height_;
+  // Row-major, width_ x height_.
+  std::vector<float> distances_;
+};
+
+}  // namespace vector_map
+
+#endif  // LIKELIHOOD_FIELD_H
@@ -0,0 +1,137 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    line_grid.cc
+\brief   Uniform grid spatial index over line segments.
+*/
+//========================================================================
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#include "shared/math/geometry.h"
+#include "shared/math/line2d.h"
+#include "vector_map/line_grid.h"
+
+using Eigen::Vector2f;
+using geometry::line2f;
+using std::vector;
+
+namespace vector_map {
+
+void LineGrid::Build(const vector<line2f>& lines, float cell_size) {
+  lines_ = lines;
+  cell_size_ = cell_size;
+  width_ = height_ = 0;
+  cell_start_.clear();
+  cell_lines_.clear();
+  if (lines_.empty()) return;
+
+  Vector2f map_min = lines_[0].p0;
+  Vector2f map_max = lines_[0].p0;
+  for (const line2f& l : lines_) {
+    map_min = map_min.cwiseMin(l.p0).cwiseMin(l.p1);
+    map_max = map_max.cwiseMax(l.p0).cwiseMax(l.p1);
+  }
+  origin_ = map_min;
+  width_ = std::floor((map_max.x() - map_min.x()) / cell_size) + 1;
+  height_ = std::floor((map_max.y() - map_min.y()) / cell_size) + 1;
+
+  // A line is in a cell if it passes within the cell's circumscribed circle.
+  const float radius = 0.5 * M_SQRT2 * cell_size;
+  vector<vector<int>> cells(width_ * height_);
+  for (size_t i = 0; i < lines_.size(); ++i) {
+    const line2f& l = lines_[i];
+    int x0, y0, x1, y1;
+    CellRange(l.p0.cwiseMin(l.p1), l.p0.cwiseMax(l.p1), &x0, &y0, &x1, &y1);
+    for (int y = y0; y <= y1; ++y) {
+      for (int x = x0; x <= x1; ++x) {
+        const Vector2f center =
+            origin_ + cell_size * Vector2f(x + 0.5, y + 0.5);
+        const Vector2f closest =
+            geometry::ProjectPointOntoLineSegment(center, l.p0, l.p1);
+        if ((closest - center).squaredNorm() <= radius * radius) {
+          cells[y * width_ + x].push_back(i);
+        }
+      }
+    }
+  }
+
+  cell_start_.resize(cells.size() + 1);
+  cell_start_[0] = 0;
+  for (size_t i = 0; i < cells.size(); ++i) {
+    cell_start_[i + 1] = cell_start_[i] + cells[i].size();
+  }
+  cell_lines_.reserve(cell_start_.back());
+  for (const vector<int>& cell : cells) {
+    cell_lines_.insert(cell_lines_.end(), cell.begin(), cell.end());
+  }
+}
+
+bool LineGrid::CellRange(const Vector2f& box_min,
+                         const Vector2f& box_max,
+                         int* x0, int* y0, int* x1, int* y1) const {
+  *x0 = std::max<int>(0, std::floor((box_min.x() - origin_.x()) / cell_size_));
+  *y0 = std::max<int>(0, std::floor((box_min.y() - origin_.y()) / cell_size_));
+  *x1 = std::min<int>(
+      width_ - 1, std::floor((box_max.x() - origin_.x()) / cell_size_));
+  *y1 = std::min<int>(
+      height_ - 1, std::floor((box_max.y() - origin_.y()) / cell_size_));
+  return *x0 <= *x1 && *y0 <= *y1;
+}
+
+void LineGrid::GetCandidates(const Vector2f& box_min,
+                             const Vector2f& box_max,
+                             vector<int>* ids) const {
+  ids->clear();
+  int x0, y0, x1, y1;
+  if (width_ == 0 || !CellRange(box_min, box_max, &x0, &y0, &x1, &y1)) {
+    return;
+  }
+  for (int y = y0; y <= y1; ++y) {
+    for (int x = x0; x <= x1; ++x) {
+      const int cell = y * width_ + x;
+      ids->insert(ids->end(),
+                  cell_lines_.begin() + cell_start_[cell],
+                  cell_lines_.begin() + cell_start_[cell + 1]);
+    }
+  }
+  std::sort(ids->begin(), ids->end());
+  ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+}
+
+bool LineGrid::Intersects(const Vector2f& p0, const Vector2f& p1) const {
+  int x0, y0, x1, y1;
+  if (width_ == 0 ||
+      !CellRange(p0.cwiseMin(p1), p0.cwiseMax(p1), &x0, &y0, &x1, &y1)) {
+    return false;
+  }
+  // Lines spanning several cells may be tested more than once, which is
+  // cheaper than de-duplicating for the short segments this is used for.
+  for (int y = y0; y <= y1; ++y) {
+    for (int x = x0; x <= x1; ++x) {
+      const int cell = y * width_ + x;
+      for (int i = cell_start_[cell]; i < cell_start_[cell + 1]; ++i) {
+        if (lines_[cell_lines_[i]].Intersects(p0, p1)) return true;
+      }
+    }
+  }
+  return false;
+}
+
+}  // namespace vector_map
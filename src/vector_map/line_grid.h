@@ -0,0 +1,70 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    line_grid.h
+\brief   Uniform grid spatial index over line segments.
+*/
+//========================================================================
+
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#include "math/line2d.h"
+
+#ifndef LINE_GRID_H
+#define LINE_GRID_H
+
+namespace vector_map {
+
+// Buckets line segments into the cells of a uniform grid they pass through,
+// so that only the lines near a query have to be tested.
+class LineGrid {
+ public:
+  LineGrid() : cell_size_(1), width_(0), height_(0) {}
+
+  void Build(const std::vector<geometry::line2f>& lines, float cell_size);
+
+  const std::vector<geometry::line2f>& lines() const { return lines_; }
+
+  // Indices into lines() of the lines that may intersect the axis-aligned
+  // box [box_min, box_max], sorted and without duplicates.
+  void GetCandidates(const Eigen::Vector2f& box_min,
+                     const Eigen::Vector2f& box_max,
+                     std::vector<int>* ids) const;
+
+  // True if the segment p0-p1 intersects any of the lines.
+  bool Intersects(const Eigen::Vector2f& p0, const Eigen::Vector2f& p1) const;
+
+ private:
+  // Range of cells overlapping [box_min, box_max], clamped to the grid.
+  // Returns false if the box is outside the grid.
+  bool CellRange(const Eigen::Vector2f& box_min,
+                 const Eigen::Vector2f& box_max,
+                 int* x0, int* y0, int* x1, int* y1) const;
+
+  std::vector<geometry::line2f> lines_;
+  float cell_size_;
+  Eigen::Vector2f origin_;
+  int width_;
+  int height_;
+  // Lines of cell i are cell_lines_[cell_start_[i] .. cell_start_[i + 1]).
+  std::vector<int> cell_start_;
+  std::vector<int> cell_lines_;
+};
+
+}  // namespace vector_map
+
+#endif  // LINE_GRID_H
@@ -0,0 +1,61 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    map_context.cc
+\brief   Immutable map data shared between localizers.
+*/
+//========================================================================
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+#include "vector_map/map_context.h"
+
+using std::shared_ptr;
+using std::string;
+
+namespace vector_map {
+
+MapContext::MapContext(const string& file, const MapContextOptions& options) :
+    map_(file) {
+  line_grid_.Build(map_.lines, options.line_grid_cell_size);
+  likelihood_field_.Build(map_,
+                          options.likelihood_field_resolution,
+                          options.likelihood_field_max_dist);
+}
+
+shared_ptr<const MapContext> MapContext::Get(
+    const string& file, const MapContextOptions& options) {
+  typedef std::tuple<string, float, float, float> Key;
+  static std::mutex mutex;
+  static std::map<Key, std::weak_ptr<const MapContext>> contexts;
+
+  const Key key(file,
+                options.line_grid_cell_size,
+                options.likelihood_field_resolution,
+                options.likelihood_field_max_dist);
+  std::lock_guard<std::mutex> lock(mutex);
+  shared_ptr<const MapContext> context = contexts[key].lock();
+  if (!context) {
+    context.reset(new MapContext(file, options));
+    contexts[key] = context;
+  }
+  return context;
+}
+
+}  // namespace vector_map
@@ -0,0 +1,67 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    map_context.h
+\brief   Immutable map data shared between localizers.
+*/
+//========================================================================
+
+#include <memory>
+#include <string>
+
+#include "vector_map/likelihood_field.h"
+#include "vector_map/line_grid.h"
+#include "vector_map/vector_map.h"
+
+#ifndef MAP_CONTEXT_H
+#define MAP_CONTEXT_H
+
+namespace vector_map {
+
+struct MapContextOptions {
+  MapContextOptions() :
+      line_grid_cell_size(1.0),
+      likelihood_field_resolution(0.05),
+      likelihood_field_max_dist(1.0) {}
+  float line_grid_cell_size;
+  float likelihood_field_resolution;
+  float likelihood_field_max_dist;
+};
+
+// A vector map together with the structures derived from it. A context never
+// changes once built, so it can be used from any number of threads, and all
+// users of the same map file (and options) share one instance.
+class MapContext {
+ public:
+  // The context for file, loaded and built if no one holds it yet. It is
+  // freed when the last reference is dropped. Thread-safe.
+  static std::shared_ptr<const MapContext> Get(
+      const std::string& file, const MapContextOptions& options);
+
+  const VectorMap& map() const { return map_; }
+  const LineGrid& line_grid() const { return line_grid_; }
+  const LikelihoodField& likelihood_field() const { return likelihood_field_; }
+
+ private:
+  MapContext(const std::string& file, const MapContextOptions& options);
+
+  VectorMap map_;
+  LineGrid line_grid_;
+  LikelihoodField likelihood_field_;
+};
+
+}  // namespace vector_map
+
+#endif  // MAP_CONTEXT_H
@@ -29,6 +29,7 @@
 #include "eigen3/Eigen/Geometry"
 #include "gflags/gflags.h"
 
+#include "shared/math/fast_math.h"
 #include "shared/math/geometry.h"
 #include "shared/math/line2d.h"
 #include "shared/math/math_util.h"
@@ -421,8 +422,8 @@ void VectorMap::GetPredictedScan(const Vector2f& loc,
     LineCast l;
     l.line.p0 = r.p0 - loc;
     l.line.p1 = r.p1 - loc;
-    l.a0 = atan2(l.line.p0.y(), l.line.p0.x());
-    l.a1 = atan2(l.line.p1.y(), l.line.p1.x());
+    l.a0 = fast_math::FastAtan2(l.line.p0.y(), l.line.p0.x());
+    l.a1 = fast_math::FastAtan2(l.line.p1.y(), l.line.p1.x());
     if (fabs(l.a0 - l.a1) < 0.0001) continue;
     l.wraps_around = fabs(l.a1 - l.a0) > M_PI;
     if ((l.wraps_around && l.a0 < l.a1) ||
@@ -444,7 +445,8 @@ void VectorMap::GetPredictedScan(const Vector2f& loc,
       if ((!l.wraps_around && l.a0 <= a && l.a1 >= a) ||
           (l.wraps_around && (l.a0 <= a || l.a1 >= a))) {
         const Vector2f n = l.line.UnitNormal();
-        const Vector2f r(cos(a), sin(a));
+        Vector2f r;
+        fast_math::FastSinCos(a, &r.y(), &r.x());
         scan[i] = n.dot(l.line.p0) / n.dot(r);
         break;
       }